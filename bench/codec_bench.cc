@@ -0,0 +1,255 @@
+// Copyright [2021] zhangke
+// ProxyMessage编解码的微基准, 覆盖所有带body的消息类型和64B~1MB的数据长度,
+// 统计每帧耗时, 吞吐和每帧的内存分配次数
+// ERROR/ECHO_REQUEST/ECHO_RESPONSE没有body, 不随数据长度变化, 不单独统计
+
+#include <muduo/net/Buffer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "common/alloc_stats.h"
+#include "common/proto.h"
+
+// 打开PROXY_ALLOC_STATS时使用common中的分配统计, 否则在这里替换operator new
+#ifndef PROXY_ALLOC_STATS
+namespace {
+
+std::atomic<uint64_t> g_alloc_count(0);
+std::atomic<uint64_t> g_alloc_bytes(0);
+
+}  // namespace
+
+// 统计全部通过operator new的分配, 包括std::string和make_shared
+void *operator new(size_t size) {
+  g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+  g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  void *ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+AllocCounter TotalAllocs() {
+  AllocCounter counter;
+  counter.count = g_alloc_count.load(std::memory_order_relaxed);
+  counter.bytes = g_alloc_bytes.load(std::memory_order_relaxed);
+  return counter;
+}
+#else
+AllocCounter TotalAllocs() { return AllocStats::Snapshot().Total(); }
+#endif
+
+namespace {
+
+struct CodecOptions {
+  // 每个用例至少运行的时间
+  double duration = 0.2;
+  // 只运行指定的消息类型, 0表示全部
+  uint16_t message_type = 0;
+  size_t min_size = 64;
+  size_t max_size = 1024 * 1024;
+};
+
+struct CaseResult {
+  uint64_t frames = 0;
+  uint64_t bytes = 0;
+  uint64_t allocs = 0;
+  uint64_t alloc_bytes = 0;
+  double seconds = 0;
+};
+
+// 防止编解码结果被优化掉
+volatile size_t g_sink = 0;
+
+const char *MessageTypeName(uint16_t message_type) {
+  switch (message_type) {
+    case PROTOBUF_MESSAGE:
+      return "PROTOBUF_MESSAGE";
+    case PROTOBUF_RESPONSE:
+      return "PROTOBUF_RESPONSE";
+    case DATA_REQUEST:
+      return "DATA_REQUEST";
+    case DATA_RESPONSE:
+      return "DATA_RESPONSE";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// 和MessageDispatch发送时一样, body在栈上, 编码完成后从head上摘下来
+class FrameBuilder {
+ public:
+  FrameBuilder(uint16_t message_type, size_t payload_size)
+      : payload_(payload_size, 'x') {
+    head_.message_type = message_type;
+    head_.request_id = 1;
+    switch (message_type) {
+      case PROTOBUF_MESSAGE:
+      case PROTOBUF_RESPONSE: {
+        pb_body_.length = payload_.length();
+        pb_body_.data = payload_;
+        head_.body = &pb_body_;
+        break;
+      }
+      case DATA_REQUEST: {
+        data_request_.length = payload_.length();
+        data_request_.conn_key = 0x1234567890ULL;
+        data_request_.data = payload_;
+        head_.body = &data_request_;
+        break;
+      }
+      case DATA_RESPONSE: {
+        data_response_.length = payload_.length();
+        data_response_.retcode = 0;
+        data_response_.data = payload_;
+        head_.body = &data_response_;
+        break;
+      }
+      default:
+        break;
+    }
+    head_.length = head_.body ? head_.body->Size() : 0;
+  }
+  ~FrameBuilder() { head_.body = nullptr; }
+  std::string Encode() const { return head_.ToString(); }
+
+ private:
+  std::string payload_;
+  PbRequestBody pb_body_;
+  DataRequestBody data_request_;
+  DataResponseBody data_response_;
+  ProxyMessage head_;
+};
+
+template <typename Func>
+CaseResult RunCase(const CodecOptions &options, size_t frame_size, Func func) {
+  typedef std::chrono::steady_clock Clock;
+  CaseResult result;
+  // 先预热一次, 排除首次分配的影响
+  func();
+  // 每批次的帧数随帧长度减少, 减少读时钟的开销
+  uint64_t batch = std::max<uint64_t>(1, (1 << 20) / frame_size);
+  AllocCounter alloc_start = TotalAllocs();
+  Clock::time_point start = Clock::now();
+  for (;;) {
+    for (uint64_t i = 0; i < batch; ++i) {
+      func();
+    }
+    result.frames += batch;
+    result.seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (result.seconds >= options.duration) {
+      break;
+    }
+  }
+  AllocCounter alloc_end = TotalAllocs();
+  result.allocs = alloc_end.count - alloc_start.count;
+  result.alloc_bytes = alloc_end.bytes - alloc_start.bytes;
+  result.bytes = result.frames * frame_size;
+  return result;
+}
+
+void PrintResult(const char *op, uint16_t message_type, size_t payload_size,
+                 const CaseResult &result) {
+  printf("%-18s %-6s %8zu %10.1f %10.1f %10.2f %12.1f\n",
+         MessageTypeName(message_type), op, payload_size,
+         result.seconds * 1e9 / result.frames,
+         result.bytes / result.seconds / (1024 * 1024),
+         static_cast<double>(result.allocs) / result.frames,
+         static_cast<double>(result.alloc_bytes) / result.frames);
+}
+
+void RunMessageType(const CodecOptions &options, uint16_t message_type) {
+  for (size_t size = options.min_size; size <= options.max_size; size *= 4) {
+    FrameBuilder builder(message_type, size);
+    std::string frame = builder.Encode();
+    CaseResult encode = RunCase(options, frame.size(), [&builder] {
+      std::string encoded = builder.Encode();
+      g_sink = g_sink + encoded.size();
+    });
+    PrintResult("encode", message_type, size, encode);
+
+    // 解码和MessageDispatch::OnMessage一样, 从Buffer中解析后retrieve
+    muduo::net::Buffer buffer;
+    CaseResult decode = RunCase(options, frame.size(), [&buffer, &frame] {
+      buffer.append(frame.data(), frame.size());
+      ProxyMessagePtr message(std::make_shared<ProxyMessage>());
+      if (!message->ParseFromBuffer(&buffer)) {
+        abort();
+      }
+      buffer.retrieve(message->Size());
+      g_sink = g_sink + message->length;
+    });
+    PrintResult("decode", message_type, size, decode);
+  }
+}
+
+void PrintUsage(const char *command) {
+  std::cout << "Usage:" << command << " -d seconds_per_case"
+            << " -m message_type(3~6, default all)"
+            << " -s min_payload_size"
+            << " -S max_payload_size"
+            << " -h help" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  CodecOptions options;
+  int ch = 0;
+  while ((ch = getopt(argc, argv, "d:m:s:S:h")) != -1) {
+    switch (ch) {
+      case 'd':
+        options.duration = atof(optarg);
+        break;
+      case 'm':
+        options.message_type = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 's':
+        options.min_size = static_cast<size_t>(atol(optarg));
+        break;
+      case 'S':
+        options.max_size = static_cast<size_t>(atol(optarg));
+        break;
+      case 'h':
+      default:
+        PrintUsage(argv[0]);
+        exit(0);
+        break;
+    }
+  }
+  if (options.duration <= 0 || options.min_size == 0 ||
+      options.min_size > options.max_size ||
+      (options.message_type != 0 &&
+       (options.message_type < PROTOBUF_MESSAGE ||
+        options.message_type > DATA_RESPONSE))) {
+    std::cout << "invalid parameter" << std::endl;
+    PrintUsage(argv[0]);
+    exit(-1);
+  }
+  printf("%-18s %-6s %8s %10s %10s %10s %12s\n", "message_type", "op",
+         "payload", "ns/frame", "MB/s", "allocs", "alloc_bytes");
+  const uint16_t message_types[] = {PROTOBUF_MESSAGE, PROTOBUF_RESPONSE,
+                                    DATA_REQUEST, DATA_RESPONSE};
+  for (uint16_t message_type : message_types) {
+    if (options.message_type == 0 || options.message_type == message_type) {
+      RunMessageType(options, message_type);
+    }
+  }
+  return 0;
+}
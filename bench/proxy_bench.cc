@@ -0,0 +1,686 @@
+// Copyright [2021] zhangke
+// 在本机回环地址上启动proxy_server, proxy_client, 后端服务和压测客户端,
+// 统计吞吐, 每秒消息数和请求延迟, churn模式统计每秒建立的连接数
+
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/base/Logging.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/EventLoopThread.h>
+#include <muduo/net/EventLoopThreadPool.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpClient.h>
+#include <muduo/net/TcpServer.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench/wan_relay.h"
+#include "client/proxy_client.h"
+#include "common/alloc_stats.h"
+#include "server/proxy_server.h"
+
+struct BenchOptions {
+  // echo: 请求响应模式, 统计延迟; sink: 单向发送, 统计吞吐
+  // churn: 短连接, 每个连接一次请求响应后关闭
+  std::string mode = "echo";
+  // churn模式每秒新建连接数
+  double rate = 1000;
+  // churn模式同时存在的最大连接数
+  size_t max_inflight = 1000;
+  int streams = 16;
+  size_t message_size = 4096;
+  double duration = 10.0;
+  // echo模式每条连接发送的消息数, 0表示按duration运行
+  // 前1/10用于预热, 分配统计只包括之后的消息
+  uint64_t message_count = 0;
+  // ProxyClient后端连接io线程数
+  int io_threads = 2;
+  // 后端服务和压测客户端线程数
+  int bench_threads = 2;
+  // echo模式每个转发块允许的平均分配次数, 0表示不检查
+  // 需要PROXY_ALLOC_STATS编译, 超出时以3退出
+  double alloc_budget = 0;
+  uint16_t server_port = 19000;
+  uint16_t transfer_port = 19001;
+  uint16_t backend_port = 19002;
+  // 设置-w时proxy_client经过wan_relay连接proxy_server
+  bool use_wan = false;
+  WanOptions wan;
+  uint16_t relay_port = 19003;
+};
+
+struct BenchResult {
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  std::vector<uint32_t> latencies_us;
+  // churn模式未收到完整响应就断开的连接数
+  uint64_t failed = 0;
+  // churn模式超过max_inflight没有建立的连接数
+  uint64_t skipped = 0;
+};
+
+// 在loop中执行并等待完成
+void RunInLoopSync(muduo::net::EventLoop *loop, std::function<void()> cb) {
+  muduo::CountDownLatch latch(1);
+  loop->runInLoop([&] {
+    cb();
+    latch.countDown();
+  });
+  latch.wait();
+}
+
+// 后端服务, echo模式原样返回, sink模式丢弃
+class BenchBackend {
+ public:
+  BenchBackend(muduo::net::EventLoop *loop, const BenchOptions &options)
+      : server_(loop,
+                muduo::net::InetAddress("127.0.0.1", options.backend_port),
+                "bench_backend"),
+        echo_(options.mode == "echo"),
+        received_bytes_(0) {
+    server_.setThreadNum(options.bench_threads);
+    server_.setMessageCallback(
+        std::bind(&BenchBackend::OnMessage, this, std::placeholders::_1,
+                  std::placeholders::_2, std::placeholders::_3));
+  }
+  void Start() { server_.start(); }
+  uint64_t ReceivedBytes() const { return received_bytes_; }
+
+ private:
+  void OnMessage(const muduo::net::TcpConnectionPtr &conn,
+                 muduo::net::Buffer *buffer, muduo::Timestamp) {
+    received_bytes_ += buffer->readableBytes();
+    if (echo_) {
+      conn->send(buffer);
+    } else {
+      buffer->retrieveAll();
+    }
+  }
+
+  muduo::net::TcpServer server_;
+  bool echo_;
+  std::atomic<uint64_t> received_bytes_;
+};
+
+// 一条压测连接, 所有操作都在loop_中
+class BenchStream : public std::enable_shared_from_this<BenchStream> {
+ public:
+  BenchStream(muduo::net::EventLoop *loop,
+              const muduo::net::InetAddress &proxy_address,
+              const BenchOptions &options, const std::string &message)
+      : loop_(loop),
+        options_(options),
+        message_(message),
+        client_(loop, proxy_address, "bench_stream"),
+        echo_(options.mode == "echo"),
+        running_(false),
+        limit_(0),
+        pending_bytes_(0) {}
+  void Start() {
+    running_ = true;
+    client_.setConnectionCallback(std::bind(
+        &BenchStream::OnConnection, shared_from_this(), std::placeholders::_1));
+    client_.setMessageCallback(
+        std::bind(&BenchStream::OnMessage, shared_from_this(),
+                  std::placeholders::_1, std::placeholders::_2,
+                  std::placeholders::_3));
+    client_.setWriteCompleteCallback(std::bind(
+        &BenchStream::OnWriteComplete, shared_from_this(),
+        std::placeholders::_1));
+    client_.connect();
+  }
+  void Stop() { running_ = false; }
+  // -k模式完成limit条消息后停止发送, 没有等待中的请求时继续发送
+  void SetLimit(uint64_t limit) {
+    limit_ = limit;
+    muduo::net::TcpConnectionPtr conn = client_.connection();
+    if (conn && conn->connected() && pending_bytes_ == 0) {
+      SendMessage(conn);
+    }
+  }
+  muduo::net::EventLoop *GetLoop() const { return loop_; }
+  const BenchResult &Result() const { return result_; }
+
+ private:
+  void OnConnection(const muduo::net::TcpConnectionPtr &conn) {
+    if (conn->connected()) {
+      conn->setTcpNoDelay(true);
+      SendMessage(conn);
+    }
+  }
+  void OnMessage(const muduo::net::TcpConnectionPtr &conn,
+                 muduo::net::Buffer *buffer, muduo::Timestamp) {
+    size_t length = buffer->readableBytes();
+    buffer->retrieveAll();
+    if (!echo_) {
+      return;
+    }
+    result_.bytes += length;
+    pending_bytes_ -= std::min(pending_bytes_, length);
+    if (pending_bytes_ == 0) {
+      ++result_.messages;
+      result_.latencies_us.push_back(static_cast<uint32_t>(
+          muduo::Timestamp::now().microSecondsSinceEpoch() -
+          send_time_.microSecondsSinceEpoch()));
+      SendMessage(conn);
+    }
+  }
+  void OnWriteComplete(const muduo::net::TcpConnectionPtr &conn) {
+    if (!echo_) {
+      ++result_.messages;
+      result_.bytes += message_.size();
+      SendMessage(conn);
+    }
+  }
+  void SendMessage(const muduo::net::TcpConnectionPtr &conn) {
+    if (!running_ ||
+        (options_.message_count && result_.messages >= limit_)) {
+      return;
+    }
+    pending_bytes_ = message_.size();
+    send_time_ = muduo::Timestamp::now();
+    conn->send(message_.data(), static_cast<int>(message_.size()));
+  }
+
+  muduo::net::EventLoop *loop_;
+  const BenchOptions &options_;
+  const std::string &message_;
+  muduo::net::TcpClient client_;
+  bool echo_;
+  bool running_;
+  uint64_t limit_;
+  // echo模式当前请求还未收到的字节数
+  size_t pending_bytes_;
+  muduo::Timestamp send_time_;
+  BenchResult result_;
+};
+
+// churn模式按速率建立短连接, 发送一个请求, 收到完整响应后关闭
+// 延迟统计从发起连接到收到第一个响应字节
+class ChurnGenerator {
+ public:
+  ChurnGenerator(muduo::net::EventLoop *loop,
+                 const muduo::net::InetAddress &proxy_address,
+                 const BenchOptions &options, const std::string &message,
+                 double rate)
+      : loop_(loop),
+        proxy_address_(proxy_address),
+        options_(options),
+        message_(message),
+        rate_(rate),
+        credit_(0),
+        next_id_(0),
+        running_(false) {}
+  void Start() {
+    running_ = true;
+    timer_ = loop_->runEvery(0.001, std::bind(&ChurnGenerator::Tick, this));
+  }
+  void Stop() {
+    running_ = false;
+    loop_->cancel(timer_);
+  }
+  muduo::net::EventLoop *GetLoop() const { return loop_; }
+  size_t Inflight() const { return conns_.size(); }
+  const BenchResult &Result() const { return result_; }
+
+ private:
+  struct Churn {
+    std::unique_ptr<muduo::net::TcpClient> client;
+    muduo::Timestamp start_time;
+    size_t pending_bytes;
+    bool first_byte;
+  };
+
+  void Tick() {
+    credit_ += rate_ * 0.001;
+    while (running_ && credit_ >= 1) {
+      credit_ -= 1;
+      if (conns_.size() >= options_.max_inflight) {
+        ++result_.skipped;
+        continue;
+      }
+      Open();
+    }
+  }
+  void Open() {
+    uint64_t id = ++next_id_;
+    Churn &churn = conns_[id];
+    churn.client.reset(
+        new muduo::net::TcpClient(loop_, proxy_address_, "bench_churn"));
+    churn.client->setConnectionCallback(std::bind(
+        &ChurnGenerator::OnConnection, this, id, std::placeholders::_1));
+    churn.client->setMessageCallback(
+        std::bind(&ChurnGenerator::OnMessage, this, id, std::placeholders::_1,
+                  std::placeholders::_2, std::placeholders::_3));
+    churn.start_time = muduo::Timestamp::now();
+    churn.pending_bytes = message_.size();
+    churn.first_byte = true;
+    churn.client->connect();
+  }
+  void OnConnection(uint64_t id, const muduo::net::TcpConnectionPtr &conn) {
+    if (conn->connected()) {
+      conn->send(message_.data(), static_cast<int>(message_.size()));
+      return;
+    }
+    auto index = conns_.find(id);
+    if (index == conns_.end()) {
+      return;
+    }
+    if ((index->second).pending_bytes > 0) {
+      ++result_.failed;
+    }
+    // 不能在TcpClient的回调中析构
+    loop_->queueInLoop([this, id] { conns_.erase(id); });
+  }
+  void OnMessage(uint64_t id, const muduo::net::TcpConnectionPtr &conn,
+                 muduo::net::Buffer *buffer, muduo::Timestamp) {
+    size_t length = buffer->readableBytes();
+    buffer->retrieveAll();
+    Churn &churn = conns_[id];
+    if (churn.first_byte) {
+      churn.first_byte = false;
+      result_.latencies_us.push_back(static_cast<uint32_t>(
+          muduo::Timestamp::now().microSecondsSinceEpoch() -
+          churn.start_time.microSecondsSinceEpoch()));
+    }
+    result_.bytes += length;
+    churn.pending_bytes -= std::min(churn.pending_bytes, length);
+    if (churn.pending_bytes == 0) {
+      ++result_.messages;
+      conn->shutdown();
+    }
+  }
+
+  muduo::net::EventLoop *loop_;
+  muduo::net::InetAddress proxy_address_;
+  const BenchOptions &options_;
+  const std::string &message_;
+  double rate_;
+  double credit_;
+  uint64_t next_id_;
+  bool running_;
+  muduo::net::TimerId timer_;
+  std::map<uint64_t, Churn> conns_;
+  BenchResult result_;
+};
+
+uint32_t Percentile(const std::vector<uint32_t> &sorted, double percent) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(sorted.size() * percent / 100);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+void PrintLatency(const std::vector<uint32_t> &sorted) {
+  printf("latency(us): p50:%u p90:%u p99:%u p999:%u max:%u\n",
+         Percentile(sorted, 50), Percentile(sorted, 90),
+         Percentile(sorted, 99), Percentile(sorted, 99.9),
+         sorted.empty() ? 0 : sorted.back());
+}
+
+int RunChurn(const BenchOptions &options, muduo::net::EventLoop *base_loop,
+             muduo::net::EventLoopThreadPool *bench_pool,
+             const muduo::net::InetAddress &proxy_address,
+             const std::string &message, muduo::net::EventLoop *server_loop,
+             ProxyServer *proxy_server, muduo::net::EventLoop *client_loop,
+             ProxyClient *proxy_client) {
+  std::vector<muduo::net::EventLoop *> loops = bench_pool->getAllLoops();
+  std::vector<std::unique_ptr<ChurnGenerator>> generators;
+  for (muduo::net::EventLoop *loop : loops) {
+    generators.emplace_back(new ChurnGenerator(
+        loop, proxy_address, options, message, options.rate / loops.size()));
+    loop->runInLoop(
+        std::bind(&ChurnGenerator::Start, generators.back().get()));
+  }
+  muduo::Timestamp start_time = muduo::Timestamp::now();
+  base_loop->runAfter(options.duration, [=] { base_loop->quit(); });
+  base_loop->loop();
+  double elapsed = muduo::timeDifference(muduo::Timestamp::now(), start_time);
+  for (const auto &generator : generators) {
+    RunInLoopSync(generator->GetLoop(), [&] { generator->Stop(); });
+  }
+  // 等待未完成的连接结束, proxy两端释放连接状态
+  size_t inflight = 0, server_conns = 0, client_conns = 0;
+  for (int i = 0; i < 50; ++i) {
+    inflight = 0;
+    for (const auto &generator : generators) {
+      RunInLoopSync(generator->GetLoop(),
+                    [&] { inflight += generator->Inflight(); });
+    }
+    RunInLoopSync(server_loop,
+                  [&] { server_conns = proxy_server->ConnectionCount(); });
+    RunInLoopSync(client_loop,
+                  [&] { client_conns = proxy_client->ConnectionCount(); });
+    if (inflight == 0 && server_conns == 0 && client_conns == 0) {
+      break;
+    }
+    usleep(100 * 1000);
+  }
+  BenchResult total;
+  for (const auto &generator : generators) {
+    RunInLoopSync(generator->GetLoop(), [&] {
+      const BenchResult &result = generator->Result();
+      total.messages += result.messages;
+      total.failed += result.failed;
+      total.skipped += result.skipped;
+      total.latencies_us.insert(total.latencies_us.end(),
+                                result.latencies_us.begin(),
+                                result.latencies_us.end());
+    });
+  }
+  std::sort(total.latencies_us.begin(), total.latencies_us.end());
+  printf("mode:churn target_rate:%.0f/s message_size:%zu duration:%.2fs\n",
+         options.rate, options.message_size, elapsed);
+  if (options.use_wan) {
+    printf("wan: %s\n", options.wan.ToString().c_str());
+  }
+  printf("connections: %.0f/s completed:%llu failed:%llu skipped:%llu\n",
+         total.messages / elapsed,
+         static_cast<unsigned long long>(total.messages),
+         static_cast<unsigned long long>(total.failed),
+         static_cast<unsigned long long>(total.skipped));
+  PrintLatency(total.latencies_us);
+  printf("leaked: bench_inflight:%zu server_conn_map:%zu client_clients:%zu\n",
+         inflight, server_conns, client_conns);
+  fflush(stdout);
+  ::_exit(server_conns == 0 && client_conns == 0 ? 0 : 2);
+}
+
+// 当前所有压测连接完成的消息数, 在base_loop之外的线程调用
+uint64_t CollectMessages(
+    const std::vector<std::shared_ptr<BenchStream>> &streams) {
+  uint64_t messages = 0;
+  for (const auto &stream : streams) {
+    RunInLoopSync(stream->GetLoop(),
+                  [&] { messages += stream->Result().messages; });
+  }
+  return messages;
+}
+
+// -k模式让每条连接完成limit条消息, 等待全部完成
+// 再等待隧道上的DATA_RESPONSE处理完, 之后proxy两端没有转发中的数据
+void WaitStreams(const std::vector<std::shared_ptr<BenchStream>> &streams,
+                 uint64_t limit) {
+  for (const auto &stream : streams) {
+    RunInLoopSync(stream->GetLoop(), [&] { stream->SetLimit(limit); });
+  }
+  while (CollectMessages(streams) < limit * streams.size()) {
+    usleep(10 * 1000);
+  }
+  usleep(100 * 1000);
+}
+
+// proxy两端在隧道上发出的DATA_REQUEST帧数, 在base_loop之外的线程调用
+uint64_t CollectDataFrames(muduo::net::EventLoop *server_loop,
+                           ProxyServer *proxy_server,
+                           muduo::net::EventLoop *client_loop,
+                           ProxyClient *proxy_client) {
+  uint64_t frames = 0;
+  RunInLoopSync(server_loop, [&] { frames += proxy_server->DataFramesOut(); });
+  RunInLoopSync(client_loop, [&] { frames += proxy_client->DataFramesOut(); });
+  return frames;
+}
+
+// echo模式每条消息经过proxy转发两次(请求和响应), 每次记为一个转发块
+// 只统计打了子系统标签的分配, 压测程序自身的分配不计入
+bool CheckAllocBudget(const BenchOptions &options, const AllocSnapshot &diff,
+                      uint64_t messages) {
+  uint64_t chunks = messages * 2;
+  if (chunks == 0) {
+    printf("alloc budget: no chunk forwarded\n");
+    return false;
+  }
+  AllocCounter tagged = diff.Tagged();
+  double allocs_per_chunk = static_cast<double>(tagged.count) / chunks;
+  printf("forwarded chunks:%llu\n%s",
+         static_cast<unsigned long long>(chunks),
+         AllocStats::Format(diff, chunks).c_str());
+  printf("alloc budget: %.2f allocs/chunk, budget:%.2f %s\n",
+         allocs_per_chunk, options.alloc_budget,
+         allocs_per_chunk <= options.alloc_budget ? "PASS" : "FAIL");
+  return allocs_per_chunk <= options.alloc_budget;
+}
+
+void PrintUsage(const char *command) {
+  std::cout << "Usage:" << command << " -m mode[echo/sink/churn]"
+            << " -c stream_count"
+            << " -r churn_conn_per_second"
+            << " -i churn_max_inflight"
+            << " -s message_size"
+            << " -d duration_seconds"
+            << " -k echo_messages_per_stream(default 0, use duration)"
+            << " -n proxy_client_io_thread_num"
+            << " -t bench_thread_num"
+            << " -p base_port(use port ~ port+3)"
+            << " -w wan_spec(delay=50,jitter=5,bw=100,loss=0.001,stall=200)"
+            << " -b echo_allocs_per_chunk_budget"
+            << " -h help" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options;
+  int ch = 0;
+  while ((ch = getopt(argc, argv, "m:c:s:d:k:n:t:p:r:i:b:w:h")) != -1) {
+    switch (ch) {
+      case 'm':
+        options.mode = optarg;
+        break;
+      case 'c':
+        options.streams = atoi(optarg);
+        break;
+      case 's':
+        options.message_size = static_cast<size_t>(atol(optarg));
+        break;
+      case 'd':
+        options.duration = atof(optarg);
+        break;
+      case 'k':
+        options.message_count = static_cast<uint64_t>(atoll(optarg));
+        break;
+      case 'n':
+        options.io_threads = atoi(optarg);
+        break;
+      case 't':
+        options.bench_threads = atoi(optarg);
+        break;
+      case 'r':
+        options.rate = atof(optarg);
+        break;
+      case 'i':
+        options.max_inflight = static_cast<size_t>(atol(optarg));
+        break;
+      case 'b':
+        options.alloc_budget = atof(optarg);
+        break;
+      case 'p':
+        options.server_port = static_cast<uint16_t>(atoi(optarg));
+        options.transfer_port = static_cast<uint16_t>(options.server_port + 1);
+        options.backend_port = static_cast<uint16_t>(options.server_port + 2);
+        options.relay_port = static_cast<uint16_t>(options.server_port + 3);
+        break;
+      case 'w':
+        if (!options.wan.Parse(optarg)) {
+          std::cout << "invalid wan spec:" << optarg << std::endl;
+          exit(1);
+        }
+        options.use_wan = true;
+        break;
+      default:
+        PrintUsage(argv[0]);
+        exit(0);
+        break;
+    }
+  }
+  if ((options.mode != "echo" && options.mode != "sink" &&
+       options.mode != "churn") ||
+      options.streams <= 0 || options.message_size == 0 ||
+      options.rate <= 0 || options.max_inflight == 0 ||
+      options.duration <= 0 || options.io_threads < 0 ||
+      options.bench_threads < 0 || options.alloc_budget < 0) {
+    std::cout << "invalid parameter" << std::endl;
+    PrintUsage(argv[0]);
+    exit(1);
+  }
+  if (options.alloc_budget > 0 &&
+      (options.mode != "echo" || !AllocStats::Enabled())) {
+    std::cout << "-b needs echo mode and -DPROXY_ALLOC_STATS=ON" << std::endl;
+    exit(1);
+  }
+  // 主线程等待压测连接完成, 连接不能在base_loop中
+  if (options.message_count > 0 &&
+      (options.mode != "echo" || options.bench_threads == 0)) {
+    std::cout << "-k needs echo mode and bench_thread_num > 0" << std::endl;
+    exit(1);
+  }
+  muduo::Logger::setLogLevel(muduo::Logger::WARN);
+
+  // proxy server
+  muduo::net::EventLoopThread server_thread;
+  muduo::net::EventLoop *server_loop = server_thread.startLoop();
+  std::unique_ptr<ProxyServer> proxy_server;
+  RunInLoopSync(server_loop, [&] {
+    proxy_server.reset(new ProxyServer(
+        server_loop,
+        muduo::net::InetAddress("127.0.0.1", options.server_port)));
+    proxy_server->Start();
+  });
+
+  // 后端服务
+  muduo::net::EventLoopThread backend_thread;
+  muduo::net::EventLoop *backend_loop = backend_thread.startLoop();
+  std::unique_ptr<BenchBackend> backend;
+  RunInLoopSync(backend_loop, [&] {
+    backend.reset(new BenchBackend(backend_loop, options));
+    backend->Start();
+  });
+
+  // 模拟广域网的中继, 使用单独的线程, 不占用proxy两端的loop
+  muduo::net::InetAddress server_address("127.0.0.1", options.server_port);
+  muduo::net::EventLoopThread relay_thread;
+  std::unique_ptr<WanRelay> relay;
+  if (options.use_wan) {
+    muduo::net::EventLoop *relay_loop = relay_thread.startLoop();
+    RunInLoopSync(relay_loop, [&] {
+      relay.reset(new WanRelay(
+          relay_loop, muduo::net::InetAddress("127.0.0.1", options.relay_port),
+          server_address, options.wan));
+      relay->Start();
+    });
+    server_address = muduo::net::InetAddress("127.0.0.1", options.relay_port);
+  }
+
+  // proxy client
+  muduo::net::EventLoopThread client_thread;
+  muduo::net::EventLoop *client_loop = client_thread.startLoop();
+  std::shared_ptr<ProxyClient> proxy_client = std::make_shared<ProxyClient>(
+      client_loop, server_address,
+      muduo::net::InetAddress("127.0.0.1", options.backend_port),
+      options.transfer_port, options.io_threads);
+  if (proxy_client->Start() != 0) {
+    std::cout << "proxy client start failed" << std::endl;
+    ::_exit(1);
+  }
+
+  // 压测客户端
+  muduo::net::EventLoop base_loop;
+  muduo::net::EventLoopThreadPool bench_pool(&base_loop, "bench");
+  bench_pool.setThreadNum(options.bench_threads);
+  bench_pool.start();
+  std::string message(options.message_size, 'x');
+  muduo::net::InetAddress proxy_address("127.0.0.1", options.transfer_port);
+  if (options.mode == "churn") {
+    return RunChurn(options, &base_loop, &bench_pool, proxy_address, message,
+                    server_loop, proxy_server.get(), client_loop,
+                    proxy_client.get());
+  }
+  std::vector<std::shared_ptr<BenchStream>> streams;
+  for (int i = 0; i < options.streams; ++i) {
+    muduo::net::EventLoop *loop = bench_pool.getNextLoop();
+    std::shared_ptr<BenchStream> stream(
+        std::make_shared<BenchStream>(loop, proxy_address, options, message));
+    loop->runInLoop(std::bind(&BenchStream::Start, stream));
+    streams.push_back(stream);
+  }
+  uint64_t backend_start_bytes = backend->ReceivedBytes();
+  uint64_t start_frames = CollectDataFrames(server_loop, proxy_server.get(),
+                                            client_loop, proxy_client.get());
+  muduo::Timestamp start_time = muduo::Timestamp::now();
+  // 分配统计从预热结束开始, 排除建立连接的分配
+  AllocSnapshot alloc_start;
+  uint64_t alloc_start_messages = 0;
+  if (options.message_count > 0) {
+    // 两次快照时都没有转发中的数据, 统计的分配只和消息数有关
+    WaitStreams(streams, std::max<uint64_t>(options.message_count / 10, 1));
+    alloc_start_messages = CollectMessages(streams);
+    alloc_start = AllocStats::Snapshot();
+    WaitStreams(streams, options.message_count);
+  } else {
+    if (options.alloc_budget > 0) {
+      base_loop.runAfter(options.duration / 10, [&] {
+        alloc_start_messages = CollectMessages(streams);
+        alloc_start = AllocStats::Snapshot();
+      });
+    }
+    base_loop.runAfter(options.duration, [&] { base_loop.quit(); });
+    base_loop.loop();
+  }
+  double elapsed = muduo::timeDifference(muduo::Timestamp::now(), start_time);
+  AllocSnapshot alloc_end = AllocStats::Snapshot();
+  uint64_t alloc_end_messages =
+      options.alloc_budget > 0 ? CollectMessages(streams) : 0;
+  uint64_t backend_bytes = backend->ReceivedBytes() - backend_start_bytes;
+  uint64_t data_frames =
+      CollectDataFrames(server_loop, proxy_server.get(), client_loop,
+                        proxy_client.get()) -
+      start_frames;
+
+  // 汇总结果
+  BenchResult total;
+  for (const auto &stream : streams) {
+    RunInLoopSync(stream->GetLoop(), [&] {
+      stream->Stop();
+      const BenchResult &result = stream->Result();
+      total.messages += result.messages;
+      total.bytes += result.bytes;
+      total.latencies_us.insert(total.latencies_us.end(),
+                                result.latencies_us.begin(),
+                                result.latencies_us.end());
+    });
+  }
+  std::sort(total.latencies_us.begin(), total.latencies_us.end());
+  // sink模式以后端实际收到的数据计算吞吐
+  uint64_t bytes = options.mode == "sink" ? backend_bytes : total.bytes;
+  printf("mode:%s streams:%d message_size:%zu duration:%.2fs\n",
+         options.mode.c_str(), options.streams, options.message_size,
+         elapsed);
+  if (options.use_wan) {
+    printf("wan: %s\n", options.wan.ToString().c_str());
+  }
+  // msgs/s是压测客户端完成的消息数, 隧道帧数和消息数无关:
+  // 一条消息可能被拆成多帧, 也可能和其他数据合并成一帧
+  printf("throughput: %.3f Gbit/s, %.0f msgs/s, %.0f data frames/s\n",
+         bytes * 8 / elapsed / 1e9, total.messages / elapsed,
+         data_frames / elapsed);
+  if (options.mode == "echo") {
+    PrintLatency(total.latencies_us);
+  }
+  int ret = 0;
+  if (options.alloc_budget > 0 &&
+      !CheckAllocBudget(options, alloc_end - alloc_start,
+                        alloc_end_messages - alloc_start_messages)) {
+    ret = 3;
+  }
+  fflush(stdout);
+  // 各个loop线程中的对象相互引用, 不做析构直接退出
+  ::_exit(ret);
+}
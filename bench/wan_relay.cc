@@ -0,0 +1,302 @@
+// Copyright [2021] zhangke
+
+#include "bench/wan_relay.h"
+
+#include <muduo/base/Logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <boost/any.hpp>
+#include <utility>
+#include <vector>
+
+bool WanOptions::Parse(const std::string &spec) {
+  size_t pos = 0;
+  while (pos < spec.size()) {
+    size_t end = spec.find(',', pos);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    std::string item = spec.substr(pos, end - pos);
+    pos = end + 1;
+    size_t equal = item.find('=');
+    if (equal == std::string::npos) {
+      return false;
+    }
+    std::string key = item.substr(0, equal);
+    double value = atof(item.c_str() + equal + 1);
+    if (value < 0) {
+      return false;
+    }
+    if (key == "delay") {
+      delay_ms = value;
+    } else if (key == "jitter") {
+      jitter_ms = value;
+    } else if (key == "bw") {
+      bandwidth_mbps = value;
+    } else if (key == "loss") {
+      loss = value;
+    } else if (key == "stall") {
+      stall_ms = value;
+    } else if (key == "queue") {
+      queue_bytes = static_cast<size_t>(value);
+    } else {
+      return false;
+    }
+  }
+  return loss <= 1 && queue_bytes > 0;
+}
+
+std::string WanOptions::ToString() const {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "delay:%.1fms jitter:%.1fms bw:%.1fMbit/s loss:%g stall:%.1fms "
+           "queue:%zu",
+           delay_ms, jitter_ms, bandwidth_mbps, loss, stall_ms, queue_bytes);
+  return buf;
+}
+
+WanPipe::WanPipe(muduo::net::EventLoop *loop, const WanOptions &options,
+                 std::mt19937 *rng)
+    : loop_(loop),
+      options_(options),
+      rng_(rng),
+      queued_bytes_(0),
+      link_free_us_(0),
+      last_release_us_(0),
+      timer_pending_(false),
+      input_closed_(false),
+      output_closed_(false),
+      input_blocked_(false) {}
+
+void WanPipe::SetOutput(const muduo::net::TcpConnectionPtr &output) {
+  output_ = output;
+  Schedule();
+}
+
+void WanPipe::Push(muduo::net::Buffer *buffer) {
+  size_t size = buffer->readableBytes();
+  if (output_closed_) {
+    buffer->retrieveAll();
+    return;
+  }
+  int64_t now_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+  // 按带宽串行发送, 链路忙时排队
+  int64_t start_us = std::max(now_us, link_free_us_);
+  int64_t transmit_us = 0;
+  if (options_.bandwidth_mbps > 0) {
+    transmit_us = static_cast<int64_t>(size * 8 / options_.bandwidth_mbps);
+  }
+  link_free_us_ = start_us + transmit_us;
+  double delay_ms = options_.delay_ms;
+  if (options_.jitter_ms > 0) {
+    std::uniform_real_distribution<double> jitter(-options_.jitter_ms,
+                                                  options_.jitter_ms);
+    delay_ms = std::max(0.0, delay_ms + jitter(*rng_));
+  }
+  int64_t release_us = link_free_us_ + static_cast<int64_t>(delay_ms * 1000);
+  if (options_.loss > 0) {
+    std::uniform_real_distribution<double> dice(0, 1);
+    if (dice(*rng_) < options_.loss) {
+      release_us += static_cast<int64_t>(options_.stall_ms * 1000);
+    }
+  }
+  // TCP按序交付, 丢包停顿和抖动都不能让后面的数据先到
+  release_us = std::max(release_us, last_release_us_);
+  last_release_us_ = release_us;
+  chunks_.push_back(Chunk{release_us, buffer->retrieveAllAsString()});
+  queued_bytes_ += size;
+  if (queued_bytes_ > options_.queue_bytes && input_ && !input_blocked_) {
+    input_->stopRead();
+    input_blocked_ = true;
+  }
+  Schedule();
+}
+
+void WanPipe::CloseInput() {
+  input_closed_ = true;
+  input_.reset();
+  input_blocked_ = false;
+  if (chunks_.empty() && output_) {
+    output_->shutdown();
+  }
+}
+
+void WanPipe::CloseOutput() {
+  output_closed_ = true;
+  output_.reset();
+  chunks_.clear();
+  queued_bytes_ = 0;
+  if (input_blocked_ && input_) {
+    input_->startRead();
+    input_blocked_ = false;
+  }
+}
+
+void WanPipe::Flush() {
+  timer_pending_ = false;
+  if (!output_) {
+    return;
+  }
+  int64_t now_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+  while (!chunks_.empty() && chunks_.front().release_us <= now_us) {
+    Chunk &chunk = chunks_.front();
+    output_->send(chunk.data.data(), static_cast<int>(chunk.data.size()));
+    queued_bytes_ -= chunk.data.size();
+    chunks_.pop_front();
+  }
+  if (input_blocked_ && queued_bytes_ <= options_.queue_bytes / 2) {
+    input_->startRead();
+    input_blocked_ = false;
+  }
+  if (chunks_.empty()) {
+    if (input_closed_) {
+      output_->shutdown();
+    }
+    return;
+  }
+  Schedule();
+}
+
+void WanPipe::Schedule() {
+  if (timer_pending_ || chunks_.empty() || !output_) {
+    return;
+  }
+  timer_pending_ = true;
+  std::weak_ptr<WanPipe> weak_pipe(shared_from_this());
+  loop_->runAt(muduo::Timestamp(chunks_.front().release_us), [weak_pipe] {
+    std::shared_ptr<WanPipe> pipe = weak_pipe.lock();
+    if (pipe) {
+      pipe->Flush();
+    }
+  });
+}
+
+WanRelay::WanRelay(muduo::net::EventLoop *loop,
+                   const muduo::net::InetAddress &listen_addr,
+                   const muduo::net::InetAddress &upstream_addr,
+                   const WanOptions &options)
+    : loop_(loop),
+      upstream_addr_(upstream_addr),
+      options_(options),
+      server_(loop, listen_addr, "wan_relay"),
+      rng_(std::random_device()()),
+      next_id_(0) {
+  server_.setConnectionCallback(
+      std::bind(&WanRelay::OnConnection, this, std::placeholders::_1));
+  server_.setMessageCallback(
+      std::bind(&WanRelay::OnMessage, this, std::placeholders::_1,
+                std::placeholders::_2, std::placeholders::_3));
+}
+
+void WanRelay::Start() {
+  LOG_INFO << "wan relay " << server_.ipPort() << " => "
+           << upstream_addr_.toIpPort() << " " << options_.ToString();
+  server_.start();
+}
+
+void WanRelay::OnConnection(const muduo::net::TcpConnectionPtr &conn) {
+  if (conn->connected()) {
+    SessionPtr session(std::make_shared<Session>());
+    session->id = ++next_id_;
+    session->downstream = conn;
+    session->to_upstream =
+        std::make_shared<WanPipe>(loop_, options_, &rng_);
+    session->to_downstream =
+        std::make_shared<WanPipe>(loop_, options_, &rng_);
+    session->to_upstream->SetInput(conn);
+    session->to_downstream->SetOutput(conn);
+    session->upstream_client = std::make_shared<muduo::net::TcpClient>(
+        loop_, upstream_addr_, "wan_upstream");
+    session->upstream_client->setConnectionCallback(
+        std::bind(&WanRelay::OnUpstreamConnection, this, session->id,
+                  std::placeholders::_1));
+    session->upstream_client->setMessageCallback(
+        std::bind(&WanRelay::OnUpstreamMessage, this, session->id,
+                  std::placeholders::_1, std::placeholders::_2,
+                  std::placeholders::_3));
+    conn->setContext(session->id);
+    conn->setTcpNoDelay(true);
+    sessions_[session->id] = session;
+    session->upstream_client->connect();
+  } else {
+    uint64_t id = boost::any_cast<uint64_t>(conn->getContext());
+    auto iter = sessions_.find(id);
+    if (iter == sessions_.end()) {
+      return;
+    }
+    SessionPtr session = iter->second;
+    session->downstream.reset();
+    session->to_upstream->CloseInput();
+    session->to_downstream->CloseOutput();
+    if (!session->upstream_connected) {
+      // 上游还没有连上, 直接放弃
+      session->upstream_client->stop();
+      RemoveSession(id);
+    } else if (!session->upstream) {
+      RemoveSession(id);
+    }
+  }
+}
+
+void WanRelay::OnMessage(const muduo::net::TcpConnectionPtr &conn,
+                         muduo::net::Buffer *buffer, muduo::Timestamp) {
+  uint64_t id = boost::any_cast<uint64_t>(conn->getContext());
+  auto iter = sessions_.find(id);
+  if (iter == sessions_.end()) {
+    buffer->retrieveAll();
+    return;
+  }
+  iter->second->to_upstream->Push(buffer);
+}
+
+void WanRelay::OnUpstreamConnection(uint64_t id,
+                                    const muduo::net::TcpConnectionPtr &conn) {
+  auto iter = sessions_.find(id);
+  if (iter == sessions_.end()) {
+    if (conn->connected()) {
+      conn->forceClose();
+    }
+    return;
+  }
+  SessionPtr session = iter->second;
+  if (conn->connected()) {
+    conn->setTcpNoDelay(true);
+    session->upstream = conn;
+    session->upstream_connected = true;
+    session->to_downstream->SetInput(conn);
+    session->to_upstream->SetOutput(conn);
+  } else {
+    session->upstream.reset();
+    session->to_downstream->CloseInput();
+    session->to_upstream->CloseOutput();
+    if (!session->downstream) {
+      RemoveSession(id);
+    }
+  }
+}
+
+void WanRelay::OnUpstreamMessage(uint64_t id,
+                                 const muduo::net::TcpConnectionPtr &conn,
+                                 muduo::net::Buffer *buffer,
+                                 muduo::Timestamp) {
+  auto iter = sessions_.find(id);
+  if (iter == sessions_.end()) {
+    buffer->retrieveAll();
+    return;
+  }
+  iter->second->to_downstream->Push(buffer);
+}
+
+void WanRelay::RemoveSession(uint64_t id) {
+  auto iter = sessions_.find(id);
+  if (iter == sessions_.end()) {
+    return;
+  }
+  // 可能在TcpClient自己的回调中, 延后析构
+  std::shared_ptr<muduo::net::TcpClient> upstream_client =
+      iter->second->upstream_client;
+  sessions_.erase(iter);
+  loop_->queueInLoop([upstream_client] {});
+}
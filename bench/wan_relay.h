@@ -0,0 +1,118 @@
+// Copyright [2021] zhangke
+#ifndef BENCH_WAN_RELAY_H_
+#define BENCH_WAN_RELAY_H_
+
+#include <muduo/net/Buffer.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+#include <muduo/net/TcpClient.h>
+#include <muduo/net/TcpConnection.h>
+#include <muduo/net/TcpServer.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+
+// 模拟广域网链路的参数, 每个方向独立生效
+struct WanOptions {
+  // 单向延迟, RTT约为两倍
+  double delay_ms = 0;
+  // 延迟抖动, 均匀分布在[-jitter_ms, jitter_ms], 不会导致数据乱序
+  double jitter_ms = 0;
+  // 单向带宽, 0表示不限制
+  double bandwidth_mbps = 0;
+  // 每个数据块触发丢包重传的概率, 重传期间后续数据全部停顿
+  double loss = 0;
+  // 一次丢包重传的停顿时长, 近似一次RTO
+  double stall_ms = 200;
+  // 链路上(排队和传输中)的最大字节数, 超过后停止读取发送方, 模拟瓶颈队列
+  size_t queue_bytes = 4 * 1024 * 1024;
+  // 解析"delay=50,jitter=5,bw=100,loss=0.001,stall=200,queue=4194304"
+  bool Parse(const std::string &spec);
+  std::string ToString() const;
+};
+
+// 一个方向的模拟链路, 从input读出的数据按延迟, 带宽和停顿计算到达时间,
+// 到达后写入output, 所有操作都在loop_中
+class WanPipe : public std::enable_shared_from_this<WanPipe> {
+ public:
+  WanPipe(muduo::net::EventLoop *loop, const WanOptions &options,
+          std::mt19937 *rng);
+  void SetInput(const muduo::net::TcpConnectionPtr &input) { input_ = input; }
+  void SetOutput(const muduo::net::TcpConnectionPtr &output);
+  void Push(muduo::net::Buffer *buffer);
+  // 输入端关闭, 排队的数据全部送达后关闭输出端
+  void CloseInput();
+  // 输出端关闭, 丢弃排队的数据
+  void CloseOutput();
+  size_t QueuedBytes() const { return queued_bytes_; }
+
+ private:
+  struct Chunk {
+    int64_t release_us;
+    std::string data;
+  };
+  void Flush();
+  void Schedule();
+
+  muduo::net::EventLoop *loop_;
+  const WanOptions &options_;
+  std::mt19937 *rng_;
+  muduo::net::TcpConnectionPtr input_;
+  muduo::net::TcpConnectionPtr output_;
+  std::deque<Chunk> chunks_;
+  size_t queued_bytes_;
+  // 链路空闲的时间, 用于按带宽串行发送
+  int64_t link_free_us_;
+  // 上一个数据块的到达时间, 保证不乱序
+  int64_t last_release_us_;
+  bool timer_pending_;
+  bool input_closed_;
+  bool output_closed_;
+  bool input_blocked_;
+};
+
+// 监听listen_addr, 每个连接建立一条到upstream_addr的连接, 双向数据都经过
+// WanPipe, 用于在本机模拟proxy_client和proxy_server之间的广域网
+class WanRelay {
+ public:
+  WanRelay(muduo::net::EventLoop *loop,
+           const muduo::net::InetAddress &listen_addr,
+           const muduo::net::InetAddress &upstream_addr,
+           const WanOptions &options);
+  void Start();
+  // 在loop_中调用
+  size_t SessionCount() const { return sessions_.size(); }
+
+ private:
+  struct Session {
+    uint64_t id;
+    muduo::net::TcpConnectionPtr downstream;
+    std::shared_ptr<muduo::net::TcpClient> upstream_client;
+    muduo::net::TcpConnectionPtr upstream;
+    bool upstream_connected = false;
+    std::shared_ptr<WanPipe> to_upstream;
+    std::shared_ptr<WanPipe> to_downstream;
+  };
+  typedef std::shared_ptr<Session> SessionPtr;
+  void OnConnection(const muduo::net::TcpConnectionPtr &conn);
+  void OnMessage(const muduo::net::TcpConnectionPtr &conn,
+                 muduo::net::Buffer *buffer, muduo::Timestamp);
+  void OnUpstreamConnection(uint64_t id,
+                            const muduo::net::TcpConnectionPtr &conn);
+  void OnUpstreamMessage(uint64_t id, const muduo::net::TcpConnectionPtr &conn,
+                         muduo::net::Buffer *buffer, muduo::Timestamp);
+  void RemoveSession(uint64_t id);
+
+  muduo::net::EventLoop *loop_;
+  muduo::net::InetAddress upstream_addr_;
+  WanOptions options_;
+  muduo::net::TcpServer server_;
+  std::mt19937 rng_;
+  uint64_t next_id_;
+  std::map<uint64_t, SessionPtr> sessions_;
+};
+
+#endif  // BENCH_WAN_RELAY_H_
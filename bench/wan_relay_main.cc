@@ -0,0 +1,64 @@
+// Copyright [2021] zhangke
+// 独立运行的广域网模拟中继, 放在proxy_client和proxy_server之间:
+// proxy_client -> wan_relay -> proxy_server
+
+#include <muduo/base/Logging.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "bench/wan_relay.h"
+
+void PrintUsage(const char *command) {
+  std::cout << "Usage:" << command << " -l listen_port"
+            << " -s upstream_ip -p upstream_port"
+            << " -w delay=50,jitter=5,bw=100,loss=0.001,stall=200,queue=4194304"
+            << " -h help" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  uint16_t listen_port = 0;
+  std::string upstream_ip;
+  uint16_t upstream_port = 0;
+  WanOptions options;
+  int ch = 0;
+  while ((ch = getopt(argc, argv, "l:s:p:w:h")) != -1) {
+    switch (ch) {
+      case 'l':
+        listen_port = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 's':
+        upstream_ip = optarg;
+        break;
+      case 'p':
+        upstream_port = static_cast<uint16_t>(atoi(optarg));
+        break;
+      case 'w':
+        if (!options.Parse(optarg)) {
+          std::cout << "invalid wan spec:" << optarg << std::endl;
+          exit(-1);
+        }
+        break;
+      case 'h':
+      default:
+        PrintUsage(argv[0]);
+        exit(0);
+        break;
+    }
+  }
+  if (listen_port == 0 || upstream_ip.empty() || upstream_port == 0) {
+    std::cout << "invalid parameter" << std::endl;
+    PrintUsage(argv[0]);
+    exit(-1);
+  }
+  muduo::net::EventLoop loop;
+  WanRelay relay(&loop, muduo::net::InetAddress(listen_port),
+                 muduo::net::InetAddress(upstream_ip, upstream_port), options);
+  relay.Start();
+  loop.loop();
+  return 0;
+}
@@ -0,0 +1,235 @@
+// Copyright [2021] zhangke
+
+#include "client/Connector.h"
+
+#include <errno.h>
+#include <muduo/base/Logging.h>
+#include <muduo/net/SocketsOps.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <random>
+
+using namespace muduo;
+using namespace muduo::net;
+
+const int Connector::kMaxRetryDelayMs;
+
+namespace {
+
+// 在[delayMs/2, delayMs]之间随机, 避免大量连接同时重连
+int jitteredDelayMs(int delayMs) {
+  static thread_local std::mt19937 gen(std::random_device{}());
+  std::uniform_int_distribution<int> dis(delayMs / 2, delayMs);
+  return dis(gen);
+}
+
+}  // namespace
+
+Connector::Connector(EventLoop* loop, const InetAddress& serverAddr)
+    : loop_(loop),
+      serverAddr_(serverAddr),
+      connect_(false),
+      state_(kDisconnected),
+      initRetryDelayMs_(kInitRetryDelayMs),
+      retryDelayMs_(kInitRetryDelayMs) {}
+
+Connector::Connector(EventLoop* loop, const std::string& unixPath)
+    : loop_(loop),
+      unixPath_(unixPath),
+      connect_(false),
+      state_(kDisconnected),
+      initRetryDelayMs_(kInitRetryDelayMs),
+      retryDelayMs_(kInitRetryDelayMs) {}
+
+Connector::~Connector() { assert(!channel_); }
+
+std::string Connector::serverName() const {
+  return isUnix() ? "unix:" + unixPath_ : serverAddr_.toIpPort();
+}
+
+void Connector::start() {
+  connect_ = true;
+  loop_->runInLoop(std::bind(&Connector::startInLoop, shared_from_this()));
+}
+
+void Connector::startInLoop() {
+  loop_->assertInLoopThread();
+  assert(state_ == kDisconnected);
+  if (connect_) {
+    connect();
+  } else {
+    LOG_DEBUG << "do not connect";
+  }
+}
+
+void Connector::stop() {
+  connect_ = false;
+  // TcpClient可能在stopInLoop之前析构, 回调中持有Connector
+  loop_->queueInLoop(std::bind(&Connector::stopInLoop, shared_from_this()));
+}
+
+void Connector::stopInLoop() {
+  loop_->assertInLoopThread();
+  if (state_ == kConnecting) {
+    setState(kDisconnected);
+    int sockfd = removeAndResetChannel();
+    retry(sockfd);
+  }
+}
+
+int Connector::connectSocket(int* sockfd) {
+  if (!isUnix()) {
+    *sockfd = sockets::createNonblockingOrDie(serverAddr_.family());
+    return sockets::connect(*sockfd, serverAddr_.getSockAddr());
+  }
+  *sockfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (*sockfd < 0) {
+    LOG_SYSFATAL << "Connector::connectSocket unix socket";
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, unixPath_.c_str(), sizeof(addr.sun_path) - 1);
+  return ::connect(*sockfd, reinterpret_cast<struct sockaddr*>(&addr),
+                   static_cast<socklen_t>(sizeof(addr)));
+}
+
+void Connector::connect() {
+  int sockfd = -1;
+  int ret = connectSocket(&sockfd);
+  int savedErrno = (ret == 0) ? 0 : errno;
+  switch (savedErrno) {
+    case 0:
+    case EINPROGRESS:
+    case EINTR:
+    case EISCONN:
+      connecting(sockfd);
+      break;
+
+    case EAGAIN:
+    case EADDRINUSE:
+    case EADDRNOTAVAIL:
+    case ECONNREFUSED:
+    case ENETUNREACH:
+    case ENOENT:  // unix socket文件还没创建
+      retry(sockfd);
+      break;
+
+    case EACCES:
+    case EPERM:
+    case EAFNOSUPPORT:
+    case EALREADY:
+    case EBADF:
+    case EFAULT:
+    case ENOTSOCK:
+      LOG_SYSERR << "connect error in Connector::startInLoop " << savedErrno;
+      sockets::close(sockfd);
+      break;
+
+    default:
+      LOG_SYSERR << "Unexpected error in Connector::startInLoop "
+                 << savedErrno;
+      sockets::close(sockfd);
+      // connectErrorCallback_();
+      break;
+  }
+}
+
+void Connector::restart() {
+  loop_->assertInLoopThread();
+  setState(kDisconnected);
+  connect_ = true;
+  // 对端accept之后立即关闭时也要退避, 间隔由resetRetryDelay重置
+  int delayMs = jitteredDelayMs(retryDelayMs_);
+  LOG_INFO << "Connector::restart - Reconnecting to " << serverName()
+           << " in " << delayMs << " milliseconds. ";
+  loop_->runAfter(delayMs / 1000.0,
+                  std::bind(&Connector::startInLoop, shared_from_this()));
+  retryDelayMs_ = std::min(retryDelayMs_ * 2, kMaxRetryDelayMs);
+}
+
+void Connector::resetRetryDelay() {
+  loop_->assertInLoopThread();
+  retryDelayMs_ = initRetryDelayMs_;
+}
+
+void Connector::connecting(int sockfd) {
+  setState(kConnecting);
+  assert(!channel_);
+  channel_.reset(new Channel(loop_, sockfd));
+  channel_->setWriteCallback(
+      std::bind(&Connector::handleWrite, this));  // FIXME: unsafe
+  channel_->setErrorCallback(
+      std::bind(&Connector::handleError, this));  // FIXME: unsafe
+
+  // channel_->tie(shared_from_this()); is not working,
+  // as channel_ is not managed by shared_ptr
+  channel_->enableWriting();
+}
+
+int Connector::removeAndResetChannel() {
+  channel_->disableAll();
+  channel_->remove();
+  int sockfd = channel_->fd();
+  // Can't reset channel_ here, because we are inside Channel::handleEvent
+  // resetChannel之前Connector不能析构(~Connector断言channel_为空)
+  loop_->queueInLoop(
+      std::bind(&Connector::resetChannel, shared_from_this()));
+  return sockfd;
+}
+
+void Connector::resetChannel() { channel_.reset(); }
+
+void Connector::handleWrite() {
+  LOG_TRACE << "Connector::handleWrite " << state_;
+
+  if (state_ == kConnecting) {
+    int sockfd = removeAndResetChannel();
+    int err = sockets::getSocketError(sockfd);
+    if (err) {
+      LOG_WARN << "Connector::handleWrite - SO_ERROR = " << err << " "
+               << strerror_tl(err);
+      retry(sockfd);
+    } else if (!isUnix() && sockets::isSelfConnect(sockfd)) {
+      LOG_WARN << "Connector::handleWrite - Self connect";
+      retry(sockfd);
+    } else {
+      setState(kConnected);
+      if (connect_) {
+        newConnectionCallback_(sockfd);
+      } else {
+        sockets::close(sockfd);
+      }
+    }
+  } else {
+    // what happened?
+    assert(state_ == kDisconnected);
+  }
+}
+
+void Connector::handleError() {
+  LOG_ERROR << "Connector::handleError state=" << state_;
+  if (state_ == kConnecting) {
+    int sockfd = removeAndResetChannel();
+    int err = sockets::getSocketError(sockfd);
+    LOG_TRACE << "SO_ERROR = " << err << " " << strerror_tl(err);
+    retry(sockfd);
+  }
+}
+
+void Connector::retry(int sockfd) {
+  sockets::close(sockfd);
+  setState(kDisconnected);
+  if (connect_) {
+    int delayMs = jitteredDelayMs(retryDelayMs_);
+    LOG_INFO << "Connector::retry - Retry connecting to " << serverName()
+             << " in " << delayMs << " milliseconds. ";
+    loop_->runAfter(delayMs / 1000.0,
+                    std::bind(&Connector::startInLoop, shared_from_this()));
+    retryDelayMs_ = std::min(retryDelayMs_ * 2, kMaxRetryDelayMs);
+  } else {
+    LOG_DEBUG << "do not connect";
+  }
+}
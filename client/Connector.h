@@ -0,0 +1,75 @@
+// Copyright [2021] zhangke
+
+#ifndef CLIENT_CONNECTOR_H_
+#define CLIENT_CONNECTOR_H_
+
+#include <muduo/base/noncopyable.h>
+#include <muduo/net/Channel.h>
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/InetAddress.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+///
+/// Connector of outgoing stream connections, tcp or unix domain socket.
+///
+class Connector : muduo::noncopyable,
+                  public std::enable_shared_from_this<Connector> {
+ public:
+  typedef std::function<void(int sockfd)> NewConnectionCallback;
+
+  Connector(muduo::net::EventLoop* loop,
+            const muduo::net::InetAddress& serverAddr);
+  Connector(muduo::net::EventLoop* loop, const std::string& unixPath);
+  ~Connector();
+
+  void setNewConnectionCallback(const NewConnectionCallback& cb) {
+    newConnectionCallback_ = cb;
+  }
+
+  void start();    // can be called in any thread
+  void restart();  // must be called in loop thread
+  void stop();     // can be called in any thread
+  // 重连的初始间隔, 在start之前调用
+  void setInitRetryDelayMs(int delayMs) {
+    initRetryDelayMs_ = delayMs;
+    retryDelayMs_ = delayMs;
+  }
+  // 连接确认可用后调用, 下次重连从初始间隔开始, must be called in loop thread
+  void resetRetryDelay();
+
+  const muduo::net::InetAddress& serverAddress() const { return serverAddr_; }
+  bool isUnix() const { return !unixPath_.empty(); }
+  std::string serverName() const;
+
+ private:
+  enum States { kDisconnected, kConnecting, kConnected };
+  static const int kMaxRetryDelayMs = 30 * 1000;
+  static const int kInitRetryDelayMs = 500;
+
+  void setState(States s) { state_ = s; }
+  void startInLoop();
+  void stopInLoop();
+  void connect();
+  int connectSocket(int* sockfd);
+  void connecting(int sockfd);
+  void handleWrite();
+  void handleError();
+  void retry(int sockfd);
+  int removeAndResetChannel();
+  void resetChannel();
+
+  muduo::net::EventLoop* loop_;
+  muduo::net::InetAddress serverAddr_;
+  std::string unixPath_;
+  bool connect_;  // atomic
+  States state_;  // FIXME: use atomic variable
+  std::unique_ptr<muduo::net::Channel> channel_;
+  NewConnectionCallback newConnectionCallback_;
+  int initRetryDelayMs_;
+  int retryDelayMs_;
+};
+
+#endif  // CLIENT_CONNECTOR_H_
@@ -1,45 +1,57 @@
 // Copyright [2020] zhangke
 
 #include <muduo/base/Logging.h>
-#include <muduo/base/LogFile.h>
 #include <muduo/net/InetAddress.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <iostream>
 #include <memory>
 
 #include "client/proxy_client.h"
+#include "common/async_logger.h"
+#include "common/memory_budget.h"
 
 void PrintUsage(const char *command) {
   std::cout << "Usage:" << command << " -s server_address"
             << " -p server_port"
+            << " -u server_unix_path"
             << " -t transfer_port"
             << " -S proxy_server_address"
             << " -P proxy_server_port"
             << " -L log_level[trace/debug/info/warn]"
+            << " -n io_thread_num"
+            << " -m admin_port(default 0, disable)"
+            << " -b memory_budget_mb(default 0, unlimited)"
+            << " -g resume_seconds(default 30, 0 disable resume)"
             << " -h help" << std::endl;
 }
 
-std::unique_ptr<muduo::LogFile> g_logFile;
+std::unique_ptr<AsyncLogger> g_async_logger;
 
 void outputFunc(const char* msg, int len) {
-  g_logFile->append(msg, len);
+  g_async_logger->Append(msg, len);
 }
 
 void flushFunc() {
-  g_logFile->flush();
+  g_async_logger->Flush();
 }
 
 int main(int argc, char *argv[]) {
   // server address, server port, transfer port, proxy server address, proxy
   // server port
   const char *server_address_p = nullptr, *proxy_server_address_p = nullptr;
-  muduo::Logger::LogLevel log_level = muduo::Logger::DEBUG;
+  const char *server_unix_path_p = nullptr;
+  muduo::Logger::LogLevel log_level = muduo::Logger::INFO;
   const char *level_str = nullptr;
   uint16_t server_port = 0, transfer_port = 0, proxy_server_port = 0;
+  int io_thread_num = 0;
+  uint16_t admin_port = 0;
+  int64_t memory_budget_mb = 0;
+  double resume_seconds = 30.0;
   int ch;
   int port = 0;
-  while ((ch = getopt(argc, argv, "s:p:t:S:P:L:h")) != -1) {
+  while ((ch = getopt(argc, argv, "s:p:u:t:S:P:L:n:m:b:g:h")) != -1) {
     switch (ch) {
       case 's':
         server_address_p = optarg;
@@ -55,6 +67,16 @@ int main(int argc, char *argv[]) {
           std::cout << "server_port:" << server_port << std::endl;
         }
         break;
+      case 'u':
+        server_unix_path_p = optarg;
+        // sun_path需要保留结尾的'\0'
+        if (strlen(server_unix_path_p) >= sizeof(sockaddr_un::sun_path)) {
+          std::cout << "server unix path too long, max length:"
+                    << sizeof(sockaddr_un::sun_path) - 1 << std::endl;
+          exit(1);
+        }
+        std::cout << "server_unix_path:" << server_unix_path_p << std::endl;
+        break;
       case 't':
         port = atoi(optarg);
         if (port <= 0 || port >= 65535) {
@@ -93,6 +115,39 @@ int main(int argc, char *argv[]) {
         }
         std::cout << "log level:" << log_level << std::endl;
         break;
+      case 'n':
+        io_thread_num = atoi(optarg);
+        if (io_thread_num < 0) {
+          std::cout << "invalid io thread num:" << io_thread_num << std::endl;
+          exit(1);
+        }
+        std::cout << "io_thread_num:" << io_thread_num << std::endl;
+        break;
+      case 'm':
+        port = atoi(optarg);
+        if (port <= 0 || port >= 65535) {
+          std::cout << "invalid admin port:" << port << std::endl;
+          exit(1);
+        }
+        admin_port = static_cast<uint16_t>(port);
+        std::cout << "admin_port:" << admin_port << std::endl;
+        break;
+      case 'b':
+        memory_budget_mb = atoll(optarg);
+        if (memory_budget_mb < 0) {
+          std::cout << "invalid memory budget:" << optarg << std::endl;
+          exit(1);
+        }
+        std::cout << "memory budget:" << memory_budget_mb << "MB" << std::endl;
+        break;
+      case 'g':
+        resume_seconds = atof(optarg);
+        if (resume_seconds < 0) {
+          std::cout << "invalid resume seconds:" << optarg << std::endl;
+          exit(1);
+        }
+        std::cout << "resume seconds:" << resume_seconds << std::endl;
+        break;
       case 'h':
         PrintUsage(argv[0]);
         exit(0);
@@ -103,34 +158,53 @@ int main(int argc, char *argv[]) {
         break;
     }
   }
-  if (server_address_p == nullptr || proxy_server_address_p == nullptr ||
-      server_port == 0 || transfer_port == 0 || proxy_server_port == 0) {
+  bool has_server = server_unix_path_p != nullptr ||
+                    (server_address_p != nullptr && server_port != 0);
+  if (!has_server || proxy_server_address_p == nullptr || transfer_port == 0 ||
+      proxy_server_port == 0) {
     std::cout << "Missing parameter" << std::endl;
     PrintUsage(argv[0]);
     exit(1);
   }
   char name[256] = {0};
   strncpy(name, argv[0], sizeof(name) - 1);
-  g_logFile.reset(new muduo::LogFile(::basename(name), 10*1024*1024, true, 1, 1));
+  // 日志由后台线程写文件, 不阻塞io线程
+  g_async_logger.reset(new AsyncLogger(::basename(name), 10 * 1024 * 1024));
+  g_async_logger->Start();
   muduo::Logger::setLogLevel(log_level);
   muduo::Logger::setOutput(outputFunc);
   muduo::Logger::setFlush(flushFunc);
   muduo::net::InetAddress server_address(server_port);
-  bool ret =
-      muduo::net::InetAddress::resolve(server_address_p, &server_address);
-  if (!ret) {
-    LOG_FATAL << "resolve:" << server_address_p << " failed";
+  if (server_unix_path_p == nullptr) {
+    bool ret =
+        muduo::net::InetAddress::resolve(server_address_p, &server_address);
+    if (!ret) {
+      LOG_FATAL << "resolve:" << server_address_p << " failed";
+    }
   }
   muduo::net::InetAddress proxy_server_address(proxy_server_port);
-  ret = muduo::net::InetAddress::resolve(proxy_server_address_p,
-                                         &proxy_server_address);
+  bool ret = muduo::net::InetAddress::resolve(proxy_server_address_p,
+                                              &proxy_server_address);
   if (!ret) {
     LOG_FATAL << "resolve:" << proxy_server_address_p << " failed";
   }
   muduo::net::EventLoopThread event_loop_thread;
   muduo::net::EventLoop *loop = event_loop_thread.startLoop();
-  std::shared_ptr<ProxyClient> proxy_client(std::make_shared<ProxyClient>(
-      loop, proxy_server_address, server_address, transfer_port));
+  MemoryBudget::Global().SetLimit(static_cast<size_t>(memory_budget_mb) << 20);
+  std::shared_ptr<ProxyClient> proxy_client;
+  if (server_unix_path_p) {
+    proxy_client = std::make_shared<ProxyClient>(
+        loop, proxy_server_address, std::string(server_unix_path_p),
+        transfer_port, io_thread_num);
+  } else {
+    proxy_client = std::make_shared<ProxyClient>(
+        loop, proxy_server_address, server_address, transfer_port,
+        io_thread_num);
+  }
+  if (admin_port) {
+    proxy_client->EnableAdmin(admin_port);
+  }
+  proxy_client->SetResumeWindow(resume_seconds);
   proxy_client->Start();
   muduo::net::EventLoop main_loop;
   main_loop.loop();
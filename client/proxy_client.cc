@@ -4,12 +4,49 @@
 
 #include <muduo/base/Logging.h>
 
-#include <boost/any.hpp>
+#include <map>
 #include <utility>
+#include <vector>
 
+#include "common/alloc_stats.h"
+#include "common/log_util.h"
+#include "common/loop_monitor.h"
 #include "common/message.pb.h"
 #include "common/message_util.h"
 
+namespace {
+
+// proxy连接重连的初始间隔, 后端连接使用Connector的默认值
+const int kTunnelInitRetryDelayMs = 100;
+
+// 任一阻塞标记置位时开始计时, 全部清除时停止
+void UpdateBlocked(ProxyConnection *connection) {
+  if (!connection->read_stopped && !connection->backend_high_water) {
+    connection->blocked_since = muduo::Timestamp();
+  } else if (!connection->blocked_since.valid()) {
+    connection->blocked_since = muduo::Timestamp::now();
+  }
+}
+
+// 在后端连接的loop中调用, 输出缓冲为空时直接writev, 写不完的交给send
+void FlushPending(const muduo::net::TcpConnectionPtr &conn, int fd,
+                  const std::shared_ptr<ChainBuffer> &pending) {
+  if (!conn->connected()) {
+    return;
+  }
+  if (fd >= 0 && conn->outputBuffer()->readableBytes() == 0 &&
+      pending->WriteTo(fd) < 0) {
+    LOG_WARN << "write pending data failed, conn:" << conn->name();
+  }
+  if (!pending->Empty()) {
+    std::string rest;
+    pending->AppendTo(&rest);
+    conn->send(rest);
+  }
+}
+
+}  // namespace
+
 int ProxyClient::Start() {
   std::call_once(start_flag_, &ProxyClient::StartProxyService, this);
   {
@@ -25,38 +62,146 @@ void ProxyClient::StartProxyService() {
   // 建立连接
   loop_->runInLoop([=] {
     dispatcher_->Init();
-    proxy_client_.reset(
-        new muduo::net::TcpClient(loop_, server_address_, "proxy_connection"));
+    dispatcher_->SetMemoryAccount(&memory_);
+    liveness_.reset(new TunnelLiveness(loop_, dispatcher_.get()));
+    bdp_tuner_.reset(new BdpTuner(loop_, dispatcher_.get()));
+    throttler_.reset(new StreamThrottler(
+        loop_,
+        std::bind(&ProxyClient::StopClientRead, this, std::placeholders::_1,
+                  false),
+        std::bind(&ProxyClient::ResumeClientRead, this, std::placeholders::_1,
+                  false),
+        std::bind(&ProxyClient::TunnelOutputBytes, this)));
+    memory_timer_ =
+        loop_->runEvery(0.1, std::bind(&ProxyClient::CheckMemory, this));
+    sweep_timer_ = loop_->runEvery(
+        BufferSweeper::kInterval, std::bind(&ProxyClient::SweepBuffers, this));
+    // 后端连接分散到io线程, loop_只处理proxy连接的收发
+    thread_pool_.reset(
+        new muduo::net::EventLoopThreadPool(loop_, "proxy_client"));
+    thread_pool_->setThreadNum(io_thread_num_);
+    OnIoThreadInit(loop_);
+    thread_pool_->start(std::bind(&ProxyClient::OnIoThreadInit, this_ptr(),
+                                  std::placeholders::_1));
+    proxy_client_.reset(new TcpClient(loop_, server_address_));
     // 连接到proxy server成功
-    proxy_client_->setConnectionCallback(std::bind(
+    proxy_client_->SetConnectionCallback(std::bind(
         &ProxyClient::OnProxyConnection, this_ptr(), std::placeholders::_1));
     // proxy server conn 收到消息
-    proxy_client_->setMessageCallback(
+    proxy_client_->SetMessageCallback(
         std::bind(&ProxyClient::OnMessage, this_ptr(), std::placeholders::_1,
                   std::placeholders::_2, std::placeholders::_3));
-    proxy_client_->enableRetry();
-    proxy_client_->connect();
+    // 断开或连接失败后指数退避重连, listen成功后退避间隔重置
+    proxy_client_->EnableRetry();
+    proxy_client_->SetInitRetryDelay(kTunnelInitRetryDelayMs);
+    proxy_client_->Connect();
+    if (admin_port_) {
+      StartAdmin();
+    }
   });
 }
 
+void ProxyClient::OnIoThreadInit(muduo::net::EventLoop *loop) {
+  muduo::MutexLockGuard lock(monitors_mutex_);
+  // 没有io线程时EventLoopThreadPool会以loop_回调
+  for (const auto &monitor : loop_monitors_) {
+    if (monitor->GetLoop() == loop) {
+      return;
+    }
+  }
+  loop_monitors_.emplace_back(new LoopMonitor(
+      loop, loop == loop_ ? "proxy_client" : "proxy_client_io"));
+  loop_monitors_.back()->Start();
+  if (loop != loop_) {
+    io_loops_.emplace_back(
+        new IoLoopState(loop, loop_monitors_.back().get()));
+    loop->runEvery(0.1, std::bind(&ProxyClient::SampleIoLoop, this,
+                                  io_loops_.back().get()));
+  }
+}
+
+IoLoopState *ProxyClient::FindIoLoop(muduo::net::EventLoop *loop) {
+  muduo::MutexLockGuard lock(monitors_mutex_);
+  for (const auto &state : io_loops_) {
+    if (state->loop == loop) {
+      return state.get();
+    }
+  }
+  return nullptr;
+}
+
+std::vector<IoLoopState *> ProxyClient::IoLoops() {
+  muduo::MutexLockGuard lock(monitors_mutex_);
+  std::vector<IoLoopState *> states;
+  for (const auto &state : io_loops_) {
+    states.push_back(state.get());
+  }
+  return states;
+}
+
+void ProxyClient::SampleIoLoop(IoLoopState *state) {
+  PROXY_LOOP_CALLBACK("ProxyClient::SampleIoLoop");
+  int64_t output_bytes = 0;
+  std::unordered_map<uint64_t, size_t> backlog;
+  for (const auto &item : state->conns) {
+    size_t bytes = item.second->outputBuffer()->readableBytes();
+    if (bytes) {
+      backlog[item.first] = bytes;
+      output_bytes += bytes;
+    }
+  }
+  LoopMonitor::Stats loop_stats = state->monitor->GetStats();
+  {
+    muduo::MutexLockGuard lock(state->mutex);
+    state->backlog.swap(backlog);
+    state->loop_stats = std::move(loop_stats);
+  }
+  int64_t delta = output_bytes - state->charged_bytes;
+  if (delta) {
+    state->charged_bytes = output_bytes;
+    loop_->runInLoop(
+        [this, delta] { memory_.Charge(MEMORY_STREAM_OUTPUT, delta); });
+  }
+}
+
 void ProxyClient::OnProxyConnection(const muduo::net::TcpConnectionPtr &conn) {
+  PROXY_LOOP_CALLBACK("ProxyClient::OnProxyConnection");
   if (conn->connected()) {
-    if (!clients_.empty()) {
+    if (!resuming_ && !clients_.empty()) {
+      // 最后一个连接删除时继续
       LOG_INFO << "clients not empty, connect to server later, client count:"
                << clients_.size();
-      loop_->runAfter(1.0,
-                      std::bind(&ProxyClient::OnProxyConnection, this, conn));
+      pending_listen_conn_ = conn;
       return;
     }
-    LOG_INFO << "proxy connection established";
-    // 注册高水位回调
-    proxy_client_->connection()->setHighWaterMarkCallback(
+    if (resuming_) {
+      LOG_INFO << "proxy connection established, resume session:"
+               << session_key_;
+    } else {
+      LOG_INFO << "proxy connection established";
+      proxy_conn_ = conn;
+      // 新的会话, 对端是新的实例
+      dispatcher_->ResetPeer();
+    }
+    // 注册高水位回调, 之后按带宽时延积调整
+    conn->setHighWaterMarkCallback(
         std::bind(&ProxyClient::OnHighWaterMark, this, true,
-                  std::placeholders::_1, std::placeholders::_2),
-        10 * MB_SIZE);
-    // 开始心跳
-    heartbeat_timer_ =
-        loop_->runEvery(10.0, std::bind(&ProxyClient::SendHeartBeat, this));
+                  std::placeholders::_1, std::placeholders::_2,
+                  ProxyConnectionRef()),
+        bdp_tuner_->Current().tunnel_high_water);
+    bdp_tuner_->Start(conn, ConnectionFd(conn),
+                      std::bind(&ProxyClient::ApplyBdpSettings, this,
+                                std::placeholders::_1));
+    // 开始心跳, 判定断开时关闭连接, 由TcpClient重连
+    std::weak_ptr<muduo::net::TcpConnection> weak_conn(conn);
+    liveness_->Start(std::bind(&ProxyClient::SendHeartBeat, this), [weak_conn] {
+      muduo::net::TcpConnectionPtr conn = weak_conn.lock();
+      if (conn) {
+        LOG_WARN << "proxy connection dead, peer_address:"
+                 << conn->peerAddress().toIpPort();
+        conn->forceClose();
+      }
+    });
     if (first_connect_) {
       first_connect_ = false;
       // 注册pb handle
@@ -92,40 +237,126 @@ void ProxyClient::OnProxyConnection(const muduo::net::TcpConnectionPtr &conn) {
     // 发送listen request
     // 重新连接之后需要发送
     MessagePtr message(std::make_shared<proto::Message>());
-    MakeMessage(message.get(), proto::LISTEN_REQUEST, GetSourceEntity());
+    MakeMessage(message.get(), proto::LISTEN_REQUEST, GetSourceEntity(), "",
+                resuming_ ? session_key_ : 0);
     proto::ListenRequest *listen_request =
         message->mutable_body()->mutable_listen_request();
-    uint32_t ip =
-        ntohl(((sockaddr_in *)local_address_.getSockAddr())->sin_addr.s_addr);
-    listen_request->set_self_ipv4(ip);
-    listen_request->set_self_port(local_address_.port());
+    if (local_unix_path_.empty()) {
+      uint32_t ip = ntohl(
+          ((sockaddr_in *)local_address_.getSockAddr())->sin_addr.s_addr);
+      listen_request->set_self_ipv4(ip);
+      listen_request->set_self_port(local_address_.port());
+    } else {
+      listen_request->set_self_port(0);
+    }
     listen_request->set_listen_port(listen_port_);
-    dispatcher_->SendPbRequest(proxy_client_->connection(), message,
-                               std::bind(&ProxyClient::HandleListenResponse,
-                                         this_ptr(), std::placeholders::_1),
-                               nullptr);
+    dispatcher_->SendPbRequest(
+        conn, message,
+        std::bind(&ProxyClient::HandleListenResponse, this_ptr(),
+                  std::placeholders::_1, conn),
+        nullptr);
   } else {
+    liveness_->Stop();
+    bdp_tuner_->Stop();
+    if (resuming_) {
+      // 恢复会话过程中新连接又断开, 等待下次重连
+      LOG_WARN << "proxy connection disconnected while resuming session:"
+               << session_key_;
+      dispatcher_->DropRequests(conn);
+      return;
+    }
+    if (conn == pending_listen_conn_) {
+      pending_listen_conn_.reset();
+    }
+    if (conn != proxy_conn_) {
+      LOG_INFO << "proxy connection not in use disconnected";
+      return;
+    }
     LOG_WARN << "proxy connection disconnected, exist conn count:"
              << clients_.size();
-    loop_->cancel(heartbeat_timer_);
-    std::vector<uint64_t> exist_connections;
-    exist_connections.reserve(clients_.size());
-    for (const auto &connection : clients_) {
-      exist_connections.push_back(connection.first);
-    }
-    for (uint64_t conn_key : exist_connections) {
-      ClientClose(conn_key);
+    if (session_key_ && resume_window_ > 0 &&
+        dispatcher_->PendingBytes() <= MAX_REPLAY_SIZE) {
+      // 保留后端连接, 重连之后恢复会话
+      LOG_INFO << "keep session:" << session_key_
+               << " pending bytes:" << dispatcher_->PendingBytes();
+      resuming_ = true;
+      dispatcher_->Suspend();
+      throttler_->Reset();
+      StopClientRead();
+      // 超过server端保留会话的时间后放弃
+      resume_timer_ = loop_->runAfter(
+          resume_window_, std::bind(&ProxyClient::OnResumeTimeout, this_ptr()));
+      return;
     }
+    CloseAllClients();
+  }
+}
+
+void ProxyClient::CloseAllClients() {
+  std::vector<uint64_t> exist_connections;
+  exist_connections.reserve(clients_.size());
+  for (const auto &connection : clients_) {
+    exist_connections.push_back(connection.first);
+  }
+  for (uint64_t conn_key : exist_connections) {
+    ClientClose(conn_key);
+  }
+}
+
+void ProxyClient::GiveUpResume() {
+  LOG_WARN << "give up session:" << session_key_
+           << ", close all connection, count:" << clients_.size();
+  resuming_ = false;
+  session_key_ = 0;
+  loop_->cancel(resume_timer_);
+  liveness_->Stop();
+  bdp_tuner_->Stop();
+  throttler_->Reset();
+  dispatcher_->Abandon();
+  CloseAllClients();
+}
+
+void ProxyClient::OnResumeTimeout() {
+  if (!resuming_) {
+    return;
+  }
+  GiveUpResume();
+  // 可能已经发出恢复请求, 关闭连接重新建立会话
+  muduo::net::TcpConnectionPtr conn = proxy_client_->Connection();
+  if (conn && conn->connected()) {
+    conn->forceClose();
   }
 }
 
-void ProxyClient::HandleListenResponse(MessagePtr response) {
+void ProxyClient::HandleListenResponse(
+    MessagePtr response, const muduo::net::TcpConnectionPtr &conn) {
+  PROXY_LOOP_CALLBACK("ProxyClient::HandleListenResponse");
   assert(response->head().message_type() == proto::LISTEN_RESPONSE);
   assert(response->body().has_listen_response());
   const proto::ListenResponse &listen_response =
       response->body().listen_response();
-  if (listen_response.rc().retcode() == 0) {
+  if (resuming_) {
+    if (listen_response.rc().retcode() == LISTEN_SUCCESS) {
+      LOG_INFO << "resume session:" << session_key_
+               << " succ, conn count:" << clients_.size();
+      resuming_ = false;
+      loop_->cancel(resume_timer_);
+      proxy_client_->ResetRetryDelay();
+      proxy_conn_ = conn;
+      dispatcher_->Resume(proxy_conn_);
+      ResumeClientRead();
+    } else {
+      LOG_WARN << "resume session:" << session_key_
+               << " failed:" << listen_response.rc().error_message();
+      GiveUpResume();
+      // 等待后端连接都关闭之后重新listen
+      OnProxyConnection(conn);
+    }
+    return;
+  }
+  if (listen_response.rc().retcode() == LISTEN_SUCCESS) {
     session_key_ = listen_response.session_key();
+    proxy_client_->ResetRetryDelay();
   } else {
     start_retcode_ = -1;
   }
@@ -139,6 +370,7 @@ void ProxyClient::HandleListenResponse(MessagePtr response) {
 void ProxyClient::OnNewConnection(const muduo::net::TcpConnectionPtr &conn,
                                   ProxyMessagePtr request_head,
                                   MessagePtr message) {
+  PROXY_LOOP_CALLBACK("ProxyClient::OnNewConnection");
   // 连接到本地
   assert(message->head().message_type() == proto::NEW_CONNECTION_REQUEST);
   assert(message->body().has_new_connection_request());
@@ -149,86 +381,174 @@ void ProxyClient::OnNewConnection(const muduo::net::TcpConnectionPtr &conn,
   uint64_t conn_key = new_connection_request.conn_key();
   LOG_INFO << "proxy connect, conn_key:" << conn_key
            << " origin client addr:" << remote_address.toIpPort()
-           << ", connect to:" << local_address_.toIpPort();
-  std::unique_ptr<TcpClient> tcp_client(new TcpClient(loop_, local_address_));
-  tcp_client->SetConnectionCallback(std::bind(&ProxyClient::OnClientConnection,
-                                              this_ptr(), std::placeholders::_1,
-                                              conn_key, request_head));
-  tcp_client->SetMessageCallback(std::bind(
-      &ProxyClient::OnClientMessage, this_ptr(), std::placeholders::_1,
-      std::placeholders::_2, std::placeholders::_3));
-  tcp_client->Connect();
+           << ", connect to:" << LocalAddress();
+  muduo::net::EventLoop *io_loop = thread_pool_->getNextLoop();
+  std::shared_ptr<TcpClient> tcp_client(
+      local_unix_path_.empty()
+          ? std::make_shared<TcpClient>(io_loop, local_address_)
+          : std::make_shared<TcpClient>(io_loop, local_unix_path_));
   ProxyConnection proxy_connection;
   proxy_connection.conn_key = conn_key;
-  proxy_connection.client_conn = std::move(tcp_client);
+  proxy_connection.client_conn = tcp_client;
   proxy_connection.state = ProxyConnState::CONNECTING;
   proxy_connection.server_open = false;
   proxy_connection.client_open = true;
   proxy_connection.connect_request = message;
   proxy_connection.client_block = false;
-  assert(clients_.find(conn_key) == clients_.end());
-  clients_[conn_key] = std::move(proxy_connection);
+  proxy_connection.connect_start = muduo::Timestamp::now();
+  proxy_connection.connect_latency_us = -1;
+  proxy_connection.bytes_in = 0;
+  proxy_connection.bytes_out = 0;
+  proxy_connection.read_stopped = false;
+  proxy_connection.backend_high_water = false;
+  proxy_connection.output_bytes = 0;
+  proxy_connection.pending_paused = false;
+  proxy_connection.trace.Mark(CLIENT_TRACE_REQUEST,
+                              proxy_connection.connect_start);
+  // conn_key由proxy server分配, 使用同一个slot下标
+  auto result = clients_.Emplace(conn_key, std::move(proxy_connection));
+  assert(result.second);
+  // 放入clients_之后再设置回调, 回调中通过stream直接访问连接状态
+  ProxyConnectionRef stream(&*result.first);
+  tcp_client->SetConnectionCallback(std::bind(&ProxyClient::OnClientConnection,
+                                              this_ptr(), std::placeholders::_1,
+                                              stream, request_head));
+  tcp_client->SetMessageCallback(std::bind(
+      &ProxyClient::OnClientMessage, this_ptr(), std::placeholders::_1,
+      std::placeholders::_2, std::placeholders::_3, stream));
+  tcp_client->Connect();
 }
 
 void ProxyClient::OnClientConnection(const muduo::net::TcpConnectionPtr &conn,
-                                     uint64_t conn_key,
+                                     ProxyConnectionRef stream,
                                      ProxyMessagePtr request_head) {
-  // 添加到记录中
-  // 如果找不到是destroy conn
-  if (clients_.find(conn_key) == clients_.end()) {
-    return;
+  PROXY_LOOP_CALLBACK("ProxyClient::OnClientConnection");
+  // 在io线程中调用, 回调只能在conn所在的loop中设置
+  uint64_t conn_key = stream.key();
+  bool connected = conn->connected();
+  // 连接断开后下一次采样归还输出缓冲占用的内存
+  IoLoopState *io_loop = FindIoLoop(conn->getLoop());
+  if (io_loop && connected) {
+    io_loop->conns[conn_key] = conn;
+  } else if (io_loop) {
+    io_loop->conns.erase(conn_key);
   }
-  ProxyConnection &proxy_connection = clients_[conn_key];
-  if (proxy_connection.state == ProxyConnState::CONNECTING) {
-    LOG_INFO << "conn to server succ, conn_key:" << conn_key
-             << " proxy conn addr:" << conn->localAddress().toIpPort();
-    proxy_connection.client_conn->Connection()->setContext(conn_key);
+  int fd = -1;
+  if (connected) {
+    fd = ConnectionFd(conn);
     // 注册高水位回调
     conn->setHighWaterMarkCallback(
         std::bind(&ProxyClient::OnHighWaterMark, this, false,
-                  std::placeholders::_1, std::placeholders::_2),
-        2 * MB_SIZE);
-    // 连接server成功
-    proxy_connection.state = ProxyConnState::CONNECTED;
-    proxy_connection.server_open = true;
-    // 响应给proxy server
-    MessagePtr response_message = std::make_shared<proto::Message>();
-    MakeResponse(proxy_connection.connect_request.get(),
-                 proto::NEW_CONNECTION_RESPONSE, response_message.get());
-    proto::NewConnectionResponse *response =
-        response_message->mutable_body()->mutable_new_connection_response();
-    response->mutable_rc()->set_retcode(0);
-    dispatcher_->SendPbResponse(proxy_client_->connection(), request_head,
-                                response_message);
-    for (auto &data : proxy_connection.pending_data) {
-      proxy_connection.client_conn->Connection()->send(data.c_str(),
-                                                       data.size());
-    }
-  } else {
-    LOG_INFO << "conn disconnect, conn_key:" << conn_key;
-    assert(conn->disconnected());
-    loop_->queueInLoop(
-        std::bind(&ProxyClient::OnClientClose, this, conn, conn_key));
+                  std::placeholders::_1, std::placeholders::_2, stream),
+        stream_high_water_.load());
   }
+  loop_->runInLoop([=] {
+    ProxyConnection *connection = stream.get();
+    if (connected && (!connection || !connection->client_open)) {
+      // 连接成功的通知还在路上时客户端已经关闭, Stop()对已经建立的连接
+      // 不起作用, 在conn的loop中关闭, RemoveConnection负责销毁
+      LOG_INFO << "client closed before backend connected, conn_key:"
+               << conn_key;
+      conn->forceClose();
+      return;
+    }
+    // 如果找不到是destroy conn
+    if (!connection) {
+      return;
+    }
+    ProxyConnection &proxy_connection = *connection;
+    if (connected) {
+      if (proxy_connection.state != ProxyConnState::CONNECTING) {
+        return;
+      }
+      LOG_INFO << "conn to server succ, conn_key:" << conn_key
+               << " proxy conn addr:" << conn->localAddress().toIpPort();
+      // 连接server成功
+      proxy_connection.state = ProxyConnState::CONNECTED;
+      proxy_connection.server_open = true;
+      proxy_connection.connect_latency_us =
+          muduo::Timestamp::now().microSecondsSinceEpoch() -
+          proxy_connection.connect_start.microSecondsSinceEpoch();
+      connect_latency_.Add(proxy_connection.connect_latency_us);
+      proxy_connection.trace.Mark(CLIENT_TRACE_BACKEND_CONNECT);
+      // 响应给proxy server
+      MessagePtr response_message = std::make_shared<proto::Message>();
+      MakeResponse(proxy_connection.connect_request.get(),
+                   proto::NEW_CONNECTION_RESPONSE, response_message.get());
+      proto::NewConnectionResponse *response =
+          response_message->mutable_body()->mutable_new_connection_response();
+      response->mutable_rc()->set_retcode(0);
+      dispatcher_->SendPbResponse(proxy_conn_, request_head,
+                                  response_message);
+      if (!proxy_connection.pending_data.Empty()) {
+        int64_t pending_bytes = proxy_connection.pending_data.Size();
+        memory_.Charge(MEMORY_PENDING_STREAM, -pending_bytes);
+        std::shared_ptr<ChainBuffer> pending = std::make_shared<ChainBuffer>(
+            std::move(proxy_connection.pending_data));
+        proxy_connection.pending_data.Clear();
+        conn->getLoop()->runInLoop(std::bind(&FlushPending, conn, fd, pending));
+        proxy_connection.trace.Mark(CLIENT_TRACE_FIRST_REQUEST);
+      }
+      if (proxy_connection.pending_paused) {
+        proxy_connection.pending_paused = false;
+        SendResumeSend(conn_key);
+      }
+      SampleOutput(conn_key, &proxy_connection);
+    } else {
+      LOG_INFO << "conn disconnect, conn_key:" << conn_key;
+      assert(conn->disconnected());
+      loop_->queueInLoop(
+          std::bind(&ProxyClient::OnClientClose, this, conn, stream));
+    }
+  });
 }
 
-void ProxyClient::OnClientMessage(const muduo::net::TcpConnectionPtr &conn,
-                                  muduo::net::Buffer *buffer,
-                                  muduo::Timestamp) {
-  uint64_t conn_key = boost::any_cast<uint64_t>(conn->getContext());
+void ProxyClient::OnClientMessage(const muduo::net::TcpConnectionPtr &,
+                                  muduo::net::Buffer *buffer, muduo::Timestamp,
+                                  ProxyConnectionRef stream) {
+  PROXY_LOOP_CALLBACK("ProxyClient::OnClientMessage");
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_CLIENT);
+  // 在io线程中取出数据, 交给loop_封包发送
+  // 数据只拷贝这一次, 之后帧和等待重发的请求都引用同一个Slice
+  Slice data(buffer->retrieveAllAsString());
+  loop_->runInLoop(std::bind(&ProxyClient::SendClientData, this_ptr(),
+                             stream, std::move(data)));
+}
+
+void ProxyClient::SendClientData(ProxyConnectionRef stream,
+                                 const Slice &data) {
+  PROXY_LOOP_CALLBACK("ProxyClient::SendClientData");
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_CLIENT);
+  uint64_t conn_key = stream.key();
+  // 恢复会话过程中的数据保留在dispatcher中, 恢复后重发
+  muduo::net::TcpConnectionPtr proxy_conn = proxy_conn_;
+  if (!proxy_conn || (!proxy_conn->connected() && !resuming_)) {
+    LOG_WARN << "proxy disconnect, drop data, conn_key:" << conn_key
+             << " data_length:" << data.size();
+    return;
+  }
+  total_bytes_in_ += data.size();
+  throttler_->OnSend(conn_key, data.size());
+  ProxyConnection *connection = stream.get();
+  if (connection) {
+    connection->bytes_in += data.size();
+    if (!connection->trace.finished) {
+      connection->trace.Mark(CLIENT_TRACE_FIRST_RESPONSE);
+      trace_stats_.Finish(conn_key, &connection->trace);
+    }
+  }
   DataRequestBody data_request;
-  data_request.length = buffer->readableBytes();
+  data_request.length = data.size();
   data_request.conn_key = conn_key;
-  data_request.data = std::string(buffer->peek(), buffer->readableBytes());
-  buffer->retrieve(buffer->readableBytes());
+  data_request.payload = data;
   ProxyMessage request_head;
   request_head.message_type = DATA_REQUEST;
   request_head.length = data_request.Size();
   request_head.body = &data_request;
-  LOG_TRACE << "receive from server, conn_key:" << conn_key
-            << " data_length:" << data_request.data.size();
+  PROXY_LOG_TRACE << "receive from server, conn_key:" << conn_key
+                  << " data_length:" << data.size();
   dispatcher_->SendRequest(
-      proxy_client_->connection(), &request_head,
+      proxy_conn, &request_head,
       std::bind(&ProxyClient::HandleDataResponse, this_ptr(),
                 std::placeholders::_1, std::placeholders::_2),
       nullptr);
@@ -240,23 +560,46 @@ void ProxyClient::HandleDataResponse(const muduo::net::TcpConnectionPtr &conn,
 
 void ProxyClient::OnNewData(const muduo::net::TcpConnectionPtr &conn,
                             ProxyMessagePtr message) {
+  PROXY_LOOP_CALLBACK("ProxyClient::OnNewData");
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_CLIENT);
   assert(message->message_type == DATA_REQUEST);
   DataRequestBody *request = dynamic_cast<DataRequestBody *>(message->body);
   uint64_t conn_key = request->conn_key;
   DataResponseBody response_body;
-  if (clients_.find(conn_key) != clients_.end()) {
-    LOG_TRACE << "receive from client, conn_key:" << conn_key
-              << " data_length:" << request->data.size();
-    auto &client_connection = clients_[conn_key];
+  response_body.retcode = -1;
+  auto index = clients_.find(conn_key);
+  if (index != clients_.end()) {
+    PROXY_LOG_TRACE << "receive from client, conn_key:" << conn_key
+                    << " data_length:" << request->data.size();
+    auto &client_connection = index->second;
+    client_connection.bytes_out += request->data.size();
+    total_bytes_out_ += request->data.size();
     if (client_connection.state == ProxyConnState::CONNECTING) {
-      client_connection.pending_data.push_back(request->data);
+      // 在途的数据不能拒绝, 超过上限时通知proxy server暂停读客户端
+      client_connection.pending_data.ForceAppend(request->data.data(),
+                                                 request->data.size());
+      memory_.Charge(MEMORY_PENDING_STREAM, request->data.size());
+      if (client_connection.pending_data.Full() &&
+          !client_connection.pending_paused) {
+        LOG_INFO << "pending buffer full, pause conn_key:" << conn_key;
+        client_connection.pending_paused = true;
+        SendPauseSend(conn_key);
+      }
+      response_body.retcode = 0;
     } else {
-      client_connection.client_conn->Connection()->send(request->data.c_str(),
-                                                        request->data.size());
+      // 后端连接在io线程中关闭后Connection()为空, 关闭通知还在路上
+      muduo::net::TcpConnectionPtr backend =
+          client_connection.client_conn->Connection();
+      if (backend) {
+        backend->send(request->data.c_str(), request->data.size());
+        client_connection.trace.Mark(CLIENT_TRACE_FIRST_REQUEST);
+        SampleOutput(conn_key, &client_connection);
+        response_body.retcode = 0;
+      } else {
+        LOG_WARN << "backend of conn_key:" << conn_key
+                 << " already closed, drop data";
+      }
     }
-    response_body.retcode = 0;
-  } else {
-    response_body.retcode = -1;
   }
   ProxyMessage response_head;
   response_head.message_type = DATA_RESPONSE;
@@ -287,15 +630,20 @@ void ProxyClient::OnCloseConnection(const muduo::net::TcpConnectionPtr &conn,
   } else {
     close_connection_response->mutable_rc()->set_retcode(-1);
   }
-  dispatcher_->SendPbResponse(proxy_client_->connection(), request_head,
+  dispatcher_->SendPbResponse(proxy_conn_, request_head,
                               response);
 }
 
 void ProxyClient::OnClientClose(const muduo::net::TcpConnectionPtr &,
-                                uint64_t conn_key) {
+                                ProxyConnectionRef stream) {
+  PROXY_LOOP_CALLBACK("ProxyClient::OnClientClose");
+  uint64_t conn_key = stream.key();
   LOG_INFO << "server shutdown write, conn_key:" << conn_key;
-  assert(clients_.find(conn_key) != clients_.end());
-  ProxyConnection &proxy_connection = clients_[conn_key];
+  if (!stream.get()) {
+    // 客户端先关闭, RemoveConnection已经处理
+    return;
+  }
+  ProxyConnection &proxy_connection = *stream.get();
   proxy_connection.server_open = false;
   LOG_DEBUG << "address: " << &proxy_connection << " conn_key:" << conn_key;
   if (proxy_connection.client_open == true) {
@@ -306,13 +654,13 @@ void ProxyClient::OnClientClose(const muduo::net::TcpConnectionPtr &,
         request_message->mutable_body()->mutable_close_connection_request();
     close_conn_request->set_conn_key(conn_key);
     dispatcher_->SendPbRequest(
-        proxy_client_->connection(), request_message,
+        proxy_conn_, request_message,
         std::bind(&ProxyClient::HandleCloseResponse, this_ptr(),
                   std::placeholders::_1, conn_key),
         nullptr);
   } else {
     LOG_DEBUG << "client already close, conn_key:" << conn_key;
-    RemoveConnection(conn_key, false);
+    RemoveConnection(conn_key);
   }
 }
 
@@ -320,9 +668,9 @@ void ProxyClient::HandleCloseResponse(MessagePtr message, uint64_t conn_key) {
   assert(message->head().message_type() == proto::CLOSE_CONNECTION_RESONSE);
   assert(message->body().has_close_connection_response());
   // 忽略返回码
-  if (clients_.find(conn_key) != clients_.end()) {
-    ProxyConnection &proxy_connection = clients_[conn_key];
-    proxy_connection.server_open = false;
+  auto index = clients_.find(conn_key);
+  if (index != clients_.end()) {
+    index->second.server_open = false;
     RemoveConnection(conn_key);
   } else {
     LOG_WARN << "conn_id:" << conn_key << " already removed";
@@ -330,7 +678,9 @@ void ProxyClient::HandleCloseResponse(MessagePtr message, uint64_t conn_key) {
 }
 
 void ProxyClient::ClientClose(uint64_t conn_key) {
-  auto &client_connection = clients_[conn_key];
+  auto index = clients_.find(conn_key);
+  assert(index != clients_.end());
+  auto &client_connection = index->second;
   LOG_DEBUG << "address: " << &client_connection << " conn_key:" << conn_key;
   if (client_connection.client_open == false) {
     LOG_DEBUG << "connection already call close, conn_key:" << conn_key;
@@ -339,34 +689,124 @@ void ProxyClient::ClientClose(uint64_t conn_key) {
   client_connection.client_open = false;
   if (client_connection.state != ProxyConnState::CONNECTED) {
     LOG_DEBUG << "connection to server not accepted, conn_id:" << conn_key;
-    // 到server连接还没建立成功
+    // 到server连接还没建立成功, 或者已经建立但是loop_还没有收到通知
     client_connection.client_conn->Stop();
-    // 为了防止TcpClient.Connector析构时channel没有reset
-    // 这里应该获取TcpClient对应的loop
-    loop_->runAfter(
-        1.0, std::bind(&ProxyClient::RemoveConnection, this, conn_key, false));
+    // Connector::stop和resetChannel的回调持有Connector, TcpClient可以先析构
+    RemoveConnection(conn_key);
   } else if (client_connection.server_open == true) {
-    client_connection.client_conn->DestroyConn();
+    client_connection.client_conn->GetLoop()->runInLoop(
+        std::bind(&TcpClient::DestroyConn, client_connection.client_conn));
   }
 }
 
-void ProxyClient::RemoveConnection(uint64_t conn_key, bool destroy) {
+void ProxyClient::RemoveConnection(uint64_t conn_key) {
   loop_->queueInLoop([=] {
-    LOG_INFO << "remove connection, conn_key:" << conn_key
-             << ", destroy(bool): " << destroy;
-    if (!clients_.count(conn_key)) {
+    LOG_INFO << "remove connection, conn_key:" << conn_key;
+    auto index = clients_.find(conn_key);
+    if (index == clients_.end()) {
       LOG_WARN << "conn_key:" << conn_key << " already removed";
       return;
     }
-    // 如果到server连接还没建立成功，不能调用DestroyConn
-    if (destroy) {
-      ProxyConnection &proxy_connection = clients_[conn_key];
-      proxy_connection.client_conn->DestroyConn();
+    trace_stats_.Finish(conn_key, &index->second.trace);
+    throttler_->Remove(conn_key);
+    ReleaseMemory(conn_key, index->second);
+    std::shared_ptr<TcpClient> client_conn =
+        std::move(index->second.client_conn);
+    clients_.erase(index);
+    // 连接可能在loop_看到CONNECTING时已经建立, 或者已经断开但还没有销毁
+    // 都要从poller中移除, 没有连接时DestroyConn直接返回
+    client_conn->GetLoop()->runInLoop(
+        std::bind(&TcpClient::DestroyConn, client_conn));
+    // TcpClient在它自己的loop中析构, Connector由它排队的回调持有
+    client_conn->GetLoop()->queueInLoop([client_conn] {});
+    if (clients_.empty() && pending_listen_conn_) {
+      LOG_INFO << "all connection removed, listen now";
+      muduo::net::TcpConnectionPtr conn = std::move(pending_listen_conn_);
+      pending_listen_conn_.reset();
+      OnProxyConnection(conn);
     }
-    clients_.erase(conn_key);
   });
 }
 
+void ProxyClient::CheckMemory() {
+  PROXY_LOOP_CALLBACK("ProxyClient::CheckMemory");
+  memory_.Set(MEMORY_TUNNEL_OUTPUT, TunnelOutputBytes());
+  for (auto index = buffered_conns_.begin();
+       index != buffered_conns_.end();) {
+    uint64_t conn_key = *index++;
+    auto connection = clients_.find(conn_key);
+    if (connection != clients_.end()) {
+      SampleOutput(conn_key, &connection->second);
+    }
+  }
+  const MemoryBudget &budget = MemoryBudget::Global();
+  if (budget.Pressure()) {
+    LOG_WARN << "memory used:" << budget.Used() << " limit:" << budget.Limit()
+             << ", client used:" << memory_.Total();
+    throttler_->Hold();
+  } else if (budget.Relieved()) {
+    throttler_->Release();
+  }
+}
+
+void ProxyClient::SampleOutput(uint64_t conn_key,
+                               ProxyConnection *connection) {
+  muduo::net::TcpConnectionPtr conn = connection->client_conn->Connection();
+  if (!conn || conn->getLoop() != loop_) {
+    return;
+  }
+  size_t output_bytes = conn->outputBuffer()->readableBytes();
+  memory_.Charge(MEMORY_STREAM_OUTPUT,
+                 static_cast<int64_t>(output_bytes) -
+                     static_cast<int64_t>(connection->output_bytes));
+  connection->output_bytes = output_bytes;
+  if (output_bytes) {
+    buffered_conns_.insert(conn_key);
+  } else {
+    buffered_conns_.erase(conn_key);
+  }
+}
+
+void ProxyClient::ReleaseMemory(uint64_t conn_key,
+                                const ProxyConnection &connection) {
+  memory_.Charge(MEMORY_PENDING_STREAM,
+                 -static_cast<int64_t>(connection.pending_data.Size()));
+  memory_.Charge(MEMORY_STREAM_OUTPUT,
+                 -static_cast<int64_t>(connection.output_bytes));
+  buffered_conns_.erase(conn_key);
+}
+
+void ProxyClient::SweepBuffers() {
+  PROXY_LOOP_CALLBACK("ProxyClient::SweepBuffers");
+  // 每个loop都要缩小SlabPool的缓存, 没有连接的loop也要处理
+  std::map<muduo::net::EventLoop *, std::vector<muduo::net::TcpConnectionPtr>>
+      loop_conns;
+  for (muduo::net::EventLoop *loop : thread_pool_->getAllLoops()) {
+    loop_conns[loop];
+  }
+  muduo::net::TcpConnectionPtr proxy_conn = proxy_client_->Connection();
+  if (proxy_conn) {
+    loop_conns[loop_].push_back(proxy_conn);
+  }
+  for (const auto &item : clients_) {
+    muduo::net::TcpConnectionPtr conn = item.second.client_conn->Connection();
+    if (conn) {
+      loop_conns[conn->getLoop()].push_back(conn);
+    }
+  }
+  for (const auto &item : loop_conns) {
+    std::vector<muduo::net::TcpConnectionPtr> conns = item.second;
+    item.first->runInLoop([conns] {
+      size_t freed = 0;
+      for (const muduo::net::TcpConnectionPtr &conn : conns) {
+        freed += BufferSweeper::ShrinkConnection(conn);
+      }
+      freed += BufferSweeper::TrimSlabs();
+      BufferSweeper::ReturnFreed(freed);
+    });
+  }
+}
+
 void ProxyClient::HandlePauseSendRequest(const muduo::net::TcpConnectionPtr,
                                          ProxyMessagePtr request_head,
                                          MessagePtr message) {
@@ -381,7 +821,7 @@ void ProxyClient::HandlePauseSendRequest(const muduo::net::TcpConnectionPtr,
       pause_send_response->mutable_body()->mutable_pause_send_response();
   StopClientRead(conn_key, true);
   response_body->mutable_rc()->set_retcode(0);
-  dispatcher_->SendPbResponse(proxy_client_->connection(), request_head,
+  dispatcher_->SendPbResponse(proxy_conn_, request_head,
                               pause_send_response);
 }
 
@@ -400,24 +840,29 @@ void ProxyClient::HandleResumeSendRequest(const muduo::net::TcpConnectionPtr,
       resume_send_response->mutable_body()->mutable_resume_send_response();
   ResumeClientRead(conn_key, true);
   response_body->mutable_rc()->set_retcode(0);
-  dispatcher_->SendPbResponse(proxy_client_->connection(), request_head,
+  dispatcher_->SendPbResponse(proxy_conn_, request_head,
                               resume_send_response);
 }
 
 void ProxyClient::StopClientRead(uint64_t conn_id, bool client_block) {
+  PROXY_LOOP_CALLBACK("ProxyClient::StopClientRead");
   if (conn_id) {
     auto index = clients_.find(conn_id);
     if (index == clients_.end()) {
       LOG_WARN << "stop conn_id:" << conn_id
                << " read failed, not found connection";
     } else {
-      if ((index->second).server_open) {
-        (index->second).client_conn->Connection()->stopRead();
+      muduo::net::TcpConnectionPtr backend =
+          (index->second).client_conn->Connection();
+      if ((index->second).server_open && backend) {
+        backend->stopRead();
         if (client_block) {
           // 标识client链接阻塞
           (index->second).client_block = true;
         }
-        LOG_INFO << "stop conn_id:" << conn_id << " read succ";
+        (index->second).read_stopped = true;
+        UpdateBlocked(&index->second);
+        LOG_DEBUG << "stop conn_id:" << conn_id << " read succ";
       } else {
         LOG_WARN << "already close conn_id:" << conn_id;
       }
@@ -432,6 +877,7 @@ void ProxyClient::StopClientRead(uint64_t conn_id, bool client_block) {
 }
 
 void ProxyClient::ResumeClientRead(uint64_t conn_id, bool client_block) {
+  PROXY_LOOP_CALLBACK("ProxyClient::ResumeClientRead");
   if (conn_id) {
     auto index = clients_.find(conn_id);
     if (index == clients_.end()) {
@@ -439,12 +885,19 @@ void ProxyClient::ResumeClientRead(uint64_t conn_id, bool client_block) {
                << " read failed, not found connection";
     } else {
       ProxyConnection &conn = index->second;
+      muduo::net::TcpConnectionPtr backend = conn.client_conn->Connection();
       if (conn.client_block && !client_block) {
-        LOG_INFO << "not resume conn_id:" << conn_id << " read, client block";
-      } else if (conn.client_open && conn.server_open) {
-        (index->second).client_conn->Connection()->startRead();
+        LOG_DEBUG << "not resume conn_id:" << conn_id << " read, client block";
+      } else if (client_block && throttler_->Paused(conn_id)) {
+        // proxy连接拥塞暂停的连接由throttler_恢复
+        conn.client_block = false;
+        LOG_DEBUG << "not resume conn_id:" << conn_id << " read, throttled";
+      } else if (conn.client_open && conn.server_open && backend) {
+        backend->startRead();
         (index->second).client_block = false;
-        LOG_INFO << "resume conn_id:" << conn_id << " read succ";
+        (index->second).read_stopped = false;
+        UpdateBlocked(&index->second);
+        LOG_DEBUG << "resume conn_id:" << conn_id << " read succ";
       }
     }
     return;
@@ -458,51 +911,102 @@ void ProxyClient::ResumeClientRead(uint64_t conn_id, bool client_block) {
 
 void ProxyClient::OnHighWaterMark(bool is_proxy_conn,
                                   const muduo::net::TcpConnectionPtr &conn,
-                                  size_t) {
+                                  size_t, ProxyConnectionRef stream) {
   if (is_proxy_conn) {
-    if (proxy_client_->connection()->outputBuffer()->readableBytes() > 0) {
-      StopClientRead();
-      proxy_client_->connection()->setWriteCompleteCallback(std::bind(
-          &ProxyClient::OnWriteComplete, this, true, std::placeholders::_1));
+    if (conn->outputBuffer()->readableBytes() > 0) {
+      throttler_->OnHighWater(bdp_tuner_->Current().tunnel_high_water);
+      conn->setWriteCompleteCallback(
+          std::bind(&ProxyClient::OnWriteComplete, this, true,
+                    std::placeholders::_1, ProxyConnectionRef()));
     }
   } else {
     // 客户端接收速度慢,通知proxy client
-    uint64_t conn_id = boost::any_cast<uint64_t>(conn->getContext());
-    MessagePtr message = std::make_shared<proto::Message>();
-    MakeMessage(message.get(), proto::PAUSE_SEND_REQUEST, GetSourceEntity());
-    proto::PauseSendRequest *pause_send_request =
-        message->mutable_body()->mutable_pause_send_request();
-    pause_send_request->set_conn_key(conn_id);
-    dispatcher_->SendPbRequest(
-        proxy_client_->connection(), message,
-        std::bind(&ProxyClient::EntryPauseSend, this_ptr(),
-                  std::placeholders::_1, conn_id),
-        nullptr);
-    conn->setWriteCompleteCallback(std::bind(
-        &ProxyClient::OnWriteComplete, this, false, std::placeholders::_1));
+    // 在io线程中调用, 请求需要在loop_中发送
+    conn->setWriteCompleteCallback(
+        std::bind(&ProxyClient::OnWriteComplete, this, false,
+                  std::placeholders::_1, stream));
+    loop_->runInLoop([=] {
+      ProxyConnection *connection = stream.get();
+      if (connection) {
+        connection->backend_high_water = true;
+        UpdateBlocked(connection);
+      }
+      SendPauseSend(stream.key());
+    });
   }
 }
 
 void ProxyClient::OnWriteComplete(bool is_proxy_conn,
-                                  const muduo::net::TcpConnectionPtr &conn) {
+                                  const muduo::net::TcpConnectionPtr &conn,
+                                  ProxyConnectionRef stream) {
   if (is_proxy_conn) {
-    ResumeClientRead();
-    proxy_client_->connection()->setWriteCompleteCallback(
-        muduo::net::WriteCompleteCallback());
+    throttler_->OnDrain();
+    conn->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
   } else {
     // 通知proxy client可以继续发送
-    uint64_t conn_id = boost::any_cast<uint64_t>(conn->getContext());
-    MessagePtr message = std::make_shared<proto::Message>();
-    MakeMessage(message.get(), proto::RESUME_SEND_REQUEST, GetSourceEntity());
-    proto::ResumeSendRequest *resume_send_request =
-        message->mutable_body()->mutable_resume_send_request();
-    resume_send_request->set_conn_key(conn_id);
-    dispatcher_->SendPbRequest(
-        proxy_client_->connection(), message,
-        std::bind(&ProxyClient::EntryResumeSend, this_ptr(),
-                  std::placeholders::_1, conn_id),
-        nullptr);
     conn->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
+    loop_->runInLoop([=] {
+      ProxyConnection *connection = stream.get();
+      if (connection) {
+        connection->backend_high_water = false;
+        UpdateBlocked(connection);
+      }
+      SendResumeSend(stream.key());
+    });
+  }
+}
+
+void ProxyClient::SendPauseSend(uint64_t conn_key) {
+  MessagePtr message = std::make_shared<proto::Message>();
+  MakeMessage(message.get(), proto::PAUSE_SEND_REQUEST, GetSourceEntity());
+  proto::PauseSendRequest *pause_send_request =
+      message->mutable_body()->mutable_pause_send_request();
+  pause_send_request->set_conn_key(conn_key);
+  dispatcher_->SendPbRequest(
+      proxy_conn_, message,
+      std::bind(&ProxyClient::EntryPauseSend, this_ptr(),
+                std::placeholders::_1, conn_key),
+      nullptr);
+}
+
+void ProxyClient::SendResumeSend(uint64_t conn_key) {
+  MessagePtr message = std::make_shared<proto::Message>();
+  MakeMessage(message.get(), proto::RESUME_SEND_REQUEST, GetSourceEntity());
+  proto::ResumeSendRequest *resume_send_request =
+      message->mutable_body()->mutable_resume_send_request();
+  resume_send_request->set_conn_key(conn_key);
+  dispatcher_->SendPbRequest(
+      proxy_conn_, message,
+      std::bind(&ProxyClient::EntryResumeSend, this_ptr(),
+                std::placeholders::_1, conn_key),
+      nullptr);
+}
+
+void ProxyClient::ApplyBdpSettings(const BdpSettings &settings) {
+  // 恢复会话过程中proxy_conn_还是旧连接, 使用TcpClient当前的连接
+  muduo::net::TcpConnectionPtr proxy_conn = proxy_client_->Connection();
+  if (proxy_conn) {
+    proxy_conn->setHighWaterMarkCallback(
+        std::bind(&ProxyClient::OnHighWaterMark, this, true,
+                  std::placeholders::_1, std::placeholders::_2,
+                  ProxyConnectionRef()),
+        settings.tunnel_high_water);
+  }
+  stream_high_water_ = settings.stream_high_water;
+  // 后端连接在io线程中, 高水位只能在它自己的loop中修改
+  for (auto &item : clients_) {
+    if (!item.second.client_conn) {
+      continue;
+    }
+    muduo::net::TcpConnectionPtr conn = item.second.client_conn->Connection();
+    if (conn) {
+      muduo::net::HighWaterMarkCallback callback = std::bind(
+          &ProxyClient::OnHighWaterMark, this, false, std::placeholders::_1,
+          std::placeholders::_2, ProxyConnectionRef(&item));
+      conn->getLoop()->runInLoop(
+          std::bind(&muduo::net::TcpConnection::setHighWaterMarkCallback, conn,
+                    callback, settings.stream_high_water));
+    }
   }
 }
 
@@ -518,7 +1022,7 @@ void ProxyClient::HandleHeartbeat(const muduo::net::TcpConnectionPtr,
   proto::Pong *response_body = pong_response->mutable_body()->mutable_pong();
   response_body->mutable_rc()->set_retcode(0);
   response_body->set_time(time(nullptr));
-  dispatcher_->SendPbResponse(proxy_client_->connection(), request_head,
+  dispatcher_->SendPbResponse(proxy_conn_, request_head,
                               pong_response);
 }
 
@@ -528,7 +1032,7 @@ void ProxyClient::SendHeartBeat() {
   proto::Ping *ping_request = message->mutable_body()->mutable_ping();
   ping_request->set_time(time(nullptr));
   LOG_DEBUG << "ping to server, time:" << ping_request->time();
-  dispatcher_->SendPbRequest(proxy_client_->connection(), message,
+  dispatcher_->SendPbRequest(proxy_conn_, message,
                              std::bind(&ProxyClient::EntryHeartBeat, this_ptr(),
                                        std::placeholders::_1),
                              nullptr);
@@ -6,18 +6,41 @@
 #include <muduo/base/Mutex.h>
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/EventLoopThread.h>
+#include <muduo/net/EventLoopThreadPool.h>
 #include <muduo/net/InetAddress.h>
-#include <muduo/net/TcpClient.h>
+#include <muduo/net/http/HttpRequest.h>
+#include <muduo/net/http/HttpResponse.h>
+#include <muduo/net/http/HttpServer.h>
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "common/bdp_tuner.h"
+#include "common/buffer_sweeper.h"
+#include "common/chain_buffer.h"
+#include "common/conn_trace.h"
+#include "common/histogram.h"
+#include "common/loop_monitor.h"
+#include "common/memory_budget.h"
+#include "common/slot_map.h"
 #include "common/message_dispatch.h"
+#include "common/stream_throttler.h"
+#include "common/tunnel_liveness.h"
 #include "tcp_client.h"
 
+// ProxyConnection::trace的时间点, 和ProxyClient::trace_stats_中名字的顺序一致
+enum ClientTracePoint {
+  CLIENT_TRACE_REQUEST,          // 收到NEW_CONNECTION_REQUEST
+  CLIENT_TRACE_BACKEND_CONNECT,  // 连接后端成功
+  CLIENT_TRACE_FIRST_REQUEST,    // 第一次写数据给后端
+  CLIENT_TRACE_FIRST_RESPONSE,   // 第一次收到后端的数据
+};
+
 enum class ProxyConnState : uint32_t {
   INIT_STATE,
   CONNECTING,
@@ -26,13 +49,64 @@ enum class ProxyConnState : uint32_t {
 
 struct ProxyConnection {
   uint64_t conn_key;
-  std::unique_ptr<TcpClient> client_conn;
+  // client_conn运行在io线程, 需要在它自己的loop中析构
+  std::shared_ptr<TcpClient> client_conn;
   ProxyConnState state;
   bool server_open;  // 连接server是否成功
   bool client_open;  // client是否连接
   MessagePtr connect_request;
-  std::vector<std::string> pending_data;
+  // 连接后端成功之前收到的数据, 满了之后通知proxy server暂停
+  ChainBuffer pending_data;
+  bool pending_paused;
   bool client_block;
+  // 以下统计都在loop_中更新
+  muduo::Timestamp connect_start;
+  int64_t connect_latency_us;  // 连接后端成功前为-1
+  uint64_t bytes_in;           // 后端发往隧道
+  uint64_t bytes_out;          // 隧道写入后端
+  bool read_stopped;           // 停止读后端
+  bool backend_high_water;     // 后端写缓冲超过高水位
+  size_t output_bytes;         // 最近一次采样的后端写缓冲, 已计入memory_
+  // 进入阻塞状态的时间, 不阻塞时为invalid
+  muduo::Timestamp blocked_since;
+  ConnTrace trace;
+};
+
+// 绑定到后端连接的回调中, 直接访问clients_中的连接状态
+typedef SlotRef<ProxyConnection> ProxyConnectionRef;
+
+// 一个io线程中的后端连接, 除快照外只在该io线程中访问
+// 定时采样输出缓冲, 变化量交给loop_计入memory_, 同时发布快照
+// admin接口在loop_中读取快照, 不等待io线程
+struct IoLoopState {
+  IoLoopState(muduo::net::EventLoop *io_loop, LoopMonitor *loop_monitor)
+      : loop(io_loop), monitor(loop_monitor), charged_bytes(0) {}
+  muduo::net::EventLoop *loop;
+  LoopMonitor *monitor;
+  // 已经建立的后端连接, conn_key => conn
+  std::unordered_map<uint64_t, muduo::net::TcpConnectionPtr> conns;
+  // 已经计入MEMORY_STREAM_OUTPUT的字节数
+  int64_t charged_bytes;
+  muduo::MutexLock mutex;
+  // 输出缓冲不为空的后端连接, conn_key => 字节数
+  std::unordered_map<uint64_t, size_t> backlog GUARDED_BY(mutex);
+  LoopMonitor::Stats loop_stats GUARDED_BY(mutex);
+};
+
+// admin接口输出的单个连接状态
+struct StreamStats {
+  uint64_t conn_key = 0;
+  ProxyConnState state = ProxyConnState::INIT_STATE;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  // 等待连接成功的数据和后端连接写缓冲中的数据
+  size_t backlog_bytes = 0;
+  // 还在连接中时为已等待的时间
+  int64_t connect_us = 0;
+  int64_t blocked_us = 0;
+  bool read_stopped = false;
+  bool client_block = false;
+  bool backend_high_water = false;
 };
 
 class ProxyClient : public std::enable_shared_from_this<ProxyClient> {
@@ -40,19 +114,48 @@ class ProxyClient : public std::enable_shared_from_this<ProxyClient> {
   ProxyClient(muduo::net::EventLoop *loop,
               const muduo::net::InetAddress &server_address,
               const muduo::net::InetAddress &local_address,
-              uint16_t listen_port)
+              uint16_t listen_port, int io_thread_num = 0)
       : loop_(loop),
         dispatcher_(new MessageDispatch(loop_)),
         source_entity_(0),
         server_address_(server_address),
         local_address_(local_address),
         listen_port_(listen_port),
+        io_thread_num_(io_thread_num),
         start_finish_(false),
         start_retcode_(0),
         cond_(mutex_),
         session_key_(0),
-        first_connect_(true) {}
+        resuming_(false),
+        resume_window_(30.0),
+        first_connect_(true),
+        total_bytes_in_(0),
+        total_bytes_out_(0),
+        trace_stats_("client", {"request", "backend_connect",
+                                "first_request", "first_response"}),
+        admin_port_(0),
+        stream_high_water_(BdpTuner::Default().stream_high_water) {}
+  // 后端服务监听unix domain socket
+  ProxyClient(muduo::net::EventLoop *loop,
+              const muduo::net::InetAddress &server_address,
+              const std::string &local_unix_path, uint16_t listen_port,
+              int io_thread_num = 0)
+      : ProxyClient(loop, server_address, muduo::net::InetAddress(),
+                    listen_port, io_thread_num) {
+    local_unix_path_ = local_unix_path;
+  }
   int Start();
+  // 在Start之前调用, 在127.0.0.1:port上提供/metrics和/streams
+  void EnableAdmin(uint16_t port) { admin_port_ = port; }
+  // 在Start之前调用, proxy连接断开后等待恢复会话的时间(s), 0表示不恢复
+  // 应该和server的session_grace一致
+  void SetResumeWindow(double seconds) { resume_window_ = seconds; }
+  // 后端连接数, 在loop_中调用
+  size_t ConnectionCount() const { return clients_.size(); }
+  // 发出的DATA_REQUEST帧数, 在loop_中调用
+  uint64_t DataFramesOut() const {
+    return dispatcher_->Stats().data_frames_out;
+  }
   void OnMessage(const muduo::net::TcpConnectionPtr &conn,
                  muduo::net::Buffer *buf, muduo::Timestamp time) {
     dispatcher_->OnMessage(conn, buf, time);
@@ -64,17 +167,26 @@ class ProxyClient : public std::enable_shared_from_this<ProxyClient> {
                  ProxyMessagePtr message);
   void OnCloseConnection(const muduo::net::TcpConnectionPtr &conn,
                          ProxyMessagePtr request_head, MessagePtr message);
-  void HandleListenResponse(MessagePtr message);
+  void HandleListenResponse(MessagePtr message,
+                            const muduo::net::TcpConnectionPtr &conn);
+  // 后端连接的回调都绑定了stream, 不再通过context和conn_key查找连接
   void OnClientConnection(const muduo::net::TcpConnectionPtr &,
-                          uint64_t conn_key, ProxyMessagePtr request_head);
+                          ProxyConnectionRef stream,
+                          ProxyMessagePtr request_head);
   void OnClientMessage(const muduo::net::TcpConnectionPtr &,
-                       muduo::net::Buffer *buffer, muduo::Timestamp);
-  void OnClientClose(const muduo::net::TcpConnectionPtr &, uint64_t conn_key);
+                       muduo::net::Buffer *buffer, muduo::Timestamp,
+                       ProxyConnectionRef stream);
+  void SendClientData(ProxyConnectionRef stream, const Slice &data);
+  void OnClientClose(const muduo::net::TcpConnectionPtr &,
+                     ProxyConnectionRef stream);
   void HandleDataResponse(const muduo::net::TcpConnectionPtr &conn,
                           ProxyMessagePtr response);
   void HandleCloseResponse(MessagePtr message, uint64_t conn_key);
   void EntryPauseSend(MessagePtr, uint64_t conn_id);
   void EntryResumeSend(MessagePtr, uint64_t conn_id);
+  // 通知proxy server停止/恢复读conn_key对应的客户端连接, 在loop_中调用
+  void SendPauseSend(uint64_t conn_key);
+  void SendResumeSend(uint64_t conn_key);
   void HandlePauseSendRequest(const muduo::net::TcpConnectionPtr,
                               ProxyMessagePtr request_head, MessagePtr message);
   void HandleResumeSendRequest(const muduo::net::TcpConnectionPtr,
@@ -87,32 +199,108 @@ class ProxyClient : public std::enable_shared_from_this<ProxyClient> {
  private:
   std::shared_ptr<ProxyClient> this_ptr() { return shared_from_this(); }
   void StartProxyService();
+  // io线程启动时在该线程中调用
+  void OnIoThreadInit(muduo::net::EventLoop *loop);
   uint32_t GetSourceEntity() { return ++source_entity_; }
+  std::string LocalAddress() const {
+    return local_unix_path_.empty() ? local_address_.toIpPort()
+                                    : "unix:" + local_unix_path_;
+  }
   void ClientClose(uint64_t conn_key);
-  void RemoveConnection(uint64_t conn_key, bool destroy = true);
+  void CloseAllClients();
+  // 放弃恢复会话, 关闭所有后端连接
+  void GiveUpResume();
+  void OnResumeTimeout();
+  // 在后端连接的loop中销毁已经建立的连接, 之后TcpClient在该loop中析构
+  void RemoveConnection(uint64_t conn_key);
   void StopClientRead(uint64_t conn_id = 0, bool client_block = false);
   void ResumeClientRead(uint64_t conn_id = 0, bool client_block = false);
+  // proxy连接的stream为空
   void OnHighWaterMark(bool is_proxy_conn, const muduo::net::TcpConnectionPtr &,
-                       size_t);
-  void OnWriteComplete(bool is_proxy_conn,
-                       const muduo::net::TcpConnectionPtr &);
+                       size_t, ProxyConnectionRef stream);
+  void OnWriteComplete(bool is_proxy_conn, const muduo::net::TcpConnectionPtr &,
+                       ProxyConnectionRef stream);
   void SendHeartBeat();
+  // 按带宽时延积调整proxy连接和后端连接的高水位
+  void ApplyBdpSettings(const BdpSettings &settings);
+  size_t TunnelOutputBytes() const {
+    return proxy_conn_ ? proxy_conn_->outputBuffer()->readableBytes() : 0;
+  }
+  // 采样输出缓冲, 超过内存预算时暂停发送最多的后端连接
+  void CheckMemory();
+  // 只处理loop_中的后端连接, io线程中的由SampleIoLoop采样
+  void SampleOutput(uint64_t conn_key, ProxyConnection *connection);
+  // 在io线程中调用, loop_不是io线程时返回nullptr
+  IoLoopState *FindIoLoop(muduo::net::EventLoop *loop);
+  // 在state->loop中定时调用
+  void SampleIoLoop(IoLoopState *state);
+  // 各io线程最近一次发布的快照, 在loop_中调用
+  std::vector<IoLoopState *> IoLoops();
+  // 连接删除时归还缓存数据和输出缓冲占用的内存
+  void ReleaseMemory(uint64_t conn_key, const ProxyConnection &connection);
+  // 缩小proxy连接和后端连接突发之后的缓冲, 每个loop各自处理
+  void SweepBuffers();
+  // admin接口, 在proxy_client_admin.cc中实现, 都在loop_中调用
+  void StartAdmin();
+  void OnAdminRequest(const muduo::net::HttpRequest &request,
+                      muduo::net::HttpResponse *response);
+  std::vector<StreamStats> CollectStreams();
+  std::string CollectMetrics();
+  std::string DumpStreams(const std::string &query);
   muduo::net::EventLoop *loop_;
+  // 在dispatcher_之前构造, dispatcher_析构时还会使用
+  MemoryAccount memory_;
   std::unique_ptr<MessageDispatch> dispatcher_;
+  std::unique_ptr<TunnelLiveness> liveness_;
+  std::unique_ptr<BdpTuner> bdp_tuner_;
+  std::unique_ptr<StreamThrottler> throttler_;
   uint32_t source_entity_;
   muduo::net::InetAddress server_address_;
   muduo::net::InetAddress local_address_;
+  // 不为空时通过unix domain socket连接后端, 忽略local_address_
+  std::string local_unix_path_;
   uint16_t listen_port_;
+  // 0表示后端连接和proxy连接都在loop_中处理
+  int io_thread_num_;
+  std::shared_ptr<muduo::net::EventLoopThreadPool> thread_pool_;
+  // loop_和每个io线程各一个
+  muduo::MutexLock monitors_mutex_;
+  std::vector<std::unique_ptr<LoopMonitor>> loop_monitors_
+      GUARDED_BY(monitors_mutex_);
+  // 每个io线程一个, 不包括loop_, 启动之后不再修改
+  std::vector<std::unique_ptr<IoLoopState>> io_loops_
+      GUARDED_BY(monitors_mutex_);
   bool start_finish_;
   int start_retcode_;
   muduo::MutexLock mutex_;
   muduo::Condition cond_ GUARDED_BY(mutex_);
-  std::unique_ptr<muduo::net::TcpClient> proxy_client_;
+  std::unique_ptr<TcpClient> proxy_client_;
+  // 当前会话使用的proxy连接, 恢复会话完成前仍是断开的旧连接
+  muduo::net::TcpConnectionPtr proxy_conn_;
+  // 等待后端连接全部关闭之后再发送listen的proxy连接
+  muduo::net::TcpConnectionPtr pending_listen_conn_;
   uint64_t session_key_;
-  std::unordered_map<uint64_t, ProxyConnection> clients_;
+  // proxy连接断开后等待恢复会话
+  bool resuming_;
+  double resume_window_;
+  muduo::net::TimerId resume_timer_;
+  muduo::net::TimerId memory_timer_;
+  muduo::net::TimerId sweep_timer_;
+  // 输出缓冲不为空的后端连接
+  std::unordered_set<uint64_t> buffered_conns_;
+  // 按proxy server分配的conn_key中的slot下标保存
+  SlotMap<ProxyConnection> clients_;
   bool first_connect_;
   std::once_flag start_flag_;
-  muduo::net::TimerId heartbeat_timer_;
+  // 包括已经关闭的连接
+  uint64_t total_bytes_in_;
+  uint64_t total_bytes_out_;
+  Histogram connect_latency_;
+  ConnTraceStats trace_stats_;
+  uint16_t admin_port_;
+  std::unique_ptr<muduo::net::HttpServer> admin_server_;
+  // 新建后端连接使用的高水位, 在io线程中读取
+  std::atomic<size_t> stream_high_water_;
 };
 
 #endif  // CLIENT_PROXY_CLIENT_H_
@@ -0,0 +1,332 @@
+// Copyright [2021] zhangke
+
+#include <muduo/base/Logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "client/proxy_client.h"
+#include "common/prometheus.h"
+
+namespace {
+
+// query形如 [?]a=1&b=2, 找不到时返回空
+std::string QueryParam(const std::string &query, const std::string &key) {
+  size_t start = (!query.empty() && query[0] == '?') ? 1 : 0;
+  while (start < query.size()) {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    size_t equal = query.find('=', start);
+    if (equal < end && query.compare(start, equal - start, key) == 0) {
+      return query.substr(equal + 1, end - equal - 1);
+    }
+    start = end + 1;
+  }
+  return "";
+}
+
+const char *StateName(ProxyConnState state) {
+  switch (state) {
+    case ProxyConnState::CONNECTING:
+      return "connecting";
+    case ProxyConnState::CONNECTED:
+      return "connected";
+    default:
+      return "init";
+  }
+}
+
+}  // namespace
+
+void ProxyClient::StartAdmin() {
+  // 只监听本机, 不对外暴露
+  muduo::net::InetAddress address("127.0.0.1", admin_port_);
+  admin_server_.reset(
+      new muduo::net::HttpServer(loop_, address, "proxy_client_admin"));
+  admin_server_->setHttpCallback(std::bind(&ProxyClient::OnAdminRequest, this,
+                                           std::placeholders::_1,
+                                           std::placeholders::_2));
+  admin_server_->start();
+  LOG_INFO << "admin listen on:" << address.toIpPort();
+}
+
+void ProxyClient::OnAdminRequest(const muduo::net::HttpRequest &request,
+                                 muduo::net::HttpResponse *response) {
+  PROXY_LOOP_CALLBACK("ProxyClient::OnAdminRequest");
+  if (request.path() == "/metrics") {
+    response->setContentType("text/plain; version=0.0.4");
+    response->setBody(CollectMetrics());
+  } else if (request.path() == "/streams") {
+    response->setContentType("text/plain");
+    response->setBody(DumpStreams(request.query()));
+  } else {
+    response->setStatusCode(muduo::net::HttpResponse::k404NotFound);
+    response->setStatusMessage("Not Found");
+    response->setCloseConnection(true);
+    return;
+  }
+  response->setStatusCode(muduo::net::HttpResponse::k200Ok);
+  response->setStatusMessage("OK");
+}
+
+std::vector<StreamStats> ProxyClient::CollectStreams() {
+  int64_t now_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+  std::vector<StreamStats> streams;
+  streams.reserve(clients_.size());
+  // io线程中后端连接的写缓冲来自最近一次快照, 最多晚100ms
+  std::unordered_map<uint64_t, size_t> backlog;
+  for (IoLoopState *state : IoLoops()) {
+    muduo::MutexLockGuard lock(state->mutex);
+    backlog.insert(state->backlog.begin(), state->backlog.end());
+  }
+  for (const auto &item : clients_) {
+    const ProxyConnection &connection = item.second;
+    StreamStats stream;
+    stream.conn_key = connection.conn_key;
+    stream.state = connection.state;
+    stream.bytes_in = connection.bytes_in;
+    stream.bytes_out = connection.bytes_out;
+    stream.backlog_bytes = connection.pending_data.Size();
+    stream.connect_us =
+        connection.connect_latency_us >= 0
+            ? connection.connect_latency_us
+            : now_us - connection.connect_start.microSecondsSinceEpoch();
+    if (connection.blocked_since.valid()) {
+      stream.blocked_us =
+          now_us - connection.blocked_since.microSecondsSinceEpoch();
+    }
+    stream.read_stopped = connection.read_stopped;
+    stream.client_block = connection.client_block;
+    stream.backend_high_water = connection.backend_high_water;
+    if (connection.client_conn &&
+        connection.state == ProxyConnState::CONNECTED) {
+      muduo::net::TcpConnectionPtr conn = connection.client_conn->Connection();
+      if (conn && conn->getLoop() == loop_) {
+        stream.backlog_bytes += conn->outputBuffer()->readableBytes();
+      } else {
+        auto bytes = backlog.find(connection.conn_key);
+        if (bytes != backlog.end()) {
+          stream.backlog_bytes += bytes->second;
+        }
+      }
+    }
+    streams.push_back(stream);
+  }
+  return streams;
+}
+
+std::string ProxyClient::CollectMetrics() {
+  PrometheusWriter writer;
+  std::vector<StreamStats> streams = CollectStreams();
+  size_t connecting = 0, backlog = 0;
+  size_t read_stopped = 0, client_block = 0, backend_high_water = 0;
+  for (const StreamStats &stream : streams) {
+    if (stream.state != ProxyConnState::CONNECTED) {
+      ++connecting;
+    }
+    backlog += stream.backlog_bytes;
+    read_stopped += stream.read_stopped;
+    client_block += stream.client_block;
+    backend_high_water += stream.backend_high_water;
+  }
+  writer.AddGauge("proxy_client_streams", "Backend connections",
+                  "state=\"connecting\"", connecting);
+  writer.AddGauge("proxy_client_streams", "Backend connections",
+                  "state=\"connected\"", streams.size() - connecting);
+  writer.AddCounter("proxy_client_stream_bytes_in_total",
+                    "Bytes read from backend connections and forwarded", "",
+                    total_bytes_in_);
+  writer.AddCounter("proxy_client_stream_bytes_out_total",
+                    "Bytes received from the tunnel for backend connections",
+                    "", total_bytes_out_);
+  writer.AddGauge("proxy_client_stream_backlog_bytes",
+                  "Bytes waiting to be written to backend connections", "",
+                  backlog);
+  writer.AddGauge("proxy_client_blocked_streams",
+                  "Backend connections under flow control",
+                  "reason=\"read_stopped\"", read_stopped);
+  writer.AddGauge("proxy_client_blocked_streams",
+                  "Backend connections under flow control",
+                  "reason=\"peer_paused\"", client_block);
+  writer.AddGauge("proxy_client_blocked_streams",
+                  "Backend connections under flow control",
+                  "reason=\"backend_high_water\"", backend_high_water);
+  writer.AddHistogram("proxy_client_backend_connect_us",
+                      "Time to connect to the backend service", "",
+                      connect_latency_);
+  writer.AddGauge("proxy_tunnel_srtt_us", "Smoothed tunnel round trip time",
+                  "", dispatcher_->Stats().rtt.SrttUs());
+  writer.AddGauge("proxy_tunnel_rttvar_us", "Tunnel round trip time variation",
+                  "", dispatcher_->Stats().rtt.RttvarUs());
+  writer.AddGauge("proxy_tunnel_dead_deadline_us",
+                  "Silence after which the tunnel is declared dead", "",
+                  liveness_->DeadlineUs());
+  writer.AddCounter("proxy_tunnel_pings_total",
+                    "Pings sent because the tunnel was idle", "",
+                    liveness_->Pings());
+  writer.AddCounter("proxy_tunnel_dead_total",
+                    "Times the tunnel was declared dead", "",
+                    liveness_->Deaths());
+  writer.AddGauge("proxy_tunnel_bdp_bytes",
+                  "Estimated bandwidth-delay product of the tunnel", "",
+                  bdp_tuner_->BdpBytes());
+  writer.AddGauge("proxy_tunnel_high_water_bytes",
+                  "Tunnel output buffer high-water mark", "",
+                  bdp_tuner_->Current().tunnel_high_water);
+  writer.AddGauge("proxy_stream_high_water_bytes",
+                  "Backend connection output buffer high-water mark", "",
+                  bdp_tuner_->Current().stream_high_water);
+  writer.AddGauge("proxy_throttled_streams",
+                  "Backend connections paused because the tunnel is full", "",
+                  throttler_->PausedCount());
+  writer.AddCounter("proxy_throttle_pauses_total",
+                    "Backend connections paused on tunnel high water", "",
+                    throttler_->Pauses());
+  writer.AddConnTraceStats(trace_stats_, "");
+  writer.AddMemoryAccount(memory_, "");
+  writer.AddMemoryBudget(MemoryBudget::Global());
+  writer.AddSlabPoolStats();
+  writer.AddBufferSweeperStats();
+  writer.AddGauge("proxy_client_resuming",
+                  "Whether the session is waiting to be resumed", "",
+                  resuming_ ? 1 : 0);
+  const DispatchStats &dispatch_stats = dispatcher_->Stats();
+  writer.AddCounter("proxy_tunnel_frames_in_total",
+                    "Frames received on the tunnel", "",
+                    dispatch_stats.frames_in);
+  writer.AddCounter("proxy_tunnel_frames_out_total",
+                    "Frames sent on the tunnel", "",
+                    dispatch_stats.frames_out);
+  writer.AddCounter("proxy_tunnel_bytes_in_total",
+                    "Bytes received on the tunnel", "",
+                    dispatch_stats.bytes_in);
+  writer.AddCounter("proxy_tunnel_bytes_out_total", "Bytes sent on the tunnel",
+                    "", dispatch_stats.bytes_out);
+  // proxy连接在loop_中
+  writer.AddGauge("proxy_tunnel_output_buffer_bytes",
+                  "Bytes queued in the tunnel output buffer", "",
+                  proxy_conn_ ? proxy_conn_->outputBuffer()->readableBytes()
+                              : 0);
+  writer.AddGauge("proxy_dispatch_inflight_requests",
+                  "Requests waiting for a response", "",
+                  dispatcher_->InflightRequests());
+  writer.AddGauge("proxy_dispatch_pending_bytes",
+                  "Bytes of requests waiting for a response", "",
+                  dispatcher_->PendingBytes());
+  writer.AddCounter("proxy_dispatch_retries_total", "Requests resent", "",
+                    dispatch_stats.retries);
+  writer.AddCounter("proxy_dispatch_timeouts_total",
+                    "Requests timed out or dropped", "",
+                    dispatch_stats.timeouts);
+  writer.AddHistogram("proxy_tunnel_rtt_us",
+                      "Time from sending a request to its response", "",
+                      dispatch_stats.rtt_us);
+  // loop_的统计直接读取, io线程的统计来自快照, 不阻塞loop_
+  {
+    muduo::MutexLockGuard lock(monitors_mutex_);
+    for (const auto &monitor : loop_monitors_) {
+      if (monitor->GetLoop() == loop_) {
+        writer.AddLoopStats(monitor->GetStats());
+      }
+    }
+  }
+  for (IoLoopState *state : IoLoops()) {
+    muduo::MutexLockGuard lock(state->mutex);
+    // 还没有采样过
+    if (!state->loop_stats.name.empty()) {
+      writer.AddLoopStats(state->loop_stats);
+    }
+  }
+  return writer.ToString();
+}
+
+std::string ProxyClient::DumpStreams(const std::string &query) {
+  std::string sort = QueryParam(query, "sort");
+  if (sort.empty()) {
+    sort = "backlog";
+  }
+  size_t limit = 20;
+  std::string limit_str = QueryParam(query, "limit");
+  if (!limit_str.empty()) {
+    limit = strtoul(limit_str.c_str(), nullptr, 10);
+  }
+  std::function<int64_t(const StreamStats &)> key;
+  if (sort == "backlog") {
+    key = [](const StreamStats &stream) {
+      return static_cast<int64_t>(stream.backlog_bytes);
+    };
+  } else if (sort == "blocked") {
+    key = [](const StreamStats &stream) { return stream.blocked_us; };
+  } else if (sort == "connect") {
+    key = [](const StreamStats &stream) { return stream.connect_us; };
+  } else if (sort == "bytes") {
+    key = [](const StreamStats &stream) {
+      return static_cast<int64_t>(stream.bytes_in + stream.bytes_out);
+    };
+  } else {
+    return "unknown sort:" + sort + ", use backlog/blocked/connect/bytes\n";
+  }
+  std::vector<StreamStats> streams = CollectStreams();
+  std::sort(streams.begin(), streams.end(),
+            [&key](const StreamStats &lhs, const StreamStats &rhs) {
+              return key(lhs) > key(rhs);
+            });
+  std::string result;
+  char line[256];
+  snprintf(line, sizeof(line), "streams:%zu sort:%s resuming:%d\n",
+           streams.size(), sort.c_str(), resuming_ ? 1 : 0);
+  result += line;
+  const RttEstimator &rtt = dispatcher_->Stats().rtt;
+  snprintf(line, sizeof(line),
+           "tunnel srtt(us):%lld rttvar(us):%lld dead deadline(ms):%lld\n",
+           static_cast<long long>(rtt.SrttUs()),
+           static_cast<long long>(rtt.RttvarUs()),
+           static_cast<long long>(liveness_->DeadlineUs() / 1000));
+  result += line;
+  result += "tunnel rtt(us) " + dispatcher_->Stats().rtt_us.ToString() + "\n";
+  result += "backend connect(us) " + connect_latency_.ToString() + "\n";
+  for (size_t index = 1; index < trace_stats_.PointNum(); ++index) {
+    result += std::string("setup ") + trace_stats_.PointName(index) +
+              "(us) " + trace_stats_.Phase(index).ToString() + "\n";
+  }
+  snprintf(line, sizeof(line), "%-20s %-10s %14s %14s %12s %12s %12s %s\n",
+           "conn_key", "state", "bytes_in", "bytes_out", "backlog",
+           "connect_us", "blocked_ms", "flow_control");
+  result += line;
+  for (size_t index = 0; index < streams.size() && index < limit; ++index) {
+    const StreamStats &stream = streams[index];
+    std::string flow_control;
+    if (stream.read_stopped) {
+      flow_control += "read_stopped,";
+    }
+    if (stream.client_block) {
+      flow_control += "peer_paused,";
+    }
+    if (stream.backend_high_water) {
+      flow_control += "backend_high_water,";
+    }
+    if (flow_control.empty()) {
+      flow_control = "-";
+    } else {
+      flow_control.pop_back();
+    }
+    snprintf(line, sizeof(line),
+             "%-20llu %-10s %14llu %14llu %12zu %12lld %12lld %s\n",
+             static_cast<unsigned long long>(stream.conn_key),
+             StateName(stream.state),
+             static_cast<unsigned long long>(stream.bytes_in),
+             static_cast<unsigned long long>(stream.bytes_out),
+             stream.backlog_bytes, static_cast<long long>(stream.connect_us),
+             static_cast<long long>(stream.blocked_us / 1000),
+             flow_control.c_str());
+    result += line;
+  }
+  return result;
+}
@@ -2,14 +2,25 @@
 
 #include "client/tcp_client.h"
 
+#include <muduo/base/Logging.h>
 #include <muduo/net/SocketsOps.h>
 
 TcpClient::TcpClient(muduo::net::EventLoop* loop,
                      const muduo::net::InetAddress& addr)
     : loop_(loop),
       server_addr_(addr),
-      connector_(std::make_shared<muduo::net::Connector>(loop, addr)),
-      connect_(false) {
+      connector_(std::make_shared<Connector>(loop, addr)),
+      connect_(false),
+      retry_(false) {
+  connector_->setNewConnectionCallback(
+      std::bind(&TcpClient::OnNewConnection, this, std::placeholders::_1));
+}
+
+TcpClient::TcpClient(muduo::net::EventLoop* loop, const std::string& unix_path)
+    : loop_(loop),
+      connector_(std::make_shared<Connector>(loop, unix_path)),
+      connect_(false),
+      retry_(false) {
   connector_->setNewConnectionCallback(
       std::bind(&TcpClient::OnNewConnection, this, std::placeholders::_1));
 }
@@ -32,10 +43,16 @@ void TcpClient::Disconnect() {
 
 void TcpClient::OnNewConnection(int sock_fd) {
   loop_->assertInLoopThread();
-  muduo::net::InetAddress local_addr(
-      muduo::net::sockets::getLocalAddr(sock_fd));
+  // unix domain socket没有ip地址, local_addr和server_addr_都为空地址
+  muduo::net::InetAddress local_addr;
+  if (!connector_->isUnix()) {
+    local_addr =
+        muduo::net::InetAddress(muduo::net::sockets::getLocalAddr(sock_fd));
+  }
   muduo::net::TcpConnectionPtr conn(std::make_shared<muduo::net::TcpConnection>(
-      loop_, "", sock_fd, local_addr, server_addr_));
+      loop_, connector_->serverName(), sock_fd, local_addr, server_addr_));
+  // 默认context为socket fd, 用于设置socket选项
+  conn->setContext(sock_fd);
   conn->setConnectionCallback(connection_callback_);
   conn->setMessageCallback(msg_callback_);
   conn->setCloseCallback(
@@ -49,6 +66,9 @@ void TcpClient::OnNewConnection(int sock_fd) {
 
 void TcpClient::DestroyConn() {
   loop_->assertInLoopThread();
+  if (!connection_) {
+    return;
+  }
   loop_->queueInLoop(
       std::bind(&muduo::net::TcpConnection::connectDestroyed, connection_));
   {
@@ -62,4 +82,15 @@ muduo::net::TcpConnectionPtr TcpClient::Connection() {
   return connection_;
 }
 
-void TcpClient::OnConnClose(const muduo::net::TcpConnectionPtr&) {}
+void TcpClient::OnConnClose(const muduo::net::TcpConnectionPtr&) {
+  loop_->assertInLoopThread();
+  // 不重连时由使用者调用DestroyConn
+  if (!retry_) {
+    return;
+  }
+  DestroyConn();
+  if (connect_) {
+    LOG_INFO << "reconnect to " << connector_->serverName();
+    connector_->restart();
+  }
+}
@@ -3,19 +3,32 @@
 #define CLIENT_TCP_CLIENT_H_
 
 #include <muduo/base/Mutex.h>
-#include <muduo/net/Connector.h>
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/InetAddress.h>
 #include <muduo/net/TcpConnection.h>
 
 #include <memory>
+#include <string>
+
+#include "client/Connector.h"
 
 class TcpClient {
  public:
   TcpClient(muduo::net::EventLoop *loop, const muduo::net::InetAddress &addr);
+  // 连接unix domain socket
+  TcpClient(muduo::net::EventLoop *loop, const std::string &unix_path);
+  muduo::net::EventLoop *GetLoop() const { return loop_; }
   void Connect();
   void Stop();
   void Disconnect();
+  // 连接断开后自动重连, 连接由TcpClient自己销毁
+  void EnableRetry() { retry_ = true; }
+  // 重连的初始间隔, 在Connect之前调用
+  void SetInitRetryDelay(int delay_ms) {
+    connector_->setInitRetryDelayMs(delay_ms);
+  }
+  // 连接确认可用后调用, 重连间隔回到初始值, 在loop_中调用
+  void ResetRetryDelay() { connector_->resetRetryDelay(); }
   void SetConnectionCallback(muduo::net::ConnectionCallback cb) {
     connection_callback_ = cb;
   }
@@ -35,9 +48,10 @@ class TcpClient {
   muduo::net::ConnectionCallback connection_callback_;
   muduo::net::MessageCallback msg_callback_;
   muduo::net::CloseCallback close_callback_;
-  std::shared_ptr<muduo::net::Connector> connector_;
+  std::shared_ptr<Connector> connector_;
   muduo::net::TcpConnectionPtr connection_;
   bool connect_;
+  bool retry_;
   muduo::MutexLock mutex_;
 };
 
@@ -0,0 +1,211 @@
+// Copyright [2021] zhangke
+
+#include "common/alloc_stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+namespace {
+
+// 每个线程独占一个slot, 只有本线程写, 读取时不需要加锁
+// 超过kMaxThreadSlots的线程共用最后一个slot
+const int kMaxThreadSlots = 256;
+
+struct ThreadSlot {
+  std::atomic<int> tid;
+  std::atomic<uint64_t> count[ALLOC_TAG_NUM];
+  std::atomic<uint64_t> bytes[ALLOC_TAG_NUM];
+};
+
+// 静态存储零初始化, 分配钩子中不能再分配内存
+ThreadSlot g_slots[kMaxThreadSlots];
+std::atomic<int> g_slot_num(0);
+
+// 只用平凡类型的thread_local, 避免线程退出时析构顺序的问题
+thread_local ThreadSlot *t_slot = nullptr;
+thread_local bool t_shared_slot = false;
+thread_local uint8_t t_tag = ALLOC_TAG_OTHER;
+
+int UsedSlots() {
+  int slot_num = g_slot_num.load(std::memory_order_acquire);
+  return slot_num < kMaxThreadSlots ? slot_num : kMaxThreadSlots;
+}
+
+#ifdef PROXY_ALLOC_STATS
+void RecordAlloc(size_t size) {
+  if (t_slot == nullptr) {
+    int index = g_slot_num.fetch_add(1, std::memory_order_acq_rel);
+    if (index >= kMaxThreadSlots - 1) {
+      index = kMaxThreadSlots - 1;
+      t_shared_slot = true;
+    }
+    t_slot = &g_slots[index];
+    int tid = t_shared_slot ? 0 : static_cast<int>(::syscall(SYS_gettid));
+    t_slot->tid.store(tid, std::memory_order_relaxed);
+  }
+  if (t_shared_slot) {
+    t_slot->count[t_tag].fetch_add(1, std::memory_order_relaxed);
+    t_slot->bytes[t_tag].fetch_add(size, std::memory_order_relaxed);
+    return;
+  }
+  // 独占的slot只有本线程写, 不需要原子的读改写
+  std::atomic<uint64_t> &count = t_slot->count[t_tag];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+  std::atomic<uint64_t> &bytes = t_slot->bytes[t_tag];
+  bytes.store(bytes.load(std::memory_order_relaxed) + size,
+              std::memory_order_relaxed);
+}
+
+void *AllocOrNull(size_t size) {
+  RecordAlloc(size);
+  return malloc(size == 0 ? 1 : size);
+}
+
+void *AllocOrThrow(size_t size) {
+  void *ptr = AllocOrNull(size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+#endif
+
+AllocSnapshot SlotSnapshot(const ThreadSlot &slot) {
+  AllocSnapshot snapshot;
+  for (int tag = 0; tag < ALLOC_TAG_NUM; ++tag) {
+    snapshot.tags[tag].count = slot.count[tag].load(std::memory_order_relaxed);
+    snapshot.tags[tag].bytes = slot.bytes[tag].load(std::memory_order_relaxed);
+  }
+  return snapshot;
+}
+
+}  // namespace
+
+#ifdef PROXY_ALLOC_STATS
+void *operator new(size_t size) { return AllocOrThrow(size); }
+
+void *operator new[](size_t size) { return AllocOrThrow(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return AllocOrNull(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return AllocOrNull(size);
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete[](void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { free(ptr); }
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  free(ptr);
+}
+#endif
+
+AllocCounter AllocSnapshot::Total() const {
+  AllocCounter total;
+  for (int tag = 0; tag < ALLOC_TAG_NUM; ++tag) {
+    total.count += tags[tag].count;
+    total.bytes += tags[tag].bytes;
+  }
+  return total;
+}
+
+AllocCounter AllocSnapshot::Tagged() const {
+  AllocCounter tagged = Total();
+  tagged.count -= tags[ALLOC_TAG_OTHER].count;
+  tagged.bytes -= tags[ALLOC_TAG_OTHER].bytes;
+  return tagged;
+}
+
+AllocSnapshot AllocSnapshot::operator-(const AllocSnapshot &rhs) const {
+  AllocSnapshot diff;
+  for (int tag = 0; tag < ALLOC_TAG_NUM; ++tag) {
+    diff.tags[tag].count = tags[tag].count - rhs.tags[tag].count;
+    diff.tags[tag].bytes = tags[tag].bytes - rhs.tags[tag].bytes;
+  }
+  return diff;
+}
+
+bool AllocStats::Enabled() {
+#ifdef PROXY_ALLOC_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+const char *AllocStats::TagName(AllocTag tag) {
+  switch (tag) {
+    case ALLOC_TAG_OTHER:
+      return "other";
+    case ALLOC_TAG_CODEC:
+      return "codec";
+    case ALLOC_TAG_DISPATCHER:
+      return "dispatcher";
+    case ALLOC_TAG_SERVER:
+      return "server";
+    case ALLOC_TAG_CLIENT:
+      return "client";
+    default:
+      return "unknown";
+  }
+}
+
+AllocSnapshot AllocStats::Snapshot() {
+  AllocSnapshot snapshot;
+  int slot_num = UsedSlots();
+  for (int index = 0; index < slot_num; ++index) {
+    AllocSnapshot slot = SlotSnapshot(g_slots[index]);
+    for (int tag = 0; tag < ALLOC_TAG_NUM; ++tag) {
+      snapshot.tags[tag].count += slot.tags[tag].count;
+      snapshot.tags[tag].bytes += slot.tags[tag].bytes;
+    }
+  }
+  return snapshot;
+}
+
+std::vector<std::pair<int, AllocSnapshot>> AllocStats::ThreadSnapshots() {
+  std::vector<std::pair<int, AllocSnapshot>> result;
+  int slot_num = UsedSlots();
+  for (int index = 0; index < slot_num; ++index) {
+    result.emplace_back(g_slots[index].tid.load(std::memory_order_relaxed),
+                        SlotSnapshot(g_slots[index]));
+  }
+  return result;
+}
+
+std::string AllocStats::Format(const AllocSnapshot &diff, uint64_t units) {
+  std::string result;
+  char line[256];
+  for (int tag = 0; tag < ALLOC_TAG_NUM; ++tag) {
+    const AllocCounter &counter = diff.tags[tag];
+    int length =
+        snprintf(line, sizeof(line), "%-10s allocs:%" PRIu64 " bytes:%" PRIu64,
+                 TagName(static_cast<AllocTag>(tag)), counter.count,
+                 counter.bytes);
+    if (units) {
+      snprintf(line + length, sizeof(line) - length,
+               " allocs/unit:%.2f bytes/unit:%.1f",
+               static_cast<double>(counter.count) / units,
+               static_cast<double>(counter.bytes) / units);
+    }
+    result.append(line);
+    result.append("\n");
+  }
+  return result;
+}
+
+AllocScope::AllocScope(AllocTag tag) : prev_tag_(t_tag) { t_tag = tag; }
+
+AllocScope::~AllocScope() { t_tag = prev_tag_; }
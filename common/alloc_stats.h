@@ -0,0 +1,68 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_ALLOC_STATS_H_
+#define COMMON_ALLOC_STATS_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// 堆分配统计, 由CMake选项PROXY_ALLOC_STATS打开
+// 打开后替换全局operator new, 按线程和子系统统计分配次数和字节数
+// 关闭时接口仍可调用, 统计值都是0
+
+enum AllocTag : uint8_t {
+  ALLOC_TAG_OTHER = 0,
+  ALLOC_TAG_CODEC,       // ProxyMessage编解码
+  ALLOC_TAG_DISPATCHER,  // MessageDispatch收发
+  ALLOC_TAG_SERVER,      // ProxyInstance转发
+  ALLOC_TAG_CLIENT,      // ProxyClient转发
+  ALLOC_TAG_NUM,
+};
+
+struct AllocCounter {
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+};
+
+struct AllocSnapshot {
+  AllocCounter tags[ALLOC_TAG_NUM];
+  // 所有子系统, 包括ALLOC_TAG_OTHER
+  AllocCounter Total() const;
+  // 不包括ALLOC_TAG_OTHER, 即转发路径上的分配
+  AllocCounter Tagged() const;
+  AllocSnapshot operator-(const AllocSnapshot &rhs) const;
+};
+
+class AllocStats {
+ public:
+  static bool Enabled();
+  static const char *TagName(AllocTag tag);
+  // 所有线程的累计值
+  static AllocSnapshot Snapshot();
+  // 每个线程的累计值, first为线程id
+  static std::vector<std::pair<int, AllocSnapshot>> ThreadSnapshots();
+  // 按子系统输出diff, units不为0时同时输出每个单位的平均值
+  static std::string Format(const AllocSnapshot &diff, uint64_t units = 0);
+};
+
+// 作用域内当前线程的分配计入tag, 嵌套时以最内层为准
+class AllocScope {
+ public:
+  explicit AllocScope(AllocTag tag);
+  ~AllocScope();
+  AllocScope(const AllocScope &) = delete;
+  AllocScope &operator=(const AllocScope &) = delete;
+
+ private:
+  uint8_t prev_tag_;
+};
+
+#ifdef PROXY_ALLOC_STATS
+#define PROXY_ALLOC_SCOPE(tag) AllocScope proxy_alloc_scope(tag)
+#else
+#define PROXY_ALLOC_SCOPE(tag)
+#endif
+
+#endif  // COMMON_ALLOC_STATS_H_
@@ -0,0 +1,140 @@
+// Copyright [2021] zhangke
+
+#include "common/async_logger.h"
+
+#include <muduo/base/LogFile.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <utility>
+
+AsyncLogger::AsyncLogger(const std::string &basename, off_t roll_size,
+                         size_t max_buffers, int flush_interval)
+    : basename_(basename),
+      roll_size_(roll_size),
+      max_buffers_(max_buffers < 2 ? 2 : max_buffers),
+      flush_interval_(flush_interval),
+      running_(false),
+      thread_(std::bind(&AsyncLogger::ThreadFunc, this), "async_logger"),
+      latch_(1),
+      mutex_(),
+      cond_(mutex_),
+      flush_cond_(mutex_),
+      current_(new Buffer),
+      buffer_count_(1),
+      flush_request_(0),
+      flush_done_(0),
+      dropped_lines_(0),
+      dropped_bytes_(0) {
+  current_->bzero();
+}
+
+AsyncLogger::~AsyncLogger() {
+  if (running_) {
+    Stop();
+  }
+}
+
+void AsyncLogger::Start() {
+  running_ = true;
+  thread_.start();
+  latch_.wait();
+}
+
+void AsyncLogger::Stop() {
+  {
+    muduo::MutexLockGuard lock(mutex_);
+    running_ = false;
+    cond_.notify();
+  }
+  thread_.join();
+}
+
+void AsyncLogger::Append(const char *logline, int len) {
+  muduo::MutexLockGuard lock(mutex_);
+  if (current_ && current_->avail() > len) {
+    current_->append(logline, len);
+    return;
+  }
+  if (current_) {
+    full_buffers_.push_back(std::move(current_));
+    cond_.notify();
+  }
+  if (!free_buffers_.empty()) {
+    current_ = std::move(free_buffers_.back());
+    free_buffers_.pop_back();
+  } else if (buffer_count_ < max_buffers_) {
+    current_.reset(new Buffer);
+    ++buffer_count_;
+  }
+  if (current_ && current_->avail() > len) {
+    current_->append(logline, len);
+  } else {
+    // 后台线程写不过来, 丢弃
+    ++dropped_lines_;
+    dropped_bytes_ += len;
+  }
+}
+
+void AsyncLogger::Flush() {
+  muduo::MutexLockGuard lock(mutex_);
+  if (!running_) {
+    return;
+  }
+  uint64_t request = ++flush_request_;
+  cond_.notify();
+  while (running_ && flush_done_ < request) {
+    flush_cond_.waitForSeconds(1.0);
+  }
+}
+
+void AsyncLogger::ThreadFunc() {
+  // 只在后台线程中写, 不需要LogFile加锁
+  muduo::LogFile output(basename_, roll_size_, false, flush_interval_);
+  std::vector<BufferPtr> buffers_to_write;
+  uint64_t reported_dropped = 0;
+  bool running = true;
+  latch_.countDown();
+  while (running) {
+    uint64_t flush_request = 0;
+    {
+      muduo::MutexLockGuard lock(mutex_);
+      if (running_ && full_buffers_.empty() &&
+          flush_request_ == flush_done_) {
+        cond_.waitForSeconds(flush_interval_);
+      }
+      running = running_;
+      if (current_ && current_->length() > 0) {
+        full_buffers_.push_back(std::move(current_));
+      }
+      buffers_to_write.swap(full_buffers_);
+      flush_request = flush_request_;
+    }
+    for (const BufferPtr &buffer : buffers_to_write) {
+      output.append(buffer->data(), buffer->length());
+    }
+    uint64_t dropped = dropped_lines_;
+    if (dropped != reported_dropped) {
+      char buf[256];
+      snprintf(buf, sizeof(buf),
+               "AsyncLogger dropped %llu log lines, total %llu lines %llu "
+               "bytes\n",
+               static_cast<unsigned long long>(dropped - reported_dropped),
+               static_cast<unsigned long long>(dropped),
+               static_cast<unsigned long long>(dropped_bytes_.load()));
+      output.append(buf, static_cast<int>(strlen(buf)));
+      reported_dropped = dropped;
+    }
+    output.flush();
+    {
+      muduo::MutexLockGuard lock(mutex_);
+      for (BufferPtr &buffer : buffers_to_write) {
+        buffer->reset();
+        free_buffers_.push_back(std::move(buffer));
+      }
+      flush_done_ = flush_request;
+      flush_cond_.notifyAll();
+    }
+    buffers_to_write.clear();
+  }
+}
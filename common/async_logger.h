@@ -0,0 +1,59 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_ASYNC_LOGGER_H_
+#define COMMON_ASYNC_LOGGER_H_
+
+#include <muduo/base/Condition.h>
+#include <muduo/base/CountDownLatch.h>
+#include <muduo/base/LogStream.h>
+#include <muduo/base/Mutex.h>
+#include <muduo/base/Thread.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 异步日志, 前端只把日志拷贝到内存buffer, 由后台线程写文件
+// buffer总数有上限, 写满时丢弃日志并计数
+class AsyncLogger : muduo::noncopyable {
+ public:
+  AsyncLogger(const std::string &basename, off_t roll_size,
+              size_t max_buffers = 8, int flush_interval = 3);
+  ~AsyncLogger();
+  void Start();
+  void Stop();
+  // 作为muduo::Logger的output, 可以在任意线程调用
+  void Append(const char *logline, int len);
+  // 等待已经写入的日志落盘, 作为muduo::Logger的flush, LOG_FATAL时调用
+  void Flush();
+  uint64_t DroppedLines() const { return dropped_lines_; }
+  uint64_t DroppedBytes() const { return dropped_bytes_; }
+
+ private:
+  typedef muduo::detail::FixedBuffer<muduo::detail::kLargeBuffer> Buffer;
+  typedef std::unique_ptr<Buffer> BufferPtr;
+  void ThreadFunc();
+
+  const std::string basename_;
+  const off_t roll_size_;
+  const size_t max_buffers_;
+  const int flush_interval_;
+  std::atomic<bool> running_;
+  muduo::Thread thread_;
+  muduo::CountDownLatch latch_;
+  muduo::MutexLock mutex_;
+  muduo::Condition cond_ GUARDED_BY(mutex_);
+  muduo::Condition flush_cond_ GUARDED_BY(mutex_);
+  BufferPtr current_ GUARDED_BY(mutex_);
+  std::vector<BufferPtr> full_buffers_ GUARDED_BY(mutex_);
+  std::vector<BufferPtr> free_buffers_ GUARDED_BY(mutex_);
+  // 已经分配的buffer数量
+  size_t buffer_count_ GUARDED_BY(mutex_);
+  uint64_t flush_request_ GUARDED_BY(mutex_);
+  uint64_t flush_done_ GUARDED_BY(mutex_);
+  std::atomic<uint64_t> dropped_lines_;
+  std::atomic<uint64_t> dropped_bytes_;
+};
+
+#endif  // COMMON_ASYNC_LOGGER_H_
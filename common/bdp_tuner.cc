@@ -0,0 +1,179 @@
+// Copyright [2021] zhangke
+
+#include "common/bdp_tuner.h"
+
+#include <errno.h>
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <utility>
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25
+#endif
+
+namespace {
+
+const int64_t kKB = 1024;
+const int64_t kMB = 1024 * 1024;
+// 应用层受限时速率偏低, 峰值每次采样衰减5%
+const double kPeakDecay = 0.95;
+
+int64_t Clamp(int64_t value, int64_t low, int64_t high) {
+  return std::max(low, std::min(value, high));
+}
+
+// 变化超过25%才调整, 避免频繁设置
+bool Changed(int64_t current, int64_t value) {
+  return value * 4 > current * 5 || value * 5 < current * 4;
+}
+
+}  // namespace
+
+BdpTuner::BdpTuner(muduo::net::EventLoop *loop,
+                   const MessageDispatch *dispatcher, double interval)
+    : loop_(loop),
+      dispatcher_(dispatcher),
+      interval_(interval),
+      started_(false),
+      fd_(-1),
+      current_(Default()),
+      bdp_bytes_(0),
+      peak_rate_(0),
+      last_sample_us_(0),
+      last_bytes_out_(0),
+      last_output_bytes_(0) {}
+
+BdpTuner::~BdpTuner() { Stop(); }
+
+BdpSettings BdpTuner::Default() {
+  BdpSettings settings;
+  settings.tunnel_high_water = 10 * kMB;
+  settings.stream_high_water = 2 * kMB;
+  settings.socket_buffer = 0;
+  settings.notsent_lowat = 0;
+  return settings;
+}
+
+void BdpTuner::Start(const muduo::net::TcpConnectionPtr &conn, int fd,
+                     ApplyCb apply_cb) {
+  loop_->assertInLoopThread();
+  if (fd < 0) {
+    LOG_ERROR << "bdp tuner got no socket fd, conn:" << conn->name()
+              << ", socket buffers and TCP_INFO disabled";
+  }
+  Stop();
+  started_ = true;
+  conn_ = conn;
+  fd_ = fd;
+  apply_cb_ = std::move(apply_cb);
+  last_sample_us_ = muduo::Timestamp::now().microSecondsSinceEpoch();
+  last_bytes_out_ = dispatcher_->Stats().bytes_out;
+  last_output_bytes_ = conn->outputBuffer()->readableBytes();
+  // 新连接沿用上一个连接的估计, socket选项需要重新设置
+  if (current_.socket_buffer || current_.notsent_lowat) {
+    Apply(current_);
+  }
+  sample_timer_ =
+      loop_->runEvery(interval_, std::bind(&BdpTuner::Sample, this));
+}
+
+void BdpTuner::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  loop_->cancel(sample_timer_);
+  conn_.reset();
+}
+
+void BdpTuner::Sample() {
+  muduo::net::TcpConnectionPtr conn = conn_.lock();
+  if (!conn || !conn->connected()) {
+    return;
+  }
+  int64_t now_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+  uint64_t bytes_out = dispatcher_->Stats().bytes_out;
+  size_t output_bytes = conn->outputBuffer()->readableBytes();
+  // 交给内核的字节数: 新发送的减去输出缓冲中增加的
+  int64_t written = static_cast<int64_t>(bytes_out - last_bytes_out_) -
+                    (static_cast<int64_t>(output_bytes) -
+                     static_cast<int64_t>(last_output_bytes_));
+  int64_t used_us = now_us - last_sample_us_;
+  last_sample_us_ = now_us;
+  last_bytes_out_ = bytes_out;
+  last_output_bytes_ = output_bytes;
+  if (used_us > 0 && written > 0) {
+    peak_rate_ = std::max(peak_rate_ * kPeakDecay, written * 1e6 / used_us);
+  } else {
+    peak_rate_ *= kPeakDecay;
+  }
+  struct tcp_info info;
+  int64_t rtt_us = 0, cwnd_bytes = 0;
+  if (conn->getTcpInfo(&info)) {
+    rtt_us = info.tcpi_rtt;
+    cwnd_bytes = static_cast<int64_t>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+  }
+  if (rtt_us <= 0) {
+    // unix domain socket等没有TCP_INFO时使用应用层的RTT
+    rtt_us = dispatcher_->Stats().rtt.SrttUs();
+  }
+  if (rtt_us <= 0) {
+    return;
+  }
+  bdp_bytes_ = std::max(static_cast<int64_t>(peak_rate_ * rtt_us / 1e6),
+                        cwnd_bytes);
+  BdpSettings settings = Compute(bdp_bytes_);
+  if (Changed(current_.tunnel_high_water, settings.tunnel_high_water) ||
+      Changed(current_.stream_high_water, settings.stream_high_water) ||
+      Changed(current_.socket_buffer, settings.socket_buffer)) {
+    LOG_INFO << "bdp:" << bdp_bytes_ << " rtt(us):" << rtt_us
+             << " peak rate(B/s):" << static_cast<int64_t>(peak_rate_)
+             << " cwnd(B):" << cwnd_bytes
+             << ", tunnel high water:" << settings.tunnel_high_water
+             << " stream high water:" << settings.stream_high_water
+             << " socket buffer:" << settings.socket_buffer
+             << " notsent lowat:" << settings.notsent_lowat;
+    Apply(settings);
+    current_ = settings;
+    if (apply_cb_) {
+      apply_cb_(current_);
+    }
+  }
+}
+
+BdpSettings BdpTuner::Compute(int64_t bdp_bytes) const {
+  BdpSettings settings;
+  // proxy连接暂停读之前允许排队几个BDP, 单个连接暂停时对端还会再发一个RTT的数据
+  settings.tunnel_high_water = Clamp(4 * bdp_bytes, 1 * kMB, 64 * kMB);
+  settings.stream_high_water = Clamp(bdp_bytes, 256 * kKB, 16 * kMB);
+  settings.socket_buffer =
+      static_cast<int>(Clamp(2 * bdp_bytes, 256 * kKB, 32 * kMB));
+  // 未发送的数据留在用户态, 由高水位控制排队
+  settings.notsent_lowat =
+      static_cast<int>(Clamp(bdp_bytes / 4, 16 * kKB, 4 * kMB));
+  return settings;
+}
+
+void BdpTuner::Apply(const BdpSettings &settings) {
+  if (fd_ < 0) {
+    return;
+  }
+  int value = settings.socket_buffer;
+  if (value > 0) {
+    if (::setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) < 0 ||
+        ::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+      LOG_SYSERR << "set socket buffer:" << value << " failed";
+    }
+  }
+  value = settings.notsent_lowat;
+  if (value > 0 && ::setsockopt(fd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value,
+                                sizeof(value)) < 0) {
+    // unix domain socket不支持
+    LOG_DEBUG << "set TCP_NOTSENT_LOWAT failed, errno:" << errno;
+  }
+}
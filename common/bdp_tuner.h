@@ -0,0 +1,68 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_BDP_TUNER_H_
+#define COMMON_BDP_TUNER_H_
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TcpConnection.h>
+#include <muduo/net/TimerId.h>
+
+#include <functional>
+
+#include "common/message_dispatch.h"
+
+// 根据RTT和吞吐估计的带宽时延积得到的缓冲设置
+struct BdpSettings {
+  // proxy连接输出缓冲的高水位
+  size_t tunnel_high_water;
+  // 客户端/后端连接输出缓冲的高水位
+  size_t stream_high_water;
+  // proxy连接的SO_SNDBUF和SO_RCVBUF, 0表示不设置, 使用内核自动调整
+  int socket_buffer;
+  // proxy连接的TCP_NOTSENT_LOWAT, 0表示不设置
+  int notsent_lowat;
+};
+
+// 定期从TCP_INFO和dispatcher的发送统计估计proxy连接的带宽时延积,
+// 变化超过25%时调整socket选项并通过apply_cb通知使用者更新高水位
+// 所有操作都在proxy连接的loop中
+class BdpTuner {
+ public:
+  typedef std::function<void(const BdpSettings &)> ApplyCb;
+
+  BdpTuner(muduo::net::EventLoop *loop, const MessageDispatch *dispatcher,
+           double interval = 1.0);
+  ~BdpTuner();
+  // 调整之前的默认值, 和原来固定的10MB/2MB一致
+  static BdpSettings Default();
+  // fd为proxy连接的socket, 小于0时输出错误日志, 只按发送速率计算高水位,
+  // 不读取TCP_INFO也不设置socket选项
+  void Start(const muduo::net::TcpConnectionPtr &conn, int fd,
+             ApplyCb apply_cb);
+  void Stop();
+  const BdpSettings &Current() const { return current_; }
+  int64_t BdpBytes() const { return bdp_bytes_; }
+  // 最近的峰值发送速率, 字节/秒
+  double PeakRate() const { return peak_rate_; }
+
+ private:
+  void Sample();
+  BdpSettings Compute(int64_t bdp_bytes) const;
+  void Apply(const BdpSettings &settings);
+
+  muduo::net::EventLoop *loop_;
+  const MessageDispatch *dispatcher_;
+  double interval_;
+  bool started_;
+  muduo::net::TimerId sample_timer_;
+  std::weak_ptr<muduo::net::TcpConnection> conn_;
+  int fd_;
+  ApplyCb apply_cb_;
+  BdpSettings current_;
+  int64_t bdp_bytes_;
+  double peak_rate_;
+  int64_t last_sample_us_;
+  uint64_t last_bytes_out_;
+  size_t last_output_bytes_;
+};
+
+#endif  // COMMON_BDP_TUNER_H_
@@ -0,0 +1,88 @@
+// Copyright [2021] zhangke
+
+#include "common/buffer_chain.h"
+
+#include <errno.h>
+
+#include <utility>
+
+Slice::Slice(std::string data)
+    : storage_(std::make_shared<const std::string>(std::move(data))),
+      offset_(0),
+      length_(storage_->size()) {}
+
+Slice Slice::SubSlice(size_t offset, size_t length) const {
+  Slice slice(*this);
+  slice.offset_ += offset;
+  slice.length_ = length;
+  return slice;
+}
+
+void BufferChain::Append(Slice slice) {
+  if (slice.empty()) {
+    return;
+  }
+  size_ += slice.size();
+  slices_.push_back(std::move(slice));
+}
+
+int BufferChain::Peek(struct iovec *iov, int max_iov) const {
+  int count = 0;
+  for (const Slice &slice : slices_) {
+    if (count == max_iov) {
+      break;
+    }
+    iov[count].iov_base = const_cast<char *>(slice.data());
+    iov[count].iov_len = slice.size();
+    ++count;
+  }
+  return count;
+}
+
+void BufferChain::Retrieve(size_t len) {
+  if (len >= size_) {
+    Clear();
+    return;
+  }
+  size_ -= len;
+  size_t drained = 0;
+  while (len) {
+    Slice &slice = slices_[drained];
+    if (len < slice.size()) {
+      slice = slice.SubSlice(len, slice.size() - len);
+      break;
+    }
+    len -= slice.size();
+    ++drained;
+  }
+  slices_.erase(slices_.begin(), slices_.begin() + drained);
+}
+
+void BufferChain::Clear() {
+  slices_.clear();
+  size_ = 0;
+}
+
+std::string BufferChain::ToString() const {
+  std::string result;
+  result.reserve(size_);
+  for (const Slice &slice : slices_) {
+    result.append(slice.data(), slice.size());
+  }
+  return result;
+}
+
+ssize_t BufferChain::WriteTo(int fd) {
+  struct iovec iov[16];
+  int count = Peek(iov, static_cast<int>(sizeof(iov) / sizeof(iov[0])));
+  if (count == 0) {
+    return 0;
+  }
+  ssize_t written = ::writev(fd, iov, count);
+  if (written < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0
+                                                                        : -1;
+  }
+  Retrieve(written);
+  return written;
+}
@@ -0,0 +1,59 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_BUFFER_CHAIN_H_
+#define COMMON_BUFFER_CHAIN_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// 引用计数的只读数据片段, 复制和取子片段都只增加引用计数
+class Slice {
+ public:
+  Slice() : offset_(0), length_(0) {}
+  // 接管data
+  explicit Slice(std::string data);
+  const char *data() const {
+    return storage_ ? storage_->data() + offset_ : nullptr;
+  }
+  size_t size() const { return length_; }
+  bool empty() const { return length_ == 0; }
+  // 和当前片段共享同一块内存
+  Slice SubSlice(size_t offset, size_t length) const;
+  long UseCount() const { return storage_.use_count(); }  // NOLINT
+
+ private:
+  std::shared_ptr<const std::string> storage_;
+  size_t offset_;
+  size_t length_;
+};
+
+// 多个Slice组成的链, 一个数据块在读出到最后写出之间只有一份
+// 帧, 等待重发的请求和发送队列都只引用同一个Slice
+class BufferChain {
+ public:
+  BufferChain() : size_(0) {}
+  void Append(Slice slice);
+  void Append(std::string data) { Append(Slice(std::move(data))); }
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+  const std::vector<Slice> &Slices() const { return slices_; }
+  // 填充最多max_iov个iovec, 返回填充的个数
+  int Peek(struct iovec *iov, int max_iov) const;
+  // 删除前len字节, 部分写出的片段变成子片段
+  void Retrieve(size_t len);
+  void Clear();
+  // 拷贝成连续的字符串
+  std::string ToString() const;
+  // 一次writev写到fd, 返回写出的字节数, 写不出时返回0, 出错返回-1
+  ssize_t WriteTo(int fd);
+
+ private:
+  std::vector<Slice> slices_;
+  size_t size_;
+};
+
+#endif  // COMMON_BUFFER_CHAIN_H_
@@ -0,0 +1,72 @@
+// Copyright [2021] zhangke
+
+#include "common/buffer_sweeper.h"
+
+#include <malloc.h>
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+#include <muduo/net/EventLoop.h>
+
+#include "common/slab_pool.h"
+
+constexpr double BufferSweeper::kInterval;
+const size_t BufferSweeper::kBaseline;
+const size_t BufferSweeper::kSlabKeep;
+const size_t BufferSweeper::kTrimThreshold;
+constexpr double BufferSweeper::kTrimInterval;
+std::atomic<uint64_t> BufferSweeper::shrinks_(0);
+std::atomic<uint64_t> BufferSweeper::freed_bytes_(0);
+std::atomic<uint64_t> BufferSweeper::trims_(0);
+std::atomic<uint64_t> BufferSweeper::untrimmed_bytes_(0);
+std::atomic<int64_t> BufferSweeper::last_trim_us_(0);
+
+size_t BufferSweeper::ShrinkConnection(
+    const muduo::net::TcpConnectionPtr &conn) {
+  conn->getLoop()->assertInLoopThread();
+  if (!conn->connected()) {
+    return 0;
+  }
+  return ShrinkBuffer(conn->inputBuffer()) +
+         ShrinkBuffer(conn->outputBuffer());
+}
+
+size_t BufferSweeper::ShrinkBuffer(muduo::net::Buffer *buffer) {
+  size_t capacity = buffer->internalCapacity();
+  if (capacity <= kBaseline || buffer->readableBytes() > kBaseline / 4) {
+    return 0;
+  }
+  buffer->shrink(0);
+  size_t shrunk = buffer->internalCapacity();
+  if (shrunk >= capacity) {
+    return 0;
+  }
+  ++shrinks_;
+  return capacity - shrunk;
+}
+
+size_t BufferSweeper::TrimSlabs() {
+  return SlabPool::ThisThread().Trim(kSlabKeep) * SlabPool::kSlabSize;
+}
+
+void BufferSweeper::ReturnFreed(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+  freed_bytes_ += bytes;
+  uint64_t untrimmed = (untrimmed_bytes_ += bytes);
+  if (untrimmed < kTrimThreshold) {
+    return;
+  }
+  int64_t now_us = muduo::Timestamp::now().microSecondsSinceEpoch();
+  int64_t last_us = last_trim_us_;
+  if (now_us - last_us < kTrimInterval * 1000 * 1000 ||
+      !last_trim_us_.compare_exchange_strong(last_us, now_us)) {
+    return;
+  }
+  untrimmed_bytes_ = 0;
+  ++trims_;
+  // 释放堆顶和各arena中空闲的页, 大块缓冲释放后不会自动还给系统
+  int released = malloc_trim(0);
+  LOG_INFO << "malloc_trim after freeing " << untrimmed
+           << " bytes, released:" << released;
+}
@@ -0,0 +1,47 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_BUFFER_SWEEPER_H_
+#define COMMON_BUFFER_SWEEPER_H_
+
+#include <muduo/net/TcpConnection.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// 流量突发之后把空闲连接的缓冲缩回基线, 并把释放的内存还给系统
+// 各实例在每个loop中定期调用Sweep, 统计在所有线程间共享
+class BufferSweeper {
+ public:
+  // 每个实例的扫描间隔(s)
+  static constexpr double kInterval = 10.0;
+  // 容量超过基线, 并且数据不到基线的1/4时缩小
+  static const size_t kBaseline = 64 * 1024;
+  // 每个loop的SlabPool保留的空闲块数
+  static const size_t kSlabKeep = 16;
+  // 累计释放超过阈值才调用malloc_trim, 全进程最多每kTrimInterval秒一次
+  static const size_t kTrimThreshold = 1024 * 1024;
+  static constexpr double kTrimInterval = 10.0;
+
+  // 在conn所在的loop中调用, 返回释放的字节数
+  static size_t ShrinkConnection(const muduo::net::TcpConnectionPtr &conn);
+  // 在当前线程缩小SlabPool的缓存, 返回释放的字节数
+  static size_t TrimSlabs();
+  // 记录释放的字节数, 达到阈值时调用malloc_trim
+  static void ReturnFreed(size_t bytes);
+
+  static uint64_t Shrinks() { return shrinks_; }
+  static uint64_t FreedBytes() { return freed_bytes_; }
+  static uint64_t Trims() { return trims_; }
+
+ private:
+  static size_t ShrinkBuffer(muduo::net::Buffer *buffer);
+
+  static std::atomic<uint64_t> shrinks_;
+  static std::atomic<uint64_t> freed_bytes_;
+  static std::atomic<uint64_t> trims_;
+  // 上次malloc_trim之后释放的字节数
+  static std::atomic<uint64_t> untrimmed_bytes_;
+  static std::atomic<int64_t> last_trim_us_;
+};
+
+#endif  // COMMON_BUFFER_SWEEPER_H_
@@ -0,0 +1,142 @@
+// Copyright [2021] zhangke
+
+#include "common/chain_buffer.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+const size_t ChainBuffer::kBlockSize;
+const size_t ChainBuffer::kDefaultLimit;
+
+ChainBuffer::ChainBuffer(const ChainBuffer &other)
+    : size_(0), limit_(other.limit_) {
+  for (const Block &block : other.blocks_) {
+    DoAppend(block.data + block.read_index,
+             block.write_index - block.read_index);
+  }
+}
+
+ChainBuffer::ChainBuffer(ChainBuffer &&other)
+    : blocks_(std::move(other.blocks_)),
+      size_(other.size_),
+      limit_(other.limit_) {
+  other.blocks_.clear();
+  other.size_ = 0;
+}
+
+ChainBuffer &ChainBuffer::operator=(const ChainBuffer &other) {
+  if (this != &other) {
+    ChainBuffer copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+ChainBuffer &ChainBuffer::operator=(ChainBuffer &&other) {
+  if (this != &other) {
+    Clear();
+    blocks_.swap(other.blocks_);
+    size_ = other.size_;
+    limit_ = other.limit_;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+size_t ChainBuffer::Append(const char *data, size_t len) {
+  if (size_ >= limit_) {
+    return 0;
+  }
+  len = std::min(len, limit_ - size_);
+  DoAppend(data, len);
+  return len;
+}
+
+void ChainBuffer::ForceAppend(const char *data, size_t len) {
+  DoAppend(data, len);
+}
+
+void ChainBuffer::DoAppend(const char *data, size_t len) {
+  size_ += len;
+  while (len) {
+    if (blocks_.empty() || blocks_.back().write_index == kBlockSize) {
+      blocks_.push_back(Block{SlabPool::ThisThread().Allocate(), 0, 0});
+    }
+    Block &block = blocks_.back();
+    size_t copy = std::min(len, kBlockSize - block.write_index);
+    memcpy(block.data + block.write_index, data, copy);
+    block.write_index += copy;
+    data += copy;
+    len -= copy;
+  }
+}
+
+int ChainBuffer::Peek(struct iovec *iov, int max_iov) const {
+  int count = 0;
+  for (const Block &block : blocks_) {
+    if (count == max_iov) {
+      break;
+    }
+    iov[count].iov_base = block.data + block.read_index;
+    iov[count].iov_len = block.write_index - block.read_index;
+    ++count;
+  }
+  return count;
+}
+
+void ChainBuffer::Retrieve(size_t len) {
+  len = std::min(len, size_);
+  size_ -= len;
+  size_t drained = 0;
+  while (len) {
+    Block &block = blocks_[drained];
+    size_t readable = block.write_index - block.read_index;
+    if (len < readable) {
+      block.read_index += len;
+      break;
+    }
+    len -= readable;
+    SlabPool::ThisThread().Release(block.data);
+    ++drained;
+  }
+  blocks_.erase(blocks_.begin(), blocks_.begin() + drained);
+  if (blocks_.empty()) {
+    std::vector<Block>().swap(blocks_);
+  }
+}
+
+void ChainBuffer::Clear() {
+  for (const Block &block : blocks_) {
+    SlabPool::ThisThread().Release(block.data);
+  }
+  // 释放vector自身的内存, 空闲连接不占用堆内存
+  std::vector<Block>().swap(blocks_);
+  size_ = 0;
+}
+
+void ChainBuffer::AppendTo(std::string *out) const {
+  out->reserve(out->size() + size_);
+  for (const Block &block : blocks_) {
+    out->append(block.data + block.read_index,
+                block.write_index - block.read_index);
+  }
+}
+
+ssize_t ChainBuffer::WriteTo(int fd) {
+  // 默认上限时最多16个块, 一次writev可以全部写出
+  struct iovec iov[64];
+  int count = Peek(iov, static_cast<int>(sizeof(iov) / sizeof(iov[0])));
+  if (count == 0) {
+    return 0;
+  }
+  ssize_t written = ::writev(fd, iov, count);
+  if (written < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0
+                                                                        : -1;
+  }
+  Retrieve(written);
+  return written;
+}
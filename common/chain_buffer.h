@@ -0,0 +1,61 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_CHAIN_BUFFER_H_
+#define COMMON_CHAIN_BUFFER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <string>
+#include <vector>
+
+#include "common/slab_pool.h"
+
+// 固定大小的块串起来的缓冲, 有容量上限, 用于连接建立前暂存数据
+// 块从当前线程的SlabPool借用, 读完立即归还, 空的缓冲不占用堆内存
+// 追加时不会移动已有数据, 写出时一次writev
+class ChainBuffer {
+ public:
+  static const size_t kBlockSize = SlabPool::kSlabSize;
+  static const size_t kDefaultLimit = 256 * 1024;
+
+  explicit ChainBuffer(size_t limit = kDefaultLimit)
+      : size_(0), limit_(limit) {}
+  ChainBuffer(const ChainBuffer &other);
+  ChainBuffer(ChainBuffer &&other);
+  ChainBuffer &operator=(const ChainBuffer &other);
+  ChainBuffer &operator=(ChainBuffer &&other);
+  ~ChainBuffer() { Clear(); }
+  // 最多追加到limit, 返回追加的字节数
+  size_t Append(const char *data, size_t len);
+  // 不受limit限制, 用于已经在途不能拒绝的数据
+  void ForceAppend(const char *data, size_t len);
+  size_t Size() const { return size_; }
+  size_t Limit() const { return limit_; }
+  bool Empty() const { return size_ == 0; }
+  bool Full() const { return size_ >= limit_; }
+  // 填充最多max_iov个iovec, 返回填充的个数
+  int Peek(struct iovec *iov, int max_iov) const;
+  void Retrieve(size_t len);
+  // 归还所有块
+  void Clear();
+  // 全部追加到out之后
+  void AppendTo(std::string *out) const;
+  // 一次writev写到fd, 返回写出的字节数, 写不出时返回0, 出错返回-1
+  ssize_t WriteTo(int fd);
+
+ private:
+  struct Block {
+    char *data;
+    size_t read_index;
+    size_t write_index;
+  };
+  void DoAppend(const char *data, size_t len);
+
+  // 块数不超过limit/kBlockSize, 从头部删除的开销可以忽略
+  std::vector<Block> blocks_;
+  size_t size_;
+  size_t limit_;
+};
+
+#endif  // COMMON_CHAIN_BUFFER_H_
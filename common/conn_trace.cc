@@ -0,0 +1,45 @@
+// Copyright [2021] zhangke
+
+#include "common/conn_trace.h"
+
+#include <muduo/base/Logging.h>
+
+#include <cassert>
+
+ConnTraceStats::ConnTraceStats(const char *side,
+                               std::initializer_list<const char *> points)
+    : side_(side), points_(points), phases_(points.size()), incomplete_(0) {
+  assert(points_.size() >= 2 &&
+         points_.size() <= static_cast<size_t>(ConnTrace::kMaxPoints));
+}
+
+void ConnTraceStats::Finish(uint64_t conn_key, ConnTrace *trace) {
+  if (trace->finished || !trace->Marked(0)) {
+    return;
+  }
+  trace->finished = true;
+  std::string detail;
+  int64_t last_us = trace->points_us[0];
+  for (size_t index = 1; index < points_.size(); ++index) {
+    if (!trace->Marked(index)) {
+      continue;
+    }
+    // 不同线程的时间点可能有微小的倒退, Histogram按0记录
+    int64_t used_us = trace->points_us[index] - last_us;
+    phases_[index].Add(used_us);
+    detail += " ";
+    detail += points_[index];
+    detail += ":" + std::to_string(used_us) + "us";
+    last_us = trace->points_us[index];
+  }
+  int64_t total_us = last_us - trace->points_us[0];
+  bool complete = trace->Marked(points_.size() - 1);
+  if (complete) {
+    total_.Add(total_us);
+  } else {
+    ++incomplete_;
+  }
+  LOG_INFO << "conn trace " << side_ << " conn_key:" << conn_key << detail
+           << " total:" << total_us << "us"
+           << (complete ? "" : " incomplete");
+}
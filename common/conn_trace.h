@@ -0,0 +1,60 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_CONN_TRACE_H_
+#define COMMON_CONN_TRACE_H_
+
+#include <muduo/base/Timestamp.h>
+#include <stdint.h>
+
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "common/histogram.h"
+
+// 一个连接建立过程中各个时间点, 由使用者定义时间点的含义和顺序
+// server和client各自记录, 日志中通过conn_key关联两端
+struct ConnTrace {
+  static const int kMaxPoints = 8;
+  ConnTrace() : finished(false) {
+    for (int index = 0; index < kMaxPoints; ++index) {
+      points_us[index] = 0;
+    }
+  }
+  // 只记录第一次
+  void Mark(int point, muduo::Timestamp time = muduo::Timestamp::now()) {
+    if (!points_us[point]) {
+      points_us[point] = time.microSecondsSinceEpoch();
+    }
+  }
+  bool Marked(int point) const { return points_us[point] != 0; }
+
+  int64_t points_us[kMaxPoints];
+  bool finished;
+};
+
+// 汇总ConnTrace, 第i个阶段为第i个时间点和它之前最近的已记录时间点的差
+// 非线程安全, 在记录ConnTrace的loop中使用
+class ConnTraceStats {
+ public:
+  // points为各时间点的名字, 第一个为起点, 最后一个为终点
+  ConnTraceStats(const char *side, std::initializer_list<const char *> points);
+  const char *Side() const { return side_; }
+  size_t PointNum() const { return points_.size(); }
+  const char *PointName(size_t index) const { return points_[index]; }
+  const Histogram &Phase(size_t index) const { return phases_[index]; }
+  // 起点到终点的时间, 只包括到达终点的连接
+  const Histogram &Total() const { return total_; }
+  // 没有到达终点就结束的连接数
+  uint64_t Incomplete() const { return incomplete_; }
+  // 到达终点或连接关闭时调用, 输出各阶段耗时并计入直方图, 重复调用忽略
+  void Finish(uint64_t conn_key, ConnTrace *trace);
+
+ private:
+  const char *side_;
+  std::vector<const char *> points_;
+  std::vector<Histogram> phases_;
+  Histogram total_;
+  uint64_t incomplete_;
+};
+
+#endif  // COMMON_CONN_TRACE_H_
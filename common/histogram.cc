@@ -0,0 +1,70 @@
+// Copyright [2021] zhangke
+
+#include "common/histogram.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+void Histogram::Add(int64_t value_us) {
+  if (value_us < 0) {
+    value_us = 0;
+  }
+  int index = 0;
+  if (value_us > 0) {
+    index = 64 - __builtin_clzll(static_cast<uint64_t>(value_us));
+    index = std::min(index, kBucketNum - 1);
+  }
+  ++buckets_[index];
+  ++count_;
+  sum_ += value_us;
+  max_ = std::max(max_, value_us);
+}
+
+void Histogram::Merge(const Histogram &rhs) {
+  for (int index = 0; index < kBucketNum; ++index) {
+    buckets_[index] += rhs.buckets_[index];
+  }
+  count_ += rhs.count_;
+  sum_ += rhs.sum_;
+  max_ = std::max(max_, rhs.max_);
+}
+
+void Histogram::Reset() {
+  memset(buckets_, 0, sizeof(buckets_));
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+}
+
+int64_t Histogram::BucketUpperBound(int index) {
+  return index == 0 ? 0 : (static_cast<int64_t>(1) << index) - 1;
+}
+
+int64_t Histogram::Percentile(double percent) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  uint64_t target = static_cast<uint64_t>(count_ * percent / 100);
+  target = std::max<uint64_t>(1, std::min(target, count_));
+  uint64_t seen = 0;
+  for (int index = 0; index < kBucketNum; ++index) {
+    seen += buckets_[index];
+    if (seen >= target) {
+      return std::min(BucketUpperBound(index), max_);
+    }
+  }
+  return max_;
+}
+
+std::string Histogram::ToString() const {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "count:%" PRIu64 " avg:%" PRId64 " p50:%" PRId64 " p99:%" PRId64
+           " p999:%" PRId64 " max:%" PRId64,
+           count_, count_ ? sum_ / static_cast<int64_t>(count_) : 0,
+           Percentile(50), Percentile(99), Percentile(99.9), max_);
+  return buf;
+}
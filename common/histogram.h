@@ -0,0 +1,36 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_HISTOGRAM_H_
+#define COMMON_HISTOGRAM_H_
+
+#include <stdint.h>
+
+#include <string>
+
+// 按2的幂分桶的耗时直方图, 单位us, 非线程安全
+// 第0个桶记录0, 第i个桶记录[2^(i-1), 2^i)
+class Histogram {
+ public:
+  static const int kBucketNum = 32;
+  Histogram() { Reset(); }
+  void Add(int64_t value_us);
+  void Merge(const Histogram &rhs);
+  void Reset();
+  uint64_t Count() const { return count_; }
+  int64_t Sum() const { return sum_; }
+  int64_t Max() const { return max_; }
+  uint64_t Bucket(int index) const { return buckets_[index]; }
+  // 桶的上界, 用于导出
+  static int64_t BucketUpperBound(int index);
+  // 返回所在桶的上界, 不超过Max()
+  int64_t Percentile(double percent) const;
+  // count:N avg:x p50:x p99:x p999:x max:x
+  std::string ToString() const;
+
+ private:
+  uint64_t buckets_[kBucketNum];
+  uint64_t count_;
+  int64_t sum_;
+  int64_t max_;
+};
+
+#endif  // COMMON_HISTOGRAM_H_
@@ -0,0 +1,19 @@
+// Copyright [2021] zhangke
+
+#include "common/log_util.h"
+
+#include <string>
+
+const size_t PbDebugString::kMaxLength;
+
+muduo::LogStream &operator<<(muduo::LogStream &stream,
+                             const PbDebugString &pb) {
+  std::string str = pb.message().ShortDebugString();
+  if (str.size() > PbDebugString::kMaxLength) {
+    stream.append(str.data(), static_cast<int>(PbDebugString::kMaxLength));
+    stream << "...(" << str.size() << " bytes)";
+  } else {
+    stream.append(str.data(), static_cast<int>(str.size()));
+  }
+  return stream;
+}
@@ -0,0 +1,45 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_LOG_UTIL_H_
+#define COMMON_LOG_UTIL_H_
+
+#include <google/protobuf/message.h>
+#include <muduo/base/LogStream.h>
+#include <muduo/base/Logging.h>
+
+// 编译期日志级别下限, 0:TRACE 1:DEBUG 2:INFO, 由CMake中PROXY_LOG_FLOOR设置
+// 低于下限的PROXY_LOG_*语句不会编译进程序, 参数也不会求值
+#ifndef PROXY_LOG_FLOOR
+#define PROXY_LOG_FLOOR 0
+#endif
+
+#if PROXY_LOG_FLOOR <= 0
+#define PROXY_LOG_TRACE LOG_TRACE
+#else
+#define PROXY_LOG_TRACE \
+  while (false) LOG_TRACE
+#endif
+
+#if PROXY_LOG_FLOOR <= 1
+#define PROXY_LOG_DEBUG LOG_DEBUG
+#else
+#define PROXY_LOG_DEBUG \
+  while (false) LOG_DEBUG
+#endif
+
+// 输出pb消息, 只在日志真正输出时才序列化成单行文本
+class PbDebugString {
+ public:
+  // 超过长度的部分截断
+  static const size_t kMaxLength = 1024;
+  explicit PbDebugString(const google::protobuf::Message &message)
+      : message_(message) {}
+  const google::protobuf::Message &message() const { return message_; }
+
+ private:
+  const google::protobuf::Message &message_;
+};
+
+muduo::LogStream &operator<<(muduo::LogStream &stream,
+                             const PbDebugString &pb);
+
+#endif  // COMMON_LOG_UTIL_H_
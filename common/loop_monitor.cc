@@ -0,0 +1,156 @@
+// Copyright [2021] zhangke
+
+#include "common/loop_monitor.h"
+
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include <algorithm>
+
+namespace {
+
+thread_local LoopMonitor *t_loop_monitor = nullptr;
+// 当前线程正在执行的PROXY_LOOP_CALLBACK层数
+thread_local int t_callback_depth = 0;
+
+int64_t NowUs() { return muduo::Timestamp::now().microSecondsSinceEpoch(); }
+
+}  // namespace
+
+LoopMonitor::LoopMonitor(muduo::net::EventLoop *loop, const std::string &name,
+                         double stall_threshold_ms, double probe_interval,
+                         double report_interval)
+    : loop_(loop),
+      name_(name),
+      stall_threshold_us_(static_cast<int64_t>(stall_threshold_ms * 1000)),
+      probe_interval_(probe_interval),
+      report_interval_(report_interval),
+      started_(false),
+      probe_expect_us_(0),
+      lag_stalls_(0),
+      callback_stalls_(0),
+      last_stall_callback_(nullptr) {}
+
+LoopMonitor::~LoopMonitor() { Stop(); }
+
+void LoopMonitor::Start() {
+  loop_->assertInLoopThread();
+  if (started_) {
+    return;
+  }
+  started_ = true;
+  t_loop_monitor = this;
+  probe_expect_us_ = NowUs() + static_cast<int64_t>(probe_interval_ * 1e6);
+  probe_timer_ =
+      loop_->runAfter(probe_interval_, std::bind(&LoopMonitor::Probe, this));
+  if (report_interval_ > 0) {
+    report_timer_ = loop_->runEvery(report_interval_,
+                                    std::bind(&LoopMonitor::Report, this));
+  }
+}
+
+void LoopMonitor::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  loop_->cancel(probe_timer_);
+  if (report_interval_ > 0) {
+    loop_->cancel(report_timer_);
+  }
+  if (t_loop_monitor == this) {
+    t_loop_monitor = nullptr;
+  }
+}
+
+LoopMonitor *LoopMonitor::Current() { return t_loop_monitor; }
+
+void LoopMonitor::Probe() {
+  int64_t now_us = NowUs();
+  int64_t lag_us = now_us - probe_expect_us_;
+  lag_.Add(lag_us);
+  if (lag_us > stall_threshold_us_) {
+    ++lag_stalls_;
+    LOG_WARN << "loop " << name_ << " lag " << lag_us / 1000
+             << "ms, last slow callback:"
+             << (last_stall_callback_ ? last_stall_callback_ : "unknown");
+  }
+  // 每次重新计时, 上一次的延迟不累积到下一次
+  probe_expect_us_ = now_us + static_cast<int64_t>(probe_interval_ * 1e6);
+  probe_timer_ =
+      loop_->runAfter(probe_interval_, std::bind(&LoopMonitor::Probe, this));
+}
+
+void LoopMonitor::RecordCallback(const char *name, int64_t used_us,
+                                 bool outermost) {
+  CallbackStats &stats = callbacks_[name];
+  ++stats.count;
+  stats.total_us += used_us;
+  stats.max_us = std::max(stats.max_us, used_us);
+  bool stall = used_us > stall_threshold_us_;
+  if (stall) {
+    ++stats.stalls;
+    last_stall_callback_ = name;
+    LOG_WARN << "loop " << name_ << " callback " << name << " took "
+             << used_us / 1000 << "ms";
+  }
+  if (outermost) {
+    callback_.Add(used_us);
+    if (stall) {
+      ++callback_stalls_;
+    }
+  }
+}
+
+LoopMonitor::Stats LoopMonitor::GetStats(size_t max_callbacks) const {
+  Stats stats;
+  stats.name = name_;
+  stats.lag = lag_;
+  stats.callback = callback_;
+  stats.lag_stalls = lag_stalls_;
+  stats.callback_stalls = callback_stalls_;
+  for (const auto &item : callbacks_) {
+    stats.callbacks.emplace_back(item.first, item.second);
+  }
+  std::sort(stats.callbacks.begin(), stats.callbacks.end(),
+            [](const std::pair<std::string, CallbackStats> &lhs,
+               const std::pair<std::string, CallbackStats> &rhs) {
+              return lhs.second.max_us > rhs.second.max_us;
+            });
+  if (stats.callbacks.size() > max_callbacks) {
+    stats.callbacks.resize(max_callbacks);
+  }
+  return stats;
+}
+
+void LoopMonitor::Report() {
+  Stats stats = GetStats(5);
+  LOG_INFO << "loop " << name_ << " lag(us) " << stats.lag.ToString()
+           << " stalls:" << stats.lag_stalls;
+  LOG_INFO << "loop " << name_ << " callback(us) "
+           << stats.callback.ToString() << " stalls:" << stats.callback_stalls;
+  for (const auto &item : stats.callbacks) {
+    LOG_INFO << "loop " << name_ << " callback " << item.first
+             << " count:" << item.second.count << " avg(us):"
+             << (item.second.count ? item.second.total_us / item.second.count
+                                   : 0)
+             << " max(us):" << item.second.max_us
+             << " stalls:" << item.second.stalls;
+  }
+}
+
+LoopCallbackTimer::LoopCallbackTimer(const char *name)
+    : monitor_(t_loop_monitor), name_(name), start_us_(0) {
+  if (monitor_) {
+    ++t_callback_depth;
+    start_us_ = NowUs();
+  }
+}
+
+LoopCallbackTimer::~LoopCallbackTimer() {
+  if (monitor_) {
+    --t_callback_depth;
+    monitor_->RecordCallback(name_, NowUs() - start_us_,
+                             t_callback_depth == 0);
+  }
+}
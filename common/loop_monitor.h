@@ -0,0 +1,92 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_LOOP_MONITOR_H_
+#define COMMON_LOOP_MONITOR_H_
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TimerId.h>
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "common/histogram.h"
+
+struct CallbackStats {
+  uint64_t count = 0;
+  int64_t total_us = 0;
+  int64_t max_us = 0;
+  uint64_t stalls = 0;
+};
+
+// 监控一个EventLoop的调度延迟和回调耗时, 所有操作都在loop_中
+// 调度延迟: 定时器实际触发时间和预期时间的差
+// 回调耗时: PROXY_LOOP_CALLBACK标记的回调的执行时间, 按名字统计
+// 超过stall_threshold_ms的延迟和回调输出WARN日志
+class LoopMonitor {
+ public:
+  struct Stats {
+    std::string name;
+    Histogram lag;
+    // 只统计最外层的回调, 嵌套的回调不重复计入
+    Histogram callback;
+    uint64_t lag_stalls = 0;
+    uint64_t callback_stalls = 0;
+    // 按最大耗时排序
+    std::vector<std::pair<std::string, CallbackStats>> callbacks;
+  };
+
+  LoopMonitor(muduo::net::EventLoop *loop, const std::string &name,
+              double stall_threshold_ms = 50, double probe_interval = 0.1,
+              double report_interval = 60);
+  ~LoopMonitor();
+  // 在loop_线程中调用, 之后本线程的PROXY_LOOP_CALLBACK计入这个monitor
+  void Start();
+  void Stop();
+  muduo::net::EventLoop *GetLoop() const { return loop_; }
+  Stats GetStats(size_t max_callbacks = 10) const;
+  // 当前线程的monitor, 没有时返回nullptr
+  static LoopMonitor *Current();
+
+ private:
+  friend class LoopCallbackTimer;
+  void Probe();
+  void Report();
+  void RecordCallback(const char *name, int64_t used_us, bool outermost);
+
+  muduo::net::EventLoop *loop_;
+  std::string name_;
+  int64_t stall_threshold_us_;
+  double probe_interval_;
+  double report_interval_;
+  bool started_;
+  muduo::net::TimerId probe_timer_;
+  muduo::net::TimerId report_timer_;
+  int64_t probe_expect_us_;
+  Histogram lag_;
+  Histogram callback_;
+  uint64_t lag_stalls_;
+  uint64_t callback_stalls_;
+  // 名字都是字符串常量, 直接以指针为key
+  std::unordered_map<const char *, CallbackStats> callbacks_;
+  // 最近一次超时的回调, 调度延迟超时时一起输出
+  const char *last_stall_callback_;
+};
+
+// 统计作用域内的耗时, 记入当前线程的LoopMonitor
+class LoopCallbackTimer {
+ public:
+  explicit LoopCallbackTimer(const char *name);
+  ~LoopCallbackTimer();
+  LoopCallbackTimer(const LoopCallbackTimer &) = delete;
+  LoopCallbackTimer &operator=(const LoopCallbackTimer &) = delete;
+
+ private:
+  LoopMonitor *monitor_;
+  const char *name_;
+  int64_t start_us_;
+};
+
+#define PROXY_LOOP_CALLBACK(name) LoopCallbackTimer loop_callback_timer(name)
+
+#endif  // COMMON_LOOP_MONITOR_H_
@@ -0,0 +1,55 @@
+// Copyright [2021] zhangke
+
+#include "common/memory_budget.h"
+
+MemoryBudget &MemoryBudget::Global() {
+  static MemoryBudget budget;
+  return budget;
+}
+
+bool MemoryBudget::Pressure() const {
+  size_t limit = limit_;
+  return limit && used_ > static_cast<int64_t>(limit / 100 * kPressurePercent);
+}
+
+bool MemoryBudget::Relieved() const {
+  size_t limit = limit_;
+  return !limit ||
+         used_ < static_cast<int64_t>(limit / 100 * kRelievePercent);
+}
+
+MemoryAccount::MemoryAccount() {
+  for (int kind = 0; kind < MEMORY_KIND_NUM; ++kind) {
+    used_[kind] = 0;
+  }
+}
+
+MemoryAccount::~MemoryAccount() { MemoryBudget::Global().Add(-Total()); }
+
+void MemoryAccount::Charge(MemoryKind kind, int64_t delta) {
+  used_[kind] += delta;
+  MemoryBudget::Global().Add(delta);
+}
+
+int64_t MemoryAccount::Total() const {
+  int64_t total = 0;
+  for (int kind = 0; kind < MEMORY_KIND_NUM; ++kind) {
+    total += used_[kind];
+  }
+  return total;
+}
+
+const char *MemoryAccount::KindName(MemoryKind kind) {
+  switch (kind) {
+    case MEMORY_TUNNEL_OUTPUT:
+      return "tunnel_output";
+    case MEMORY_INFLIGHT:
+      return "inflight";
+    case MEMORY_PENDING_STREAM:
+      return "pending_stream";
+    case MEMORY_STREAM_OUTPUT:
+      return "stream_output";
+    default:
+      return "unknown";
+  }
+}
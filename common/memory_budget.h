@@ -0,0 +1,62 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_MEMORY_BUDGET_H_
+#define COMMON_MEMORY_BUDGET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// 缓冲数据的种类
+enum MemoryKind {
+  MEMORY_TUNNEL_OUTPUT,    // proxy连接输出缓冲
+  MEMORY_INFLIGHT,         // 等待响应的请求副本
+  MEMORY_PENDING_STREAM,   // 连接建立前缓存的数据
+  MEMORY_STREAM_OUTPUT,    // 客户端/后端连接输出缓冲
+  MEMORY_KIND_NUM,
+};
+
+// 进程内所有实例缓冲数据的总预算, 线程安全
+// 超过预算的kPressurePercent时各实例停止读取数据源, 低于kRelievePercent时恢复
+class MemoryBudget {
+ public:
+  static const int kPressurePercent = 90;
+  static const int kRelievePercent = 75;
+
+  static MemoryBudget &Global();
+  // 0表示不限制, 只统计
+  void SetLimit(size_t bytes) { limit_ = bytes; }
+  size_t Limit() const { return limit_; }
+  int64_t Used() const { return used_; }
+  bool Pressure() const;
+  bool Relieved() const;
+  void Add(int64_t delta) { used_ += delta; }
+
+ private:
+  MemoryBudget() : limit_(0), used_(0) {}
+  std::atomic<size_t> limit_;
+  std::atomic<int64_t> used_;
+};
+
+// 一个实例的内存账户, 同时计入全局预算, 析构时全部归还
+// 非线程安全, 在实例的loop中使用
+class MemoryAccount {
+ public:
+  MemoryAccount();
+  ~MemoryAccount();
+  MemoryAccount(const MemoryAccount &) = delete;
+  MemoryAccount &operator=(const MemoryAccount &) = delete;
+  void Charge(MemoryKind kind, int64_t delta);
+  // 按采样值设置, 用于无法在每次变化时计费的缓冲
+  void Set(MemoryKind kind, int64_t bytes) {
+    Charge(kind, bytes - used_[kind]);
+  }
+  int64_t Used(MemoryKind kind) const { return used_[kind]; }
+  int64_t Total() const;
+  static const char *KindName(MemoryKind kind);
+
+ private:
+  int64_t used_[MEMORY_KIND_NUM];
+};
+
+#endif  // COMMON_MEMORY_BUDGET_H_
@@ -4,12 +4,27 @@
 
 #include <muduo/base/Logging.h>
 
+#include <algorithm>
+#include <boost/any.hpp>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
+
+#include "common/alloc_stats.h"
+#include "common/log_util.h"
+#include "common/loop_monitor.h"
+#include "common/message_util.h"
 
 MessageDispatch::MessageDispatch(muduo::net::EventLoop *loop)
-    : loop_(loop), request_id_(0) {}
+    : loop_(loop),
+      request_id_(0),
+      suspended_(false),
+      pending_bytes_(0),
+      memory_(nullptr),
+      has_last_request_id_(false),
+      last_request_id_(0),
+      last_receive_us_(0) {}
 
 MessageDispatch::~MessageDispatch() { loop_->cancel(check_timeout_timerid); }
 
@@ -23,6 +38,9 @@ void MessageDispatch::Init() {
 }
 
 void MessageDispatch::CheckTimeout() {
+  if (suspended_) {
+    return;
+  }
   for (std::map<uint32_t, RequestContext>::iterator index =
            response_handles_.begin();
        index != response_handles_.end();) {
@@ -31,18 +49,22 @@ void MessageDispatch::CheckTimeout() {
     if (request_context.timeout_count == 0) {
       if (request_context.retry_count == 0) {
         LOG_ERROR << "message timeout, request_id:" << index->first;
-        if (request_context.timeout_cb) {
-          request_context.timeout_cb();
-        }
+        ++stats_.timeouts;
+        TimeoutCb timeout_cb = std::move(request_context.timeout_cb);
+        AddPendingBytes(
+            -static_cast<int64_t>(request_context.request.Size()));
         index = response_handles_.erase(index);
+        if (timeout_cb) {
+          timeout_cb();
+        }
         continue;
       } else {
         --(request_context.retry_count);
+        request_context.resent = true;
         LOG_INFO << "retry request_id: " << index->first << " send to:"
                  << (index->second).conn->peerAddress().toIpPort();
-        (index->second)
-            .conn->send(request_context.request.c_str(),
-                        request_context.request.length());
+        ++stats_.retries;
+        SendFrame((index->second).conn, request_context.request);
       }
     }
     ++index;
@@ -55,6 +77,7 @@ void MessageDispatch::CheckTimeout() {
     --request_context.timeout_count;
     if (request_context.timeout_count == 0) {
       LOG_ERROR << "pb message timeout, source_id:" << index->first;
+      ++stats_.timeouts;
       if (request_context.timeout_cb) {
         request_context.timeout_cb();
       }
@@ -67,6 +90,9 @@ void MessageDispatch::CheckTimeout() {
 
 void MessageDispatch::OnMessage(const muduo::net::TcpConnectionPtr &conn,
                                 muduo::net::Buffer *buf, muduo::Timestamp) {
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_DISPATCHER);
+  PROXY_LOOP_CALLBACK("MessageDispatch::OnMessage");
+  last_receive_us_ = muduo::Timestamp::now().microSecondsSinceEpoch();
   for (;;) {
     ProxyMessagePtr message_head_ptr(std::make_shared<ProxyMessage>());
     if (message_head_ptr->ParseFromBuffer(buf) == false) {
@@ -74,6 +100,8 @@ void MessageDispatch::OnMessage(const muduo::net::TcpConnectionPtr &conn,
     } else {
       buf->retrieve(message_head_ptr->Size());
     }
+    ++stats_.frames_in;
+    stats_.bytes_in += message_head_ptr->Size();
     if (message_head_ptr->message_type % 2 == 0) {
       // response
       auto index = response_handles_.find(message_head_ptr->request_id);
@@ -81,21 +109,42 @@ void MessageDispatch::OnMessage(const muduo::net::TcpConnectionPtr &conn,
         LOG_ERROR << "message resp not found, request_id:"
                   << message_head_ptr->request_id << " maybe timeout";
       } else {
-        LOG_TRACE << "response from:" << conn->peerAddress().toIpPort()
-                  << " request_id:" << message_head_ptr->request_id;
-        (index->second).response_cb(conn, message_head_ptr);
-        double used_time_ms =
-            muduo::timeDifference(muduo::Timestamp::now(),
-                                  (index->second).send_timestamp) *
-            1000;
-        LOG_TRACE << "message_type:" << message_head_ptr->message_type
-                  << " request length:" << (index->second).request.size()
-                  << " response length:" << message_head_ptr->Size()
-                  << " used time(ms):" << used_time_ms;
+        PROXY_LOG_TRACE << "response from:" << conn->peerAddress().toIpPort()
+                        << " request_id:" << message_head_ptr->request_id;
+        // 先移出再回调, 回调中可能会Resume/Abandon
+        RequestContext request_context(std::move(index->second));
         response_handles_.erase(index);
+        AddPendingBytes(
+            -static_cast<int64_t>(request_context.request.Size()));
+        AckResponses(request_context.ack_seq);
+        if (message_head_ptr->message_type == ERROR) {
+          // 对端没有缓存重复请求的响应, 按超时处理
+          LOG_ERROR << "request_id:" << message_head_ptr->request_id
+                    << " failed, peer lost response";
+          ++stats_.timeouts;
+          if (request_context.timeout_cb) {
+            request_context.timeout_cb();
+          }
+          continue;
+        }
+        int64_t used_time_us =
+            muduo::Timestamp::now().microSecondsSinceEpoch() -
+            request_context.send_timestamp.microSecondsSinceEpoch();
+        if (!request_context.resent) {
+          stats_.rtt_us.Add(used_time_us);
+          stats_.rtt.AddSample(used_time_us);
+        }
+        request_context.response_cb(conn, message_head_ptr);
+        PROXY_LOG_TRACE << "message_type:" << message_head_ptr->message_type
+                        << " request length:" << request_context.request.Size()
+                        << " response length:" << message_head_ptr->Size()
+                        << " used time(us):" << used_time_us;
       }
     } else {
       // request
+      if (IsDuplicateRequest(conn, message_head_ptr->request_id)) {
+        continue;
+      }
       auto index = msg_handlers_.find(message_head_ptr->message_type);
       if (index == msg_handlers_.end()) {
         LOG_ERROR << "unregister message_type:"
@@ -126,10 +175,11 @@ void MessageDispatch::OnPbMessage(const muduo::net::TcpConnectionPtr &conn,
                 << " flow_num:" << pb_message->head().flow_no()
                 << " desst_entity:" << pb_message->head().dest_entity();
     } else {
-      LOG_DEBUG << "pb response from:" << conn->peerAddress().toIpPort() << "\n"
-                << pb_message->DebugString();
-      (index->second).response_cb(pb_message);
+      PROXY_LOG_DEBUG << "pb response from:" << conn->peerAddress().toIpPort()
+                      << " " << PbDebugString(*pb_message);
+      PbResponseCb response_cb = std::move((index->second).response_cb);
       pb_response_handles_.erase(index);
+      response_cb(pb_message);
     }
   } else {
     // 查找请求处理函数
@@ -138,8 +188,8 @@ void MessageDispatch::OnPbMessage(const muduo::net::TcpConnectionPtr &conn,
     if (index == pb_register_handles_.end()) {
       LOG_ERROR << "message_type:" << message_type << " handle not registed";
     } else {
-      LOG_DEBUG << "pb request from:" << conn->peerAddress().toIpPort() << "\n"
-                << pb_message->DebugString();
+      PROXY_LOG_DEBUG << "pb request from:" << conn->peerAddress().toIpPort()
+                      << " " << PbDebugString(*pb_message);
       (index->second)(conn, message, pb_message);
     }
   }
@@ -152,6 +202,7 @@ void MessageDispatch::OnPbMessageTimeout(uint32_t source_entity) {
     return;
   } else {
     LOG_ERROR << "pb message timeout, source_id:" << source_entity;
+    ++stats_.timeouts;
     if (index->second.timeout_cb) {
       (index->second).timeout_cb();
     }
@@ -194,8 +245,8 @@ void MessageDispatch::SendPbRequest(const muduo::net::TcpConnectionPtr &conn,
   request_head.length = request_body.Size();
   request_head.request_id = GetRequestId();
   request_head.body = &request_body;
-  LOG_DEBUG << "pb request to:" << conn->peerAddress().toIpPort() << "\n"
-            << message->DebugString();
+  PROXY_LOG_DEBUG << "pb request to:" << conn->peerAddress().toIpPort() << " "
+                  << PbDebugString(*message);
   SendRequest(
       conn, &request_head,
       std::bind(&MessageDispatch::OnPbMessage, this, std::placeholders::_1,
@@ -210,26 +261,37 @@ void MessageDispatch::SendRequest(const muduo::net::TcpConnectionPtr &conn,
                                   MsgHandleFunction response_cb,
                                   TimeoutCb timeout_cb, double timeout,
                                   uint16_t retry_count) {
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_DISPATCHER);
   message->request_id = GetRequestId();
+  if (message->message_type == DATA_REQUEST) {
+    ++stats_.data_frames_out;
+  }
   RequestContext request_context;
   request_context.conn = conn;
   request_context.timeout_count = timeout * 100;
   request_context.retry_count = retry_count;
-  request_context.request = message->ToString();
+  request_context.request = message->ToChain();
   request_context.send_timestamp = muduo::Timestamp::now();
+  request_context.resent = false;
   request_context.response_cb = std::move(response_cb);
   request_context.timeout_cb = std::move(timeout_cb);
-  LOG_TRACE << "request_id:" << message->request_id
-            << " send to:" << conn->peerAddress().toIpPort();
-  conn->send(request_context.request.c_str(), request_context.request.length());
+  PROXY_LOG_TRACE << "request_id:" << message->request_id
+                  << " send to:" << conn->peerAddress().toIpPort();
+  // 连接断开时send不会发出数据, 请求保留到Resume时重发
+  SendFrame(conn, request_context.request);
+  // stats_.frames_out同时作为帧序号
+  request_context.ack_seq = suspended_ ? 0 : stats_.frames_out;
+  AddPendingBytes(request_context.request.Size());
   response_handles_[message->request_id] = std::move(request_context);
 }
 
 void MessageDispatch::SendResponse(const muduo::net::TcpConnectionPtr &conn,
                                    const ProxyMessage *message) {
-  std::string message_ptr = message->ToString();
-  LOG_TRACE << "response to:" << conn->peerAddress().toIpPort();
-  conn->send(message_ptr.c_str(), message_ptr.length());
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_DISPATCHER);
+  std::string frame = message->ToString();
+  PROXY_LOG_TRACE << "response to:" << conn->peerAddress().toIpPort();
+  SendFrame(conn, frame);
+  CacheResponse(message->request_id, frame);
 }
 
 void MessageDispatch::SendPbResponse(const muduo::net::TcpConnectionPtr &conn,
@@ -241,8 +303,8 @@ void MessageDispatch::SendPbResponse(const muduo::net::TcpConnectionPtr &conn,
     LOG_ERROR << "serialize message failed";
     return;
   }
-  LOG_DEBUG << "pb response to:" << conn->peerAddress().toIpPort() << "\n"
-            << message->DebugString();
+  PROXY_LOG_DEBUG << "pb response to:" << conn->peerAddress().toIpPort() << " "
+                  << PbDebugString(*message);
   PbResponseBody response_body;
   response_body.length = message_str.length();
   response_body.data = std::move(message_str);
@@ -254,3 +316,177 @@ void MessageDispatch::SendPbResponse(const muduo::net::TcpConnectionPtr &conn,
   SendResponse(conn, &response_head);
   response_head.body = nullptr;
 }
+
+bool MessageDispatch::IsDuplicateRequest(
+    const muduo::net::TcpConnectionPtr &conn, uint32_t request_id) {
+  // request_id会回绕, 按序列号比较
+  if (has_last_request_id_ &&
+      static_cast<int32_t>(request_id - last_request_id_) <= 0) {
+    size_t offset = 0;
+    for (const CachedResponse &cache : response_cache_) {
+      if (cache.request_id == request_id) {
+        LOG_INFO << "duplicate request_id:" << request_id
+                 << " resend cached response";
+        std::string frame(cached_frames_.peek() + offset, cache.length);
+        SendFrame(conn, frame);
+        // 重发的响应也可能丢失, 等待新的确认
+        CacheResponse(request_id, frame);
+        return true;
+      }
+      offset += cache.length;
+    }
+    // 不能重新处理, 数据请求会重复写入, 回复ERROR由对端按失败处理
+    LOG_WARN << "duplicate request_id:" << request_id
+             << " response not cached, reply error";
+    ProxyMessage error;
+    error.message_type = ERROR;
+    error.request_id = request_id;
+    SendFrame(conn, error.ToString());
+    return true;
+  }
+  has_last_request_id_ = true;
+  last_request_id_ = request_id;
+  return false;
+}
+
+void MessageDispatch::CacheResponse(uint32_t request_id,
+                                    const std::string &frame) {
+  CachedResponse cache;
+  cache.seq = stats_.frames_out;
+  cache.request_id = request_id;
+  cache.length = static_cast<uint32_t>(frame.length());
+  response_cache_.push_back(cache);
+  cached_frames_.append(frame);
+  size_t evicted = 0;
+  while (cached_frames_.readableBytes() > MAX_REPLAY_SIZE) {
+    cached_frames_.retrieve(response_cache_.front().length);
+    response_cache_.pop_front();
+    ++evicted;
+  }
+  if (evicted) {
+    LOG_WARN << "response cache full, drop " << evicted
+             << " unacked responses";
+  }
+}
+
+void MessageDispatch::AckResponses(uint64_t ack_seq) {
+  while (!response_cache_.empty() && response_cache_.front().seq < ack_seq) {
+    cached_frames_.retrieve(response_cache_.front().length);
+    response_cache_.pop_front();
+  }
+}
+
+void MessageDispatch::SendFrame(const muduo::net::TcpConnectionPtr &conn,
+                                const std::string &frame) {
+  ++stats_.frames_out;
+  stats_.bytes_out += frame.size();
+  conn->send(frame.c_str(), static_cast<int>(frame.length()));
+  SampleTunnelOutput(conn);
+}
+
+void MessageDispatch::SendFrame(const muduo::net::TcpConnectionPtr &conn,
+                                const BufferChain &frame) {
+  ++stats_.frames_out;
+  stats_.bytes_out += frame.Size();
+  // 只复制引用, frame仍保留完整的帧用于重发
+  BufferChain rest(frame);
+  int fd = ConnectionFd(conn);
+  if (fd >= 0 && conn->connected() && conn->getLoop()->isInLoopThread() &&
+      conn->outputBuffer()->readableBytes() == 0) {
+    // 出错时剩下的数据交给send, 由muduo处理连接断开
+    rest.WriteTo(fd);
+  }
+  for (const Slice &slice : rest.Slices()) {
+    conn->send(slice.data(), static_cast<int>(slice.size()));
+  }
+  SampleTunnelOutput(conn);
+}
+
+void MessageDispatch::SampleTunnelOutput(
+    const muduo::net::TcpConnectionPtr &conn) {
+  if (memory_) {
+    memory_->Set(MEMORY_TUNNEL_OUTPUT, conn->outputBuffer()->readableBytes());
+  }
+}
+
+int ConnectionFd(const muduo::net::TcpConnectionPtr &conn) {
+  const int *fd = boost::any_cast<int>(&conn->getContext());
+  return fd ? *fd : -1;
+}
+
+void MessageDispatch::AddPendingBytes(int64_t delta) {
+  pending_bytes_ += delta;
+  if (memory_) {
+    memory_->Charge(MEMORY_INFLIGHT, delta);
+  }
+}
+
+void MessageDispatch::Suspend() {
+  LOG_INFO << "suspend " << response_handles_.size()
+           << " pending requests, bytes:" << pending_bytes_;
+  suspended_ = true;
+}
+
+void MessageDispatch::Resume(const muduo::net::TcpConnectionPtr &conn) {
+  suspended_ = false;
+  // 按发送顺序重发, request_id可能回绕, 不能直接使用map的顺序
+  std::vector<uint32_t> request_ids;
+  request_ids.reserve(response_handles_.size());
+  for (const auto &item : response_handles_) {
+    request_ids.push_back(item.first);
+  }
+  std::sort(request_ids.begin(), request_ids.end(),
+            [](uint32_t lhs, uint32_t rhs) {
+              return static_cast<int32_t>(lhs - rhs) < 0;
+            });
+  LOG_INFO << "resume " << request_ids.size()
+           << " pending requests to:" << conn->peerAddress().toIpPort()
+           << " bytes:" << pending_bytes_;
+  for (uint32_t request_id : request_ids) {
+    auto &request_context = response_handles_[request_id];
+    request_context.conn = conn;
+    request_context.resent = true;
+    SendFrame(conn, request_context.request);
+    // 对端在恢复会话之后才会处理, 已经重发过它的请求
+    request_context.ack_seq = stats_.frames_out;
+  }
+}
+
+void MessageDispatch::Abandon() {
+  suspended_ = false;
+  TimeoutRequests(muduo::net::TcpConnectionPtr());
+}
+
+void MessageDispatch::DropRequests(const muduo::net::TcpConnectionPtr &conn) {
+  TimeoutRequests(conn);
+}
+
+void MessageDispatch::ResetPeer() {
+  has_last_request_id_ = false;
+  last_request_id_ = 0;
+  response_cache_.clear();
+  cached_frames_.retrieveAll();
+}
+
+void MessageDispatch::TimeoutRequests(
+    const muduo::net::TcpConnectionPtr &conn) {
+  std::vector<TimeoutCb> timeout_cbs;
+  for (auto index = response_handles_.begin();
+       index != response_handles_.end();) {
+    if (conn && (index->second).conn != conn) {
+      ++index;
+      continue;
+    }
+    LOG_WARN << "drop request_id:" << index->first;
+    ++stats_.timeouts;
+    if ((index->second).timeout_cb) {
+      timeout_cbs.push_back(std::move((index->second).timeout_cb));
+    }
+    AddPendingBytes(-static_cast<int64_t>((index->second).request.Size()));
+    index = response_handles_.erase(index);
+  }
+  // 回调中可能发送新的请求, 遍历结束后再调用
+  for (auto &timeout_cb : timeout_cbs) {
+    timeout_cb();
+  }
+}
@@ -6,12 +6,19 @@
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/TcpConnection.h>
 
+#include <deque>
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "common/buffer_chain.h"
+#include "common/histogram.h"
+#include "common/memory_budget.h"
 #include "common/message.pb.h"
 #include "common/proto.h"
+#include "common/rtt_estimator.h"
 
 typedef std::shared_ptr<proto::Message> MessagePtr;
 typedef std::function<void(const muduo::net::TcpConnectionPtr &conn,
@@ -28,8 +35,14 @@ struct RequestContext {
   // 0.01s自减
   uint32_t timeout_count;
   uint16_t retry_count;
-  std::string request;
+  // 编码后的帧, 数据部分和发送时共享
+  BufferChain request;
   muduo::Timestamp send_timestamp;
+  // 重发过的请求不能确定响应对应哪一次发送, 不计入RTT
+  bool resent;
+  // 发送请求的帧序号, 收到响应说明对端已经处理了之前发送的所有帧
+  // 暂停期间发送的为0, 这时对端可能还没有重发请求
+  uint64_t ack_seq;
   MsgHandleFunction response_cb;
   TimeoutCb timeout_cb;
 };
@@ -39,6 +52,13 @@ struct ResponseContext {
   ProxyMessage request_head;
 };
 
+// 等待对端确认的响应, 帧数据保存在MessageDispatch::cached_frames_
+struct CachedResponse {
+  uint64_t seq;  // 发送时的帧序号
+  uint32_t request_id;
+  uint32_t length;
+};
+
 struct PbRequestContext {
   // 这里超时时间要比RequestContext中大，用于消息无法解析时的超时处理
   uint32_t timeout_count;
@@ -46,6 +66,21 @@ struct PbRequestContext {
   TimeoutCb timeout_cb;
 };
 
+// 收发和超时统计, 只在loop_中更新和读取
+struct DispatchStats {
+  uint64_t frames_in = 0;
+  uint64_t bytes_in = 0;
+  uint64_t frames_out = 0;
+  // 发出的DATA_REQUEST帧, 不包括重发
+  uint64_t data_frames_out = 0;
+  uint64_t bytes_out = 0;
+  uint64_t retries = 0;
+  uint64_t timeouts = 0;
+  // 请求发出到收到响应的时间, 包括对端处理时间和proxy连接输出缓冲的排队时间
+  Histogram rtt_us;
+  RttEstimator rtt;
+};
+
 class MessageDispatch {
  public:
   explicit MessageDispatch(muduo::net::EventLoop *loop);
@@ -67,10 +102,43 @@ class MessageDispatch {
                             const ProxyMessage *message);
   virtual void SendPbResponse(const muduo::net::TcpConnectionPtr &conn,
                               ProxyMessagePtr request, MessagePtr message);
+  // proxy连接断开, 未收到响应的请求保留下来, 暂停超时计算
+  void Suspend();
+  // 在新连接上按request_id顺序重发未收到响应的请求
+  void Resume(const muduo::net::TcpConnectionPtr &conn);
+  // 放弃所有未收到响应的请求, 按超时处理
+  void Abandon();
+  // 放弃发送到conn的请求, 按超时处理
+  void DropRequests(const muduo::net::TcpConnectionPtr &conn);
+  // 对端是新的实例, 清除重复请求检测的状态
+  void ResetPeer();
+  // 未收到响应的请求副本和proxy连接输出缓冲计入account
+  void SetMemoryAccount(MemoryAccount *account) { memory_ = account; }
+  // 未收到响应的请求占用的字节数
+  size_t PendingBytes() const { return pending_bytes_; }
+  // 未收到响应的请求数
+  size_t InflightRequests() const { return response_handles_.size(); }
+  const DispatchStats &Stats() const { return stats_; }
+  // 最后一次收到对端数据的时间
+  int64_t LastReceiveUs() const { return last_receive_us_; }
 
  private:
   void CheckTimeout();
+  // conn为空时处理所有请求
+  void TimeoutRequests(const muduo::net::TcpConnectionPtr &conn);
+  bool IsDuplicateRequest(const muduo::net::TcpConnectionPtr &conn,
+                          uint32_t request_id);
+  void CacheResponse(uint32_t request_id, const std::string &frame);
+  // 删除帧序号小于ack_seq的响应, 对端已经收到
+  void AckResponses(uint64_t ack_seq);
   void OnPbMessageTimeout(uint32_t source_entity);
+  void SendFrame(const muduo::net::TcpConnectionPtr &conn,
+                 const std::string &frame);
+  // 输出缓冲为空时直接writev, 写不完的部分才拷贝到输出缓冲
+  void SendFrame(const muduo::net::TcpConnectionPtr &conn,
+                 const BufferChain &frame);
+  void SampleTunnelOutput(const muduo::net::TcpConnectionPtr &conn);
+  void AddPendingBytes(int64_t delta);
   uint32_t GetRequestId() { return ++request_id_; }
 
   muduo::net::EventLoop *loop_;
@@ -81,6 +149,21 @@ class MessageDispatch {
   std::map<uint32_t, PbRequestContext> pb_response_handles_;
   uint32_t request_id_;
   muduo::net::TimerId check_timeout_timerid;
+  bool suspended_;
+  size_t pending_bytes_;
+  MemoryAccount *memory_;
+  // 对端最后处理的request_id, 用于丢弃恢复会话时重发的重复请求
+  bool has_last_request_id_;
+  uint32_t last_request_id_;
+  // 对端还没有确认的响应, 按发送顺序保存, 重复请求直接回复
+  // 总长度超过MAX_REPLAY_SIZE时丢弃最早的
+  std::deque<CachedResponse> response_cache_;
+  muduo::net::Buffer cached_frames_;
+  DispatchStats stats_;
+  int64_t last_receive_us_;
 };
 
+// TcpServer和TcpClient把socket fd放在连接的context中, 使用者覆盖后返回-1
+int ConnectionFd(const muduo::net::TcpConnectionPtr &conn);
+
 #endif  // COMMON_MESSAGE_DISPATCH_H_
@@ -47,4 +47,7 @@ void MakeMessage(proto::Message *msg, proto::MessageType message_type,
   if (session_key) {
     head->set_session_key(session_key);
   }
-}
\ No newline at end of file
+}
+uint64_t GenSessionKey() {
+  return (static_cast<uint64_t>(dis(gen)) << 32) | dis(gen);
+}
@@ -7,6 +7,16 @@
 #include "common/message.pb.h"
 
 #define MB_SIZE 1024 * 1024
+// 会话恢复时最多重发的数据量
+#define MAX_REPLAY_SIZE 64 * MB_SIZE
+
+// ListenResponse retcode
+enum ListenRetCode {
+  LISTEN_SUCCESS = 0,
+  LISTEN_FAILED = -1,
+  // 恢复会话时会话不存在或已过期
+  LISTEN_SESSION_NOT_FOUND = -2,
+};
 
 void MakeResponse(const proto::Message *req_msg,
                   proto::MessageType message_type, proto::Message *resp_msg);
@@ -15,4 +25,7 @@ void MakeMessage(proto::Message *msg, proto::MessageType message_type,
                  uint32_t source_entity, std::string auth_key = "",
                  uint64_t session_key = 0);
 
+// 生成非0的随机session_key
+uint64_t GenSessionKey();
+
 #endif  // COMMON_MESSAGE_UTIL_H_
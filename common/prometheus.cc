@@ -0,0 +1,155 @@
+// Copyright [2021] zhangke
+
+#include "common/prometheus.h"
+
+#include <stdio.h>
+
+void PrometheusWriter::AddCounter(const std::string &name, const char *help,
+                                  const std::string &labels, double value) {
+  AddSample(&GetFamily(name, "counter", help).samples, name, labels, value);
+}
+
+void PrometheusWriter::AddGauge(const std::string &name, const char *help,
+                                const std::string &labels, double value) {
+  AddSample(&GetFamily(name, "gauge", help).samples, name, labels, value);
+}
+
+void PrometheusWriter::AddHistogram(const std::string &name, const char *help,
+                                    const std::string &labels,
+                                    const Histogram &histogram) {
+  Family &family = GetFamily(name, "histogram", help);
+  std::string prefix = labels.empty() ? "" : labels + ",";
+  uint64_t cumulative = 0;
+  char le[64];
+  for (int index = 0; index < Histogram::kBucketNum; ++index) {
+    cumulative += histogram.Bucket(index);
+    snprintf(le, sizeof(le), "le=\"%lld\"",
+             static_cast<long long>(Histogram::BucketUpperBound(index)));
+    AddSample(&family.samples, name + "_bucket", prefix + le, cumulative);
+    // 超过最大值之后的桶都相同, 只保留+Inf
+    if (cumulative == histogram.Count()) {
+      break;
+    }
+  }
+  AddSample(&family.samples, name + "_bucket", prefix + "le=\"+Inf\"",
+            histogram.Count());
+  AddSample(&family.samples, name + "_sum", labels, histogram.Sum());
+  AddSample(&family.samples, name + "_count", labels, histogram.Count());
+}
+
+void PrometheusWriter::AddLoopStats(const LoopMonitor::Stats &stats) {
+  std::string labels = "loop=\"" + stats.name + "\"";
+  AddHistogram("proxy_loop_lag_us",
+               "Delay between a timer's due time and its execution", labels,
+               stats.lag);
+  AddHistogram("proxy_loop_callback_us",
+               "Duration of instrumented outermost loop callbacks", labels,
+               stats.callback);
+  AddCounter("proxy_loop_stalls_total",
+             "Loop lag or callbacks beyond the stall threshold",
+             labels + ",kind=\"lag\"", stats.lag_stalls);
+  AddCounter("proxy_loop_stalls_total",
+             "Loop lag or callbacks beyond the stall threshold",
+             labels + ",kind=\"callback\"", stats.callback_stalls);
+  for (const auto &item : stats.callbacks) {
+    AddGauge("proxy_loop_callback_max_us",
+             "Longest run of each instrumented callback",
+             labels + ",callback=\"" + item.first + "\"", item.second.max_us);
+  }
+}
+
+void PrometheusWriter::AddConnTraceStats(const ConnTraceStats &stats,
+                                         const std::string &labels) {
+  std::string side_labels = (labels.empty() ? "" : labels + ",") +
+                            "side=\"" + stats.Side() + "\"";
+  for (size_t index = 1; index < stats.PointNum(); ++index) {
+    AddHistogram("proxy_conn_setup_phase_us",
+                 "Time from the previous connection milestone to this one",
+                 side_labels + ",phase=\"" + stats.PointName(index) + "\"",
+                 stats.Phase(index));
+  }
+  AddHistogram("proxy_conn_setup_total_us",
+               "Time from the first to the last connection milestone",
+               side_labels, stats.Total());
+  AddCounter("proxy_conn_setup_incomplete_total",
+             "Connections closed before reaching the last milestone",
+             side_labels, stats.Incomplete());
+}
+
+void PrometheusWriter::AddMemoryAccount(const MemoryAccount &account,
+                                        const std::string &labels) {
+  std::string prefix = labels.empty() ? "" : labels + ",";
+  for (int kind = 0; kind < MEMORY_KIND_NUM; ++kind) {
+    MemoryKind memory_kind = static_cast<MemoryKind>(kind);
+    AddGauge("proxy_memory_bytes", "Buffered bytes charged to the budget",
+             prefix + "kind=\"" + MemoryAccount::KindName(memory_kind) + "\"",
+             account.Used(memory_kind));
+  }
+}
+
+void PrometheusWriter::AddMemoryBudget(const MemoryBudget &budget) {
+  AddGauge("proxy_memory_budget_bytes",
+           "Process-wide budget for buffered bytes, 0 means unlimited", "",
+           budget.Limit());
+  AddGauge("proxy_memory_used_bytes",
+           "Buffered bytes charged by all instances", "", budget.Used());
+  AddGauge("proxy_memory_pressure",
+           "1 while sources are paused because of the memory budget", "",
+           budget.Pressure() ? 1 : 0);
+}
+
+void PrometheusWriter::AddSlabPoolStats() {
+  AddGauge("proxy_slab_in_use", "Buffer slabs borrowed by connections", "",
+           SlabPool::InUse());
+  AddGauge("proxy_slab_cached", "Free buffer slabs cached by all loops", "",
+           SlabPool::CachedTotal());
+  AddGauge("proxy_slab_size_bytes", "Size of one buffer slab", "",
+           SlabPool::kSlabSize);
+}
+
+void PrometheusWriter::AddBufferSweeperStats() {
+  AddCounter("proxy_buffer_shrinks_total",
+             "Connection buffers shrunk back to the baseline", "",
+             BufferSweeper::Shrinks());
+  AddCounter("proxy_buffer_freed_bytes_total",
+             "Bytes freed by shrinking buffers and trimming slab caches", "",
+             BufferSweeper::FreedBytes());
+  AddCounter("proxy_malloc_trim_total", "Calls to malloc_trim", "",
+             BufferSweeper::Trims());
+}
+
+std::string PrometheusWriter::ToString() const {
+  std::string result;
+  for (const std::string &name : names_) {
+    const Family &family = families_.at(name);
+    result += "# HELP " + name + " " + family.help + "\n";
+    result += "# TYPE " + name + " " + family.type + "\n";
+    result += family.samples;
+  }
+  return result;
+}
+
+PrometheusWriter::Family &PrometheusWriter::GetFamily(const std::string &name,
+                                                      const char *type,
+                                                      const char *help) {
+  auto index = families_.find(name);
+  if (index == families_.end()) {
+    names_.push_back(name);
+    Family &family = families_[name];
+    family.type = type;
+    family.help = help;
+    return family;
+  }
+  return index->second;
+}
+
+void PrometheusWriter::AddSample(std::string *samples, const std::string &name,
+                                 const std::string &labels, double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %.17g\n", value);
+  samples->append(name);
+  if (!labels.empty()) {
+    samples->append("{" + labels + "}");
+  }
+  samples->append(buf);
+}
@@ -0,0 +1,58 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_PROMETHEUS_H_
+#define COMMON_PROMETHEUS_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/buffer_sweeper.h"
+#include "common/conn_trace.h"
+#include "common/histogram.h"
+#include "common/loop_monitor.h"
+#include "common/memory_budget.h"
+#include "common/slab_pool.h"
+
+// 生成Prometheus文本格式, 同名指标的样本合并在一个HELP/TYPE下
+// labels形如 a="1",b="2", 为空表示没有label
+class PrometheusWriter {
+ public:
+  void AddCounter(const std::string &name, const char *help,
+                  const std::string &labels, double value);
+  void AddGauge(const std::string &name, const char *help,
+                const std::string &labels, double value);
+  // 输出_bucket, _sum和_count, 桶上界取Histogram的2的幂边界
+  void AddHistogram(const std::string &name, const char *help,
+                    const std::string &labels, const Histogram &histogram);
+  // LoopMonitor的调度延迟, 回调耗时和超时次数, label为loop="name"
+  void AddLoopStats(const LoopMonitor::Stats &stats);
+  // 连接建立各阶段的耗时, 增加side和phase两个label
+  void AddConnTraceStats(const ConnTraceStats &stats,
+                         const std::string &labels);
+  // 实例各类缓冲占用的内存, 增加kind label
+  void AddMemoryAccount(const MemoryAccount &account,
+                        const std::string &labels);
+  // 进程内存预算和总使用量
+  void AddMemoryBudget(const MemoryBudget &budget);
+  // 所有线程SlabPool借出和缓存的块数
+  void AddSlabPoolStats();
+  // 缓冲缩小和malloc_trim的次数
+  void AddBufferSweeperStats();
+  std::string ToString() const;
+
+ private:
+  struct Family {
+    std::string type;
+    std::string help;
+    std::string samples;
+  };
+  Family &GetFamily(const std::string &name, const char *type,
+                    const char *help);
+  void AddSample(std::string *samples, const std::string &name,
+                 const std::string &labels, double value);
+
+  std::vector<std::string> names_;
+  std::map<std::string, Family> families_;
+};
+
+#endif  // COMMON_PROMETHEUS_H_
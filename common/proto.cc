@@ -5,24 +5,29 @@
 #include <assert.h>
 #include <muduo/base/Logging.h>
 
+#include "common/alloc_stats.h"
+#include "common/log_util.h"
+
 uint16_t GetUint16(const char *str) {
   uint16_t result;
   memcpy(&result, str, sizeof(uint16_t));
-  LOG_TRACE << "GetUint16 network:" << result << " host:" << ntohs(result);
+  PROXY_LOG_TRACE << "GetUint16 network:" << result << " host:"
+                  << ntohs(result);
   return ntohs(result);
 }
 
 uint32_t GetUint32(const char *str) {
   uint32_t result;
   memcpy(&result, str, sizeof(uint32_t));
-  LOG_TRACE << "GetUint32 network:" << result << " host:" << ntohl(result);
+  PROXY_LOG_TRACE << "GetUint32 network:" << result << " host:"
+                  << ntohl(result);
   return ntohl(result);
 }
 
 int32_t Getint32(const char *str) {
   int32_t result;
   memcpy(&result, str, sizeof(uint32_t));
-  LOG_TRACE << "Getint32 network:" << result << " host:" << ntohl(result);
+  PROXY_LOG_TRACE << "Getint32 network:" << result << " host:" << ntohl(result);
   return ntohl(result);
 }
 
@@ -30,10 +35,11 @@ uint64_t GetUint64(const char *str) {
   uint64_t result;
   memcpy(&result, str, sizeof(uint64_t));
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-  LOG_TRACE << "GetUint64 network:" << result << " host:" << be64toh(result);
+  PROXY_LOG_TRACE << "GetUint64 network:" << result << " host:"
+                  << be64toh(result);
   return be64toh(result);
 #else
-  LOG_TRACE << "GetUint64 network:" << result << " host:" << result;
+  PROXY_LOG_TRACE << "GetUint64 network:" << result << " host:" << result;
   return result;
 #endif
 }
@@ -51,7 +57,9 @@ size_t ProxyMessage::Size() const {
 }
 
 bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
-  LOG_TRACE << "length: " << str_length << " message head size:" << Size();
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_CODEC);
+  PROXY_LOG_TRACE << "length: " << str_length << " message head size:"
+                  << Size();
   if (str_length < Size()) {
     return false;
   }
@@ -66,7 +74,11 @@ bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
   pos += sizeof(request_id);
   bool body_parse_ret = false;
   switch (message_type) {
-    case ERROR:
+    case ERROR: {
+      // 只有头部, 对端无法响应这个request_id
+      body_parse_ret = true;
+      break;
+    }
     case ECHO_REQUEST:
     case ECHO_RESPONSE: {
       break;
@@ -75,11 +87,11 @@ bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
       body = new PbRequestBody();
       body_parse_ret = body->ParseFromStr(str + pos, str_length - pos);
       if (!body_parse_ret) {
-        LOG_TRACE << "Parse body pb request failed";
+        PROXY_LOG_TRACE << "Parse body pb request failed";
         delete body;
         body = nullptr;
       } else {
-        LOG_TRACE << "Parse body pb request succ";
+        PROXY_LOG_TRACE << "Parse body pb request succ";
       }
       break;
     }
@@ -87,11 +99,11 @@ bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
       body = new PbResponseBody();
       body_parse_ret = body->ParseFromStr(str + pos, str_length - pos);
       if (!body_parse_ret) {
-        LOG_TRACE << "Parse body pb response failed";
+        PROXY_LOG_TRACE << "Parse body pb response failed";
         delete body;
         body = nullptr;
       } else {
-        LOG_TRACE << "Parse body pb response succ";
+        PROXY_LOG_TRACE << "Parse body pb response succ";
       }
       break;
     }
@@ -99,11 +111,11 @@ bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
       body = new DataRequestBody();
       body_parse_ret = body->ParseFromStr(str + pos, str_length - pos);
       if (!body_parse_ret) {
-        LOG_TRACE << "Parse body data request failed";
+        PROXY_LOG_TRACE << "Parse body data request failed";
         delete body;
         body = nullptr;
       } else {
-        LOG_TRACE << "Parse body data request succ";
+        PROXY_LOG_TRACE << "Parse body data request succ";
       }
       break;
     }
@@ -111,16 +123,16 @@ bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
       body = new DataResponseBody();
       body_parse_ret = body->ParseFromStr(str + pos, str_length - pos);
       if (!body_parse_ret) {
-        LOG_TRACE << "Parse body data response failed";
+        PROXY_LOG_TRACE << "Parse body data response failed";
         delete body;
         body = nullptr;
       } else {
-        LOG_TRACE << "Parse body data response succ";
+        PROXY_LOG_TRACE << "Parse body data response succ";
       }
       break;
     }
     default: {
-      LOG_TRACE << "unhandle message type:" << message_type;
+      PROXY_LOG_TRACE << "unhandle message type:" << message_type;
       break;
     }
   }
@@ -128,39 +140,58 @@ bool ProxyMessage::ParseFromStr(const char *str, size_t str_length) {
 }
 
 std::string ProxyMessage::ToString() const {
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_CODEC);
   std::string result;
   result.reserve(Size());
-  uint16_t message_type_n = htons(message_type);
-  result.append(reinterpret_cast<char *>(&message_type_n),
-                sizeof(message_type_n));
-  uint16_t message_version_n = htons(message_version);
-  result.append(reinterpret_cast<char *>(&message_version_n),
-                sizeof(message_version_n));
-  uint32_t length_n = htonl(length);
-  result.append(reinterpret_cast<char *>(&length_n), sizeof(length_n));
-  uint32_t request_id_n = htonl(request_id);
-  result.append(reinterpret_cast<char *>(&request_id_n), sizeof(request_id_n));
-  LOG_TRACE << "ProxyMessage total size:" << Size()
-            << " message_type:" << message_type << " body length:" << length
-            << " request_id:" << request_id;
+  AppendHead(&result);
   if (body) {
-    LOG_TRACE << "actual body length:" << body->Size();
+    PROXY_LOG_TRACE << "actual body length:" << body->Size();
     result.append(body->ToString());
   }
   return result;
 }
 
+BufferChain ProxyMessage::ToChain() const {
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_CODEC);
+  std::string head;
+  AppendHead(&head);
+  Slice payload;
+  if (body) {
+    payload = body->EncodeHead(&head);
+  }
+  BufferChain chain;
+  chain.Append(std::move(head));
+  chain.Append(std::move(payload));
+  return chain;
+}
+
+void ProxyMessage::AppendHead(std::string *result) const {
+  uint16_t message_type_n = htons(message_type);
+  result->append(reinterpret_cast<char *>(&message_type_n),
+                 sizeof(message_type_n));
+  uint16_t message_version_n = htons(message_version);
+  result->append(reinterpret_cast<char *>(&message_version_n),
+                 sizeof(message_version_n));
+  uint32_t length_n = htonl(length);
+  result->append(reinterpret_cast<char *>(&length_n), sizeof(length_n));
+  uint32_t request_id_n = htonl(request_id);
+  result->append(reinterpret_cast<char *>(&request_id_n), sizeof(request_id_n));
+  PROXY_LOG_TRACE << "ProxyMessage total size:" << Size()
+                  << " message_type:" << message_type
+                  << " body length:" << length << " request_id:" << request_id;
+}
+
 size_t PbRequestBody::Size() const { return sizeof(length) + length; }
 
 bool PbRequestBody::ParseFromStr(const char *str, size_t str_length) {
-  LOG_TRACE << "length: " << str_length << " minimal size:" << Size();
+  PROXY_LOG_TRACE << "length: " << str_length << " minimal size:" << Size();
   if (str_length < Size()) {
     return false;
   }
   int pos = 0;
   length = GetUint32(str + pos);
   pos += sizeof(length);
-  LOG_TRACE << "length: " << str_length << " actual need size:" << Size();
+  PROXY_LOG_TRACE << "length: " << str_length << " actual need size:" << Size();
   if (str_length < Size()) {
     return false;
   }
@@ -175,8 +206,8 @@ std::string PbRequestBody::ToString() const {
   uint32_t length_n = htonl(length);
   result.append(reinterpret_cast<char *>(&length_n), sizeof(length_n));
   result.append(data);
-  LOG_TRACE << "PbRequest[Response]Body total size:" << Size()
-            << " length:" << length << " data length:" << data.length();
+  PROXY_LOG_TRACE << "PbRequest[Response]Body total size:" << Size()
+                  << " length:" << length << " data length:" << data.length();
   return result;
 }
 
@@ -185,7 +216,7 @@ size_t DataRequestBody::Size() const {
 }
 
 bool DataRequestBody::ParseFromStr(const char *str, size_t str_length) {
-  LOG_TRACE << "length: " << str_length << " minimal size:" << Size();
+  PROXY_LOG_TRACE << "length: " << str_length << " minimal size:" << Size();
   if (str_length < Size()) {
     return false;
   }
@@ -194,7 +225,7 @@ bool DataRequestBody::ParseFromStr(const char *str, size_t str_length) {
   pos += sizeof(length);
   conn_key = GetUint64(str + pos);
   pos += sizeof(conn_key);
-  LOG_TRACE << "length: " << str_length << " actual need size:" << Size();
+  PROXY_LOG_TRACE << "length: " << str_length << " actual need size:" << Size();
   if (str_length < Size()) {
     return false;
   }
@@ -204,20 +235,31 @@ bool DataRequestBody::ParseFromStr(const char *str, size_t str_length) {
 
 std::string DataRequestBody::ToString() const {
   std::string result;
-  assert(data.length() == length);
   result.reserve(Size());
+  Slice shared = EncodeHead(&result);
+  if (!shared.empty()) {
+    result.append(shared.data(), shared.size());
+  }
+  return result;
+}
+
+Slice DataRequestBody::EncodeHead(std::string *out) const {
+  assert((payload.empty() ? data.length() : payload.size()) == length);
   uint32_t length_n = htonl(length);
-  result.append(reinterpret_cast<char *>(&length_n), sizeof(length_n));
+  out->append(reinterpret_cast<char *>(&length_n), sizeof(length_n));
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
   uint64_t conn_key_n = htobe64(conn_key);
 #else
   uint64_t conn_key_n = conn_key;
 #endif
-  result.append(reinterpret_cast<char *>(&conn_key_n), sizeof(conn_key_n));
-  result.append(data);
-  LOG_TRACE << "DataRequestBody total size:" << Size() << " length:" << length
-            << " conn_key:" << conn_key << " data length:" << data.length();
-  return result;
+  out->append(reinterpret_cast<char *>(&conn_key_n), sizeof(conn_key_n));
+  PROXY_LOG_TRACE << "DataRequestBody total size:" << Size()
+                  << " length:" << length << " conn_key:" << conn_key;
+  if (payload.empty()) {
+    out->append(data);
+    return Slice();
+  }
+  return payload;
 }
 
 size_t DataResponseBody::Size() const {
@@ -225,7 +267,7 @@ size_t DataResponseBody::Size() const {
 }
 
 bool DataResponseBody::ParseFromStr(const char *str, size_t str_length) {
-  LOG_TRACE << "length: " << str_length << " minimal size:" << Size();
+  PROXY_LOG_TRACE << "length: " << str_length << " minimal size:" << Size();
   if (str_length < Size()) {
     return false;
   }
@@ -234,7 +276,7 @@ bool DataResponseBody::ParseFromStr(const char *str, size_t str_length) {
   pos += sizeof(length);
   retcode = Getint32(str + pos);
   pos += sizeof(retcode);
-  LOG_TRACE << "length: " << str_length << " actual need size:" << Size();
+  PROXY_LOG_TRACE << "length: " << str_length << " actual need size:" << Size();
   if (str_length < Size()) {
     return false;
   }
@@ -251,7 +293,8 @@ std::string DataResponseBody::ToString() const {
   uint32_t retcode_n = htonl(retcode);
   result.append(reinterpret_cast<char *>(&retcode_n), sizeof(retcode_n));
   result.append(data);
-  LOG_TRACE << "DataResponseBody total size:" << Size() << " length:" << length
-            << " retcode:" << retcode << " data length:" << data.length();
+  PROXY_LOG_TRACE << "DataResponseBody total size:" << Size()
+                  << " length:" << length
+                  << " retcode:" << retcode << " data length:" << data.length();
   return result;
 }
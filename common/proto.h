@@ -10,6 +10,8 @@
 #include <memory>
 #include <string>
 
+#include "common/buffer_chain.h"
+
 uint16_t GetUint16(const char *str);
 
 uint32_t GetUint32(const char *str);
@@ -46,6 +48,11 @@ struct MessageBase {
     return ParseFromStr(str.c_str(), str.length());
   }
   virtual std::string ToString() const = 0;
+  // 编码时把需要拷贝的部分追加到out, 返回可以共享的数据片段
+  virtual Slice EncodeHead(std::string *out) const {
+    out->append(ToString());
+    return Slice();
+  }
 };
 
 struct ProxyMessage : public MessageBase {
@@ -89,6 +96,11 @@ struct ProxyMessage : public MessageBase {
   size_t Size() const override;
   bool ParseFromStr(const char *str, size_t str_length) override;
   std::string ToString() const override;
+  // 头部和body中需要拷贝的部分合成一个片段, 数据部分共享不拷贝
+  BufferChain ToChain() const;
+
+ private:
+  void AppendHead(std::string *out) const;
 };
 
 struct PbRequestBody : public MessageBase {
@@ -106,10 +118,13 @@ struct DataRequestBody : public MessageBase {
   DataRequestBody() : length(0), conn_key(0) {}
   uint32_t length;
   uint64_t conn_key;
+  // 解析时填充data; 发送时可以设置payload代替data, 编码时不拷贝
   std::string data;
+  Slice payload;
   size_t Size() const override;
   bool ParseFromStr(const char *str, size_t str_length) override;
   std::string ToString() const override;
+  Slice EncodeHead(std::string *out) const override;
 };
 
 enum DataResponseCode : int32_t {
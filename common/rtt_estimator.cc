@@ -0,0 +1,21 @@
+// Copyright [2021] zhangke
+
+#include "common/rtt_estimator.h"
+
+#include <algorithm>
+
+void RttEstimator::AddSample(int64_t rtt_us) {
+  rtt_us = std::max<int64_t>(rtt_us, 0);
+  if (samples_ == 0) {
+    srtt_us_ = rtt_us;
+    rttvar_us_ = rtt_us / 2;
+    min_rtt_us_ = rtt_us;
+  } else {
+    int64_t delta = srtt_us_ > rtt_us ? srtt_us_ - rtt_us : rtt_us - srtt_us_;
+    // beta = 1/4, alpha = 1/8
+    rttvar_us_ = (3 * rttvar_us_ + delta) / 4;
+    srtt_us_ = (7 * srtt_us_ + rtt_us) / 8;
+    min_rtt_us_ = std::min(min_rtt_us_, rtt_us);
+  }
+  ++samples_;
+}
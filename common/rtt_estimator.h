@@ -0,0 +1,28 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_RTT_ESTIMATOR_H_
+#define COMMON_RTT_ESTIMATOR_H_
+
+#include <stdint.h>
+
+// 按RFC 6298平滑RTT和偏差, 单位us, 非线程安全
+class RttEstimator {
+ public:
+  RttEstimator()
+      : srtt_us_(0), rttvar_us_(0), min_rtt_us_(0), samples_(0) {}
+  void AddSample(int64_t rtt_us);
+  bool HasSample() const { return samples_ > 0; }
+  uint64_t Samples() const { return samples_; }
+  int64_t SrttUs() const { return srtt_us_; }
+  int64_t RttvarUs() const { return rttvar_us_; }
+  int64_t MinRttUs() const { return min_rtt_us_; }
+  // srtt + 4 * rttvar, 没有样本时为0
+  int64_t RtoUs() const { return srtt_us_ + 4 * rttvar_us_; }
+
+ private:
+  int64_t srtt_us_;
+  int64_t rttvar_us_;
+  int64_t min_rtt_us_;
+  uint64_t samples_;
+};
+
+#endif  // COMMON_RTT_ESTIMATOR_H_
@@ -0,0 +1,52 @@
+// Copyright [2021] zhangke
+
+#include "common/slab_pool.h"
+
+const size_t SlabPool::kSlabSize;
+const size_t SlabPool::kMaxCached;
+std::atomic<int64_t> SlabPool::in_use_(0);
+std::atomic<int64_t> SlabPool::cached_total_(0);
+
+SlabPool &SlabPool::ThisThread() {
+  static thread_local SlabPool pool;
+  return pool;
+}
+
+SlabPool::~SlabPool() {
+  cached_total_ -= free_.size();
+  for (char *slab : free_) {
+    delete[] slab;
+  }
+}
+
+char *SlabPool::Allocate() {
+  ++in_use_;
+  if (free_.empty()) {
+    return new char[kSlabSize];
+  }
+  char *slab = free_.back();
+  free_.pop_back();
+  --cached_total_;
+  return slab;
+}
+
+size_t SlabPool::Trim(size_t keep) {
+  size_t trimmed = 0;
+  while (free_.size() > keep) {
+    delete[] free_.back();
+    free_.pop_back();
+    ++trimmed;
+  }
+  cached_total_ -= trimmed;
+  return trimmed;
+}
+
+void SlabPool::Release(char *slab) {
+  --in_use_;
+  if (free_.size() >= kMaxCached) {
+    delete[] slab;
+    return;
+  }
+  free_.push_back(slab);
+  ++cached_total_;
+}
@@ -0,0 +1,42 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_SLAB_POOL_H_
+#define COMMON_SLAB_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+// 每个线程(即每个EventLoop)一个固定大小内存块的缓存池
+// 连接只在有数据暂存时借用, 写完立即归还给其他连接复用
+// 在其他线程归还的块进入归还线程的缓存, 每个线程最多缓存kMaxCached个
+class SlabPool {
+ public:
+  static const size_t kSlabSize = 16 * 1024;
+  static const size_t kMaxCached = 256;
+
+  // 当前线程的缓存池
+  static SlabPool &ThisThread();
+  ~SlabPool();
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+  char *Allocate();
+  void Release(char *slab);
+  size_t Cached() const { return free_.size(); }
+  // 释放超过keep个的缓存块, 返回释放的块数
+  size_t Trim(size_t keep);
+
+  // 所有线程借出/缓存的块数
+  static int64_t InUse() { return in_use_; }
+  static int64_t CachedTotal() { return cached_total_; }
+
+ private:
+  SlabPool() = default;
+
+  std::vector<char *> free_;
+  static std::atomic<int64_t> in_use_;
+  static std::atomic<int64_t> cached_total_;
+};
+
+#endif  // COMMON_SLAB_POOL_H_
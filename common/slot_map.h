@@ -0,0 +1,251 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_SLOT_MAP_H_
+#define COMMON_SLOT_MAP_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <deque>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+// 指向SlotMap中元素的引用, 绑定到连接的回调中, 不需要查找就能访问连接状态
+// 元素删除时key清0, get()比较key判断元素是否还存在, 和元素的地址是否被
+// 新连接复用无关. 只能在修改SlotMap的线程中调用get()
+template <typename T>
+class SlotRef {
+ public:
+  SlotRef() : entry_(nullptr), key_(0) {}
+  explicit SlotRef(std::pair<uint64_t, T> *entry)
+      : entry_(entry), key_(entry ? entry->first : 0) {}
+  uint64_t key() const { return key_; }
+  // 元素已经删除时返回nullptr
+  T *get() const {
+    return key_ && entry_->first == key_ ? &entry_->second : nullptr;
+  }
+
+ private:
+  std::pair<uint64_t, T> *entry_;
+  uint64_t key_;
+};
+
+// 按下标直接访问的连接表, key的低32位是slot下标, 高32位是generation
+// slot释放后generation加1, 用旧key查找时generation不一致, 返回end()
+// server用Insert分配key(即conn_key), client用Emplace放入server分配的key:
+// server的slot下标是连续复用的, client直接使用同一个下标. server复用slot时
+// client可能还没有删除旧连接, 这时新key放到overflow_中, 按key顺序查找
+// slot用deque保存并且不会释放, 元素的地址在SlotMap析构之前不变
+template <typename T>
+class SlotMap {
+ public:
+  typedef std::pair<uint64_t, T> value_type;
+
+ private:
+  struct Slot {
+    Slot() : generation(1), used(false) {}
+    uint32_t generation;
+    bool used;
+    value_type value;
+  };
+
+  // Map为SlotMap或const SlotMap, pos_之前的slot已经跳过
+  template <typename Map, typename Value>
+  class Iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Value value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef Value *pointer;
+    typedef Value &reference;
+
+    Iterator() : map_(nullptr), pos_(0) {}
+    Iterator(Map *map, size_t pos) : map_(map), pos_(map->Skip(pos)) {}
+    // iterator转换为const_iterator
+    template <typename M, typename V>
+    Iterator(const Iterator<M, V> &other)  // NOLINT
+        : map_(other.map_), pos_(other.pos_) {}
+    Value &operator*() const { return *map_->At(pos_); }
+    Value *operator->() const { return map_->At(pos_); }
+    Iterator &operator++() {
+      pos_ = map_->Skip(pos_ + 1);
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator old(*this);
+      ++*this;
+      return old;
+    }
+    bool operator==(const Iterator &other) const { return pos_ == other.pos_; }
+    bool operator!=(const Iterator &other) const { return pos_ != other.pos_; }
+
+   private:
+    friend class SlotMap;
+    template <typename M, typename V>
+    friend class Iterator;
+    Map *map_;
+    size_t pos_;
+  };
+
+ public:
+  typedef Iterator<SlotMap, value_type> iterator;
+  typedef Iterator<const SlotMap, const value_type> const_iterator;
+
+  // Emplace的slot超过当前大小太多时放到overflow_, 避免异常的key占用内存
+  static const size_t kMaxSlotGap = 4096;
+
+  static uint32_t SlotOf(uint64_t key) { return static_cast<uint32_t>(key); }
+  static uint32_t GenerationOf(uint64_t key) {
+    return static_cast<uint32_t>(key >> 32);
+  }
+  static uint64_t MakeKey(uint32_t slot, uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) | slot;
+  }
+
+  SlotMap() : size_(0), overflow_size_(0), external_(false) {}
+  SlotMap(const SlotMap &) = delete;
+  SlotMap &operator=(const SlotMap &) = delete;
+
+  // 分配slot并返回key, generation从1开始, key不会为0
+  uint64_t Insert(T value) {
+    assert(!external_);
+    uint32_t slot;
+    if (free_slots_.empty()) {
+      slot = static_cast<uint32_t>(slots_.size());
+      slots_.emplace_back();
+    } else {
+      slot = free_slots_.back();
+      free_slots_.pop_back();
+    }
+    Slot &entry = slots_[slot];
+    entry.used = true;
+    entry.value.first = MakeKey(slot, entry.generation);
+    entry.value.second = std::move(value);
+    ++size_;
+    return entry.value.first;
+  }
+  // 放入对端分配的key, 已经存在时返回false
+  std::pair<iterator, bool> Emplace(uint64_t key, T value) {
+    iterator index = find(key);
+    if (index != end()) {
+      return std::make_pair(index, false);
+    }
+    external_ = true;
+    ++size_;
+    size_t slot = SlotOf(key);
+    if (slot >= slots_.size() && slot - slots_.size() < kMaxSlotGap) {
+      slots_.resize(slot + 1);
+    }
+    if (slot < slots_.size() && !slots_[slot].used) {
+      Slot &entry = slots_[slot];
+      entry.used = true;
+      entry.value.first = key;
+      entry.value.second = std::move(value);
+      return std::make_pair(iterator(this, slot), true);
+    }
+    // slot还被旧的key占用
+    size_t offset;
+    if (overflow_free_.empty()) {
+      offset = overflow_.size();
+      overflow_.emplace_back();
+    } else {
+      offset = overflow_free_.back();
+      overflow_free_.pop_back();
+    }
+    Slot &entry = overflow_[offset];
+    entry.used = true;
+    entry.value.first = key;
+    entry.value.second = std::move(value);
+    ++overflow_size_;
+    return std::make_pair(iterator(this, slots_.size() + offset), true);
+  }
+  // 不存在时返回空的引用
+  SlotRef<T> Ref(uint64_t key) {
+    size_t pos = Locate(key);
+    return pos == End() ? SlotRef<T>() : SlotRef<T>(At(pos));
+  }
+  iterator find(uint64_t key) { return iterator(this, Locate(key)); }
+  const_iterator find(uint64_t key) const {
+    return const_iterator(this, Locate(key));
+  }
+  size_t count(uint64_t key) const { return Locate(key) != End() ? 1 : 0; }
+  // 返回下一个元素
+  iterator erase(iterator index) {
+    size_t pos = index.pos_;
+    assert(pos < End());
+    --size_;
+    Slot &entry = pos < slots_.size() ? slots_[pos]
+                                      : overflow_[pos - slots_.size()];
+    entry.used = false;
+    entry.value.first = 0;
+    entry.value.second = T();
+    if (pos >= slots_.size()) {
+      --overflow_size_;
+      overflow_free_.push_back(static_cast<uint32_t>(pos - slots_.size()));
+    } else {
+      if (++entry.generation == 0) {
+        entry.generation = 1;
+      }
+      if (!external_) {
+        free_slots_.push_back(static_cast<uint32_t>(pos));
+      }
+    }
+    return iterator(this, pos + 1);
+  }
+  size_t erase(uint64_t key) {
+    iterator index = find(key);
+    if (index == end()) {
+      return 0;
+    }
+    erase(index);
+    return 1;
+  }
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, End()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, End()); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // 因为slot被占用放到overflow_中的元素个数
+  size_t OverflowCount() const { return overflow_size_; }
+
+ private:
+  size_t End() const { return slots_.size() + overflow_.size(); }
+  size_t Locate(uint64_t key) const {
+    size_t slot = SlotOf(key);
+    if (slot < slots_.size() && slots_[slot].used &&
+        slots_[slot].value.first == key) {
+      return slot;
+    }
+    for (size_t i = 0; overflow_size_ && i < overflow_.size(); ++i) {
+      if (overflow_[i].used && overflow_[i].value.first == key) {
+        return slots_.size() + i;
+      }
+    }
+    return End();
+  }
+  const Slot &SlotAt(size_t pos) const {
+    return pos < slots_.size() ? slots_[pos] : overflow_[pos - slots_.size()];
+  }
+  size_t Skip(size_t pos) const {
+    while (pos < End() && !SlotAt(pos).used) {
+      ++pos;
+    }
+    return pos < End() ? pos : End();
+  }
+  value_type *At(size_t pos) {
+    return const_cast<value_type *>(&SlotAt(pos).value);
+  }
+  const value_type *At(size_t pos) const { return &SlotAt(pos).value; }
+
+  std::deque<Slot> slots_;
+  std::vector<uint32_t> free_slots_;
+  std::deque<Slot> overflow_;
+  std::vector<uint32_t> overflow_free_;
+  size_t size_;
+  size_t overflow_size_;
+  // 使用Emplace放入对端分配的key, 释放的slot不再分配
+  bool external_;
+};
+
+#endif  // COMMON_SLOT_MAP_H_
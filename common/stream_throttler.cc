@@ -0,0 +1,171 @@
+// Copyright [2021] zhangke
+
+#include "common/stream_throttler.h"
+
+#include <muduo/base/Logging.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+constexpr double StreamThrottler::kPauseShare;
+const size_t StreamThrottler::kResumeBatch;
+
+StreamThrottler::StreamThrottler(muduo::net::EventLoop *loop,
+                                 StreamCb pause_cb, StreamCb resume_cb,
+                                 OutputBytesFn output_bytes)
+    : loop_(loop),
+      pause_cb_(std::move(pause_cb)),
+      resume_cb_(std::move(resume_cb)),
+      output_bytes_(std::move(output_bytes)),
+      congested_(false),
+      hold_(false),
+      high_water_(0),
+      timer_started_(false),
+      pauses_(0),
+      resumes_(0) {}
+
+StreamThrottler::~StreamThrottler() { StopTimer(); }
+
+void StreamThrottler::OnSend(uint64_t conn_id, size_t bytes) {
+  window_[conn_id] += bytes;
+}
+
+void StreamThrottler::Remove(uint64_t conn_id) {
+  window_.erase(conn_id);
+  paused_set_.erase(conn_id);
+}
+
+void StreamThrottler::OnHighWater(size_t high_water) {
+  high_water_ = high_water;
+  congested_ = true;
+  PauseTop("tunnel high water");
+  StartTimer();
+}
+
+void StreamThrottler::OnDrain() {
+  congested_ = false;
+  if (!hold_) {
+    ResumeBatch();
+  }
+  if (paused_set_.empty()) {
+    StopTimer();
+  } else {
+    StartTimer();
+  }
+}
+
+void StreamThrottler::Reset() {
+  StopTimer();
+  window_.clear();
+  paused_.clear();
+  paused_set_.clear();
+  congested_ = false;
+  hold_ = false;
+}
+
+void StreamThrottler::Hold() {
+  hold_ = true;
+  PauseTop("memory pressure");
+  StartTimer();
+}
+
+void StreamThrottler::Release() {
+  if (!hold_) {
+    return;
+  }
+  hold_ = false;
+  StartTimer();
+}
+
+void StreamThrottler::PauseTop(const char *reason) {
+  if (window_.empty()) {
+    return;
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> senders(window_.begin(),
+                                                     window_.end());
+  window_.clear();
+  std::sort(senders.begin(), senders.end(),
+            [](const std::pair<uint64_t, uint64_t> &lhs,
+               const std::pair<uint64_t, uint64_t> &rhs) {
+              return lhs.second > rhs.second;
+            });
+  uint64_t total = 0;
+  for (const auto &sender : senders) {
+    total += sender.second;
+  }
+  uint64_t paused_bytes = 0;
+  size_t count = 0;
+  while (count < senders.size() && paused_bytes < total * kPauseShare) {
+    paused_bytes += senders[count].second;
+    ++count;
+  }
+  // 发送少的先恢复
+  for (size_t index = count; index > 0; --index) {
+    uint64_t conn_id = senders[index - 1].first;
+    if (paused_set_.insert(conn_id).second) {
+      paused_.push_back(conn_id);
+      ++pauses_;
+      pause_cb_(conn_id);
+    }
+  }
+  LOG_INFO << reason << ", output bytes:" << output_bytes_()
+           << ", pause " << count << " of " << senders.size()
+           << " active streams, paused:" << paused_set_.size();
+}
+
+void StreamThrottler::ResumeBatch() {
+  size_t resumed = 0;
+  while (resumed < kResumeBatch && !paused_.empty()) {
+    uint64_t conn_id = paused_.front();
+    paused_.pop_front();
+    if (paused_set_.erase(conn_id)) {
+      ++resumed;
+      ++resumes_;
+      resume_cb_(conn_id);
+    }
+  }
+  if (resumed) {
+    LOG_DEBUG << "resume " << resumed
+              << " streams, still paused:" << paused_set_.size();
+  }
+}
+
+void StreamThrottler::Tick() {
+  size_t output_bytes = output_bytes_();
+  if (congested_) {
+    // 暂停之后输出缓冲仍在增长, 继续暂停剩下发送最多的连接
+    if (output_bytes > high_water_ + high_water_ / 2) {
+      PauseTop("tunnel high water");
+    }
+    return;
+  }
+  if (hold_) {
+    return;
+  }
+  if (paused_set_.empty()) {
+    paused_.clear();
+    StopTimer();
+    return;
+  }
+  // 低于一半高水位时继续恢复, 避免恢复的连接立即再次填满
+  if (high_water_ == 0 || output_bytes < high_water_ / 2) {
+    ResumeBatch();
+  }
+}
+
+void StreamThrottler::StartTimer() {
+  if (timer_started_) {
+    return;
+  }
+  timer_started_ = true;
+  timer_ = loop_->runEvery(0.01, std::bind(&StreamThrottler::Tick, this));
+}
+
+void StreamThrottler::StopTimer() {
+  if (!timer_started_) {
+    return;
+  }
+  timer_started_ = false;
+  loop_->cancel(timer_);
+}
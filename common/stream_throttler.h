@@ -0,0 +1,72 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_STREAM_THROTTLER_H_
+#define COMMON_STREAM_THROTTLER_H_
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TimerId.h>
+
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+// proxy连接超过高水位时只暂停最近发送最多的连接, 写完之后分批恢复
+// 只记录最近发送过数据的连接, 每次操作只涉及这些连接, 所有操作都在loop_中
+class StreamThrottler {
+ public:
+  typedef std::function<void(uint64_t conn_id)> StreamCb;
+  typedef std::function<size_t()> OutputBytesFn;
+  // 暂停的连接占最近发送字节数的比例
+  static constexpr double kPauseShare = 0.8;
+  // 每次恢复的连接数
+  static const size_t kResumeBatch = 8;
+
+  // pause_cb/resume_cb停止/恢复读一个连接
+  // output_bytes返回proxy连接输出缓冲中的字节数
+  StreamThrottler(muduo::net::EventLoop *loop, StreamCb pause_cb,
+                  StreamCb resume_cb, OutputBytesFn output_bytes);
+  ~StreamThrottler();
+  // 连接向proxy连接发送了bytes字节
+  void OnSend(uint64_t conn_id, size_t bytes);
+  // 连接关闭, 不再回调
+  void Remove(uint64_t conn_id);
+  // proxy连接输出缓冲超过high_water
+  void OnHighWater(size_t high_water);
+  // proxy连接输出缓冲写完
+  void OnDrain();
+  // 内存超过预算, 暂停最近发送最多的连接, Release之前不恢复
+  void Hold();
+  void Release();
+  // 清除所有状态, 不回调, 用于会话暂停/恢复时整体停止/恢复读
+  void Reset();
+  bool Paused(uint64_t conn_id) const { return paused_set_.count(conn_id); }
+  size_t PausedCount() const { return paused_set_.size(); }
+  uint64_t Pauses() const { return pauses_; }
+  uint64_t Resumes() const { return resumes_; }
+
+ private:
+  void PauseTop(const char *reason);
+  void ResumeBatch();
+  void Tick();
+  void StartTimer();
+  void StopTimer();
+
+  muduo::net::EventLoop *loop_;
+  StreamCb pause_cb_;
+  StreamCb resume_cb_;
+  OutputBytesFn output_bytes_;
+  // 上次选择之后各连接发送的字节数
+  std::unordered_map<uint64_t, uint64_t> window_;
+  // 按恢复顺序排列, 发送少的在前; 已关闭的连接在恢复时跳过
+  std::deque<uint64_t> paused_;
+  std::unordered_set<uint64_t> paused_set_;
+  bool congested_;
+  bool hold_;
+  size_t high_water_;
+  bool timer_started_;
+  muduo::net::TimerId timer_;
+  uint64_t pauses_;
+  uint64_t resumes_;
+};
+
+#endif  // COMMON_STREAM_THROTTLER_H_
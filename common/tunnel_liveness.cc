@@ -0,0 +1,89 @@
+// Copyright [2021] zhangke
+
+#include "common/tunnel_liveness.h"
+
+#include <muduo/base/Logging.h>
+#include <muduo/base/Timestamp.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+int64_t NowUs() { return muduo::Timestamp::now().microSecondsSinceEpoch(); }
+
+}  // namespace
+
+TunnelLiveness::TunnelLiveness(muduo::net::EventLoop *loop,
+                               const MessageDispatch *dispatcher,
+                               double idle_interval, double min_timeout,
+                               double max_timeout)
+    : loop_(loop),
+      dispatcher_(dispatcher),
+      idle_us_(static_cast<int64_t>(idle_interval * 1e6)),
+      min_timeout_us_(static_cast<int64_t>(min_timeout * 1e6)),
+      max_timeout_us_(static_cast<int64_t>(max_timeout * 1e6)),
+      started_(false),
+      start_us_(0),
+      last_ping_us_(0),
+      waiting_since_us_(0),
+      pings_(0),
+      deaths_(0) {}
+
+TunnelLiveness::~TunnelLiveness() { Stop(); }
+
+void TunnelLiveness::Start(Callback ping_cb, Callback dead_cb) {
+  loop_->assertInLoopThread();
+  Stop();
+  started_ = true;
+  ping_cb_ = std::move(ping_cb);
+  dead_cb_ = std::move(dead_cb);
+  start_us_ = NowUs();
+  last_ping_us_ = 0;
+  waiting_since_us_ = 0;
+  check_timer_ = loop_->runEvery(0.1, std::bind(&TunnelLiveness::Check, this));
+}
+
+void TunnelLiveness::Stop() {
+  if (!started_) {
+    return;
+  }
+  started_ = false;
+  loop_->cancel(check_timer_);
+}
+
+int64_t TunnelLiveness::DeadlineUs() const {
+  const RttEstimator &rtt = dispatcher_->Stats().rtt;
+  if (!rtt.HasSample()) {
+    return max_timeout_us_;
+  }
+  return std::min(max_timeout_us_,
+                  std::max(min_timeout_us_, kRtoMultiplier * rtt.RtoUs()));
+}
+
+void TunnelLiveness::Check() {
+  int64_t now_us = NowUs();
+  // 重新开始检测之前收到的帧不算
+  int64_t last_receive_us = std::max(dispatcher_->LastReceiveUs(), start_us_);
+  if (waiting_since_us_ && last_receive_us >= waiting_since_us_) {
+    waiting_since_us_ = 0;
+  }
+  if (now_us - last_receive_us >= idle_us_ &&
+      now_us - last_ping_us_ >= idle_us_) {
+    last_ping_us_ = now_us;
+    ++pings_;
+    ping_cb_();
+  }
+  if (!waiting_since_us_ && dispatcher_->InflightRequests() > 0) {
+    waiting_since_us_ = now_us;
+  }
+  if (waiting_since_us_ && now_us - waiting_since_us_ > DeadlineUs()) {
+    LOG_WARN << "no frame from peer in " << (now_us - last_receive_us) / 1000
+             << "ms, deadline:" << DeadlineUs() / 1000 << "ms, srtt(us):"
+             << dispatcher_->Stats().rtt.SrttUs() << ", tunnel dead";
+    ++deaths_;
+    Stop();
+    Callback dead_cb = dead_cb_;
+    dead_cb();
+  }
+}
@@ -0,0 +1,53 @@
+// Copyright [2021] zhangke
+#ifndef COMMON_TUNNEL_LIVENESS_H_
+#define COMMON_TUNNEL_LIVENESS_H_
+
+#include <muduo/net/EventLoop.h>
+#include <muduo/net/TimerId.h>
+
+#include <functional>
+
+#include "common/message_dispatch.h"
+
+// 根据dispatcher收到的帧和RTT判断proxy连接是否存活, 在loop_中使用
+// 收到任何帧都说明对端存活, 只有空闲超过idle_interval才发送ping
+// 有未响应的请求并且超过deadline没有收到任何帧时判定连接断开
+// deadline为kRtoMultiplier倍RTO, 限制在[min_timeout, max_timeout],
+// 还没有RTT样本时为max_timeout
+class TunnelLiveness {
+ public:
+  typedef std::function<void()> Callback;
+  static const int kRtoMultiplier = 4;
+
+  TunnelLiveness(muduo::net::EventLoop *loop,
+                 const MessageDispatch *dispatcher, double idle_interval = 10,
+                 double min_timeout = 3, double max_timeout = 30);
+  ~TunnelLiveness();
+  // ping_cb发送一次心跳, dead_cb在判定断开时调用一次, 之后自动停止
+  void Start(Callback ping_cb, Callback dead_cb);
+  void Stop();
+  int64_t DeadlineUs() const;
+  uint64_t Pings() const { return pings_; }
+  uint64_t Deaths() const { return deaths_; }
+
+ private:
+  void Check();
+
+  muduo::net::EventLoop *loop_;
+  const MessageDispatch *dispatcher_;
+  int64_t idle_us_;
+  int64_t min_timeout_us_;
+  int64_t max_timeout_us_;
+  bool started_;
+  muduo::net::TimerId check_timer_;
+  Callback ping_cb_;
+  Callback dead_cb_;
+  int64_t start_us_;
+  int64_t last_ping_us_;
+  // 开始等待对端的时间, 收到帧后清零
+  int64_t waiting_since_us_;
+  uint64_t pings_;
+  uint64_t deaths_;
+};
+
+#endif  // COMMON_TUNNEL_LIVENESS_H_
@@ -9,22 +9,38 @@
 #include <string>
 #include <utility>
 
+#include "common/alloc_stats.h"
+#include "common/log_util.h"
+#include "common/loop_monitor.h"
 #include "common/message_util.h"
 #include "common/proto.h"
 
 ProxyInstance::ProxyInstance(muduo::net::EventLoop *loop,
-                             const muduo::net::TcpConnectionPtr &conn)
+                             const muduo::net::TcpConnectionPtr &conn,
+                             double session_grace)
     : loop_(loop),
       dispatcher_(new MessageDispatch(loop_)),
       proxy_conn_(conn),
-      conn_id_(0),
       source_entity_(0),
-      proxy_client_connect_(true) {}
+      proxy_client_connect_(true),
+      session_grace_(session_grace),
+      session_key_(0),
+      detached_(false),
+      trace_stats_("server", {"accept", "register", "tunnel_ack",
+                              "first_request", "first_response"}) {}
 
 ProxyInstance::~ProxyInstance() {}
 
 void ProxyInstance::Init() {
   dispatcher_->Init();
+  dispatcher_->SetMemoryAccount(&memory_);
+  throttler_.reset(new StreamThrottler(
+      loop_,
+      std::bind(&ProxyInstance::StopClientRead, this, std::placeholders::_1,
+                false),
+      std::bind(&ProxyInstance::ResumeClientRead, this, std::placeholders::_1,
+                false),
+      std::bind(&ProxyInstance::TunnelOutputBytes, this)));
   dispatcher_->RegisterPbHandle(
       proto::LISTEN_REQUEST,
       std::bind(&ProxyInstance::HandleListenRequest, this,
@@ -52,16 +68,52 @@ void ProxyInstance::Init() {
   dispatcher_->RegisterMsgHandle(
       DATA_REQUEST, std::bind(&ProxyInstance::HandleDataRequest, this,
                               std::placeholders::_1, std::placeholders::_2));
-  proxy_conn_->setHighWaterMarkCallback(
-      std::bind(&ProxyInstance::OnHighWaterMark, this, true,
-                std::placeholders::_1, std::placeholders::_2),
-      10 * MB_SIZE);
+  bdp_tuner_.reset(new BdpTuner(loop_, dispatcher_.get()));
+  StartBdpTuner();
   // 启动定时器,10s之内没有链接就断开
   check_listen_timer_ =
       loop_->runAfter(10.0, std::bind(&ProxyInstance::CheckListen, this));
-  // 启动心跳定时器
-  heartbeat_timer_ =
-      loop_->runEvery(10.0, std::bind(&ProxyInstance::SendHeartBeat, this));
+  liveness_.reset(new TunnelLiveness(loop_, dispatcher_.get()));
+  StartLiveness();
+  memory_timer_ =
+      loop_->runEvery(0.1, std::bind(&ProxyInstance::CheckMemory, this));
+  sweep_timer_ = loop_->runEvery(
+      BufferSweeper::kInterval, std::bind(&ProxyInstance::SweepBuffers, this));
+}
+
+void ProxyInstance::StartLiveness() {
+  liveness_->Start(std::bind(&ProxyInstance::SendHeartBeat, this), [this] {
+    LOG_WARN << "proxy connection dead, peer_address:"
+             << proxy_conn_->peerAddress().toIpPort();
+    proxy_conn_->forceClose();
+  });
+}
+
+void ProxyInstance::StartBdpTuner() {
+  proxy_conn_->setHighWaterMarkCallback(
+      std::bind(&ProxyInstance::OnHighWaterMark, this, true,
+                std::placeholders::_1, std::placeholders::_2, ConnectionRef()),
+      bdp_tuner_->Current().tunnel_high_water);
+  bdp_tuner_->Start(proxy_conn_, ConnectionFd(proxy_conn_),
+                    std::bind(&ProxyInstance::ApplyBdpSettings, this,
+                              std::placeholders::_1));
+}
+
+void ProxyInstance::ApplyBdpSettings(const BdpSettings &settings) {
+  proxy_conn_->setHighWaterMarkCallback(
+      std::bind(&ProxyInstance::OnHighWaterMark, this, true,
+                std::placeholders::_1, std::placeholders::_2, ConnectionRef()),
+      settings.tunnel_high_water);
+  // 客户端连接在io线程中, 高水位只能在它自己的loop中修改
+  for (auto &item : conn_map_) {
+    const muduo::net::TcpConnectionPtr &conn = item.second.conn;
+    muduo::net::HighWaterMarkCallback callback = std::bind(
+        &ProxyInstance::OnHighWaterMark, this, false, std::placeholders::_1,
+        std::placeholders::_2, ConnectionRef(&item));
+    conn->getLoop()->runInLoop(
+        std::bind(&muduo::net::TcpConnection::setHighWaterMarkCallback, conn,
+                  callback, settings.stream_high_water));
+  }
 }
 
 void ProxyInstance::Stop(StopCb cb) {
@@ -69,9 +121,15 @@ void ProxyInstance::Stop(StopCb cb) {
   // 等到所有连接都close
   stop_cb_ = cb;
   proxy_client_connect_ = false;
-  // 停止心跳定时器
+  // 停止心跳
   loop_->cancel(check_listen_timer_);
-  loop_->cancel(heartbeat_timer_);
+  loop_->cancel(memory_timer_);
+  loop_->cancel(sweep_timer_);
+  liveness_.reset();
+  bdp_tuner_.reset();
+  throttler_->Reset();
+  loop_->cancel(grace_timer_);
+  detached_ = false;
   acceptor_.reset();
   dispatcher_.reset();  // TODO(ke.zhang) 这里是否有内存问题?
   for (auto &conn : conn_map_) {
@@ -80,12 +138,86 @@ void ProxyInstance::Stop(StopCb cb) {
   CheckStop();
 }
 
+bool ProxyInstance::Detach(StopCb expire_cb) {
+  if (!session_key_ || !acceptor_ || !proxy_client_connect_ ||
+      session_grace_ <= 0) {
+    return false;
+  }
+  if (dispatcher_->PendingBytes() > MAX_REPLAY_SIZE) {
+    LOG_WARN << "session:" << session_key_
+             << " pending bytes:" << dispatcher_->PendingBytes()
+             << " too large, not keep session";
+    return false;
+  }
+  LOG_INFO << "proxy connection lost, keep session:" << session_key_
+           << " for " << session_grace_ << "s, conn count:" << conn_map_.size();
+  detached_ = true;
+  liveness_->Stop();
+  bdp_tuner_->Stop();
+  // 未收到响应的请求等待重连后重发, 期间停止读取客户端数据
+  dispatcher_->Suspend();
+  throttler_->Reset();
+  StopClientRead();
+  grace_timer_ = loop_->runAfter(session_grace_, [=] {
+    LOG_WARN << "session:" << session_key_ << " not resumed, expire";
+    expire_cb();
+  });
+  return true;
+}
+
+void ProxyInstance::Resume(const muduo::net::TcpConnectionPtr &conn,
+                           ProxyMessagePtr request_head, MessagePtr message) {
+  assert(Resumable());
+  LOG_INFO << "resume session:" << session_key_
+           << " proxy client:" << conn->peerAddress().toIpPort()
+           << " conn count:" << conn_map_.size();
+  loop_->cancel(grace_timer_);
+  detached_ = false;
+  proxy_conn_ = conn;
+  StartBdpTuner();
+  StartLiveness();
+  MessagePtr response = std::make_shared<proto::Message>();
+  MakeResponse(message.get(), proto::LISTEN_RESPONSE, response.get());
+  proto::ListenResponse *response_body =
+      response->mutable_body()->mutable_listen_response();
+  response_body->mutable_rc()->set_retcode(LISTEN_SUCCESS);
+  response_body->mutable_rc()->set_error_message("resumed");
+  response_body->set_session_key(session_key_);
+  dispatcher_->SendPbResponse(proxy_conn_, request_head, response);
+  dispatcher_->Resume(proxy_conn_);
+  ResumeClientRead();
+}
+
+void ProxyInstance::ResumeFailed(ProxyMessagePtr request_head,
+                                 MessagePtr message) {
+  MessagePtr response = std::make_shared<proto::Message>();
+  MakeResponse(message.get(), proto::LISTEN_RESPONSE, response.get());
+  proto::ListenResponse *response_body =
+      response->mutable_body()->mutable_listen_response();
+  response_body->mutable_rc()->set_retcode(LISTEN_SESSION_NOT_FOUND);
+  response_body->mutable_rc()->set_error_message("session not found");
+  dispatcher_->SendPbResponse(proxy_conn_, request_head, response);
+}
+
 void ProxyInstance::HandleListenRequest(const muduo::net::TcpConnectionPtr,
                                         ProxyMessagePtr request_head,
                                         MessagePtr message) {
+  PROXY_LOOP_CALLBACK("ProxyInstance::HandleListenRequest");
   // 判断auth
   assert(message->head().message_type() == proto::LISTEN_REQUEST);
   assert(message->body().has_listen_request());
+  uint64_t session_key = message->head().session_key();
+  if (session_key) {
+    // 恢复会话, 由ProxyServer找到断开的实例
+    LOG_INFO << "resume session:" << session_key
+             << " request from:" << proxy_conn_->peerAddress().toIpPort();
+    if (resume_cb_ && !acceptor_) {
+      resume_cb_(session_key, proxy_conn_, request_head, message);
+    } else {
+      ResumeFailed(request_head, message);
+    }
+    return;
+  }
   listen_response_msg_ = std::make_shared<proto::Message>();
   MakeResponse(message.get(), proto::LISTEN_RESPONSE,
                listen_response_msg_.get());
@@ -93,7 +225,7 @@ void ProxyInstance::HandleListenRequest(const muduo::net::TcpConnectionPtr,
       listen_response_msg_->mutable_body()->mutable_listen_response();
   if (acceptor_) {
     // 已经有监听
-    response_body->mutable_rc()->set_retcode(-1);
+    response_body->mutable_rc()->set_retcode(LISTEN_FAILED);
     response_body->mutable_rc()->set_error_message("already listen");
     dispatcher_->SendPbResponse(proxy_conn_, request_head,
                                 listen_response_msg_);
@@ -106,13 +238,17 @@ void ProxyInstance::HandleListenRequest(const muduo::net::TcpConnectionPtr,
   // listen_addr_ = muduo::net::InetAddress("0.0.0.0", listen_port);
   auto listen_result = StartListen();
   if (listen_result.first) {
-    response_body->mutable_rc()->set_retcode(0);
+    response_body->mutable_rc()->set_retcode(LISTEN_SUCCESS);
     response_body->mutable_rc()->set_error_message("success");
+    if (session_grace_ > 0) {
+      session_key_ = GenSessionKey();
+      response_body->set_session_key(session_key_);
+    }
   } else {
     LOG_ERROR << "listen failed, port:" << listen_port
               << " error:" << listen_result.second;
     acceptor_.reset();
-    response_body->mutable_rc()->set_retcode(-1);
+    response_body->mutable_rc()->set_retcode(LISTEN_FAILED);
     response_body->mutable_rc()->set_error_message(listen_result.second);
   }
   dispatcher_->SendPbResponse(proxy_conn_, request_head, listen_response_msg_);
@@ -145,29 +281,37 @@ void ProxyInstance::OnNewConnection(int sockfd,
   muduo::net::InetAddress local_addr(muduo::net::sockets::getLocalAddr(sockfd));
   muduo::net::TcpConnectionPtr conn(std::make_shared<muduo::net::TcpConnection>(
       io_loop, conn_name, sockfd, local_addr, peer_addr));
+  // 先分配conn_id, 回调中通过stream直接访问连接状态
+  uint64_t conn_id = conn_map_.Insert(Connection(conn));
+  ConnectionRef stream = conn_map_.Ref(conn_id);
+  stream.get()->trace.Mark(SERVER_TRACE_ACCEPT);
+  ++stats_.accepted;
   conn->setConnectionCallback(std::bind(&ProxyInstance::OnClientConnection,
-                                        this, std::placeholders::_1));
-  conn->setCloseCallback(
-      std::bind(&ProxyInstance::OnClientClose, this, std::placeholders::_1));
+                                        this, std::placeholders::_1, stream));
+  conn->setCloseCallback(std::bind(&ProxyInstance::OnClientClose, this,
+                                   std::placeholders::_1, stream));
   conn->setMessageCallback(
       std::bind(&ProxyInstance::OnClientMessage, this, std::placeholders::_1,
-                std::placeholders::_2, std::placeholders::_3));
+                std::placeholders::_2, std::placeholders::_3, stream));
   conn->setHighWaterMarkCallback(
       std::bind(&ProxyInstance::OnHighWaterMark, this, false,
-                std::placeholders::_1, std::placeholders::_2),
-      2 * MB_SIZE);
+                std::placeholders::_1, std::placeholders::_2, stream),
+      bdp_tuner_->Current().stream_high_water);
   io_loop->runInLoop(
       std::bind(&muduo::net::TcpConnection::connectEstablished, conn));
 }
 
-void ProxyInstance::OnClientConnection(
-    const muduo::net::TcpConnectionPtr &conn) {
+void ProxyInstance::OnClientConnection(const muduo::net::TcpConnectionPtr &conn,
+                                       ConnectionRef stream) {
+  // 连接状态只能在conn自己的loop中读取
+  bool connected = conn->connected();
   loop_->runInLoop([=] {
-    if (conn->getContext().empty()) {
+    PROXY_LOOP_CALLBACK("ProxyInstance::OnClientConnection");
+    Connection *connection = stream.get();
+    if (connected && connection) {
       // 连接建立调用
-      uint64_t conn_id = GetConnId();
-      conn->setContext(conn_id);
-      conn_map_.insert(std::make_pair(conn_id, Connection(conn)));
+      uint64_t conn_id = stream.key();
+      connection->trace.Mark(SERVER_TRACE_REGISTER);
       if (!proxy_client_connect_) {
         LOG_WARN << "proxy disconnect, OnclientConnection, give up";
         conn->forceClose();
@@ -200,8 +344,9 @@ void ProxyInstance::OnClientConnection(
       dispatcher_->SendPbRequest(
           proxy_conn_, message,
           std::bind(&ProxyInstance::EntryAddConnection, this_ptr(),
-                    std::placeholders::_1, conn),
-          std::bind(&ProxyInstance::AddConnectionTimeout, this_ptr(), conn));
+                    std::placeholders::_1, conn, stream),
+          std::bind(&ProxyInstance::AddConnectionTimeout, this_ptr(), conn,
+                    stream));
     } else {
       // client shutdown write(recv fin)
       // 主动destroy连接
@@ -211,48 +356,78 @@ void ProxyInstance::OnClientConnection(
 
 void ProxyInstance::OnClientMessage(const muduo::net::TcpConnectionPtr &conn,
                                     muduo::net::Buffer *buffer,
-                                    muduo::Timestamp) {
+                                    muduo::Timestamp, ConnectionRef stream) {
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_SERVER);
   loop_->runInLoop([=] {
+    PROXY_LOOP_CALLBACK("ProxyInstance::OnClientMessage");
+    PROXY_ALLOC_SCOPE(ALLOC_TAG_SERVER);
     if (!proxy_client_connect_) {
       LOG_WARN << "proxy disconnect, OnClientMessage, give up";
       return;
     }
-    uint64_t conn_id = boost::any_cast<uint64_t>(conn->getContext());
-    assert(conn_id);
-    assert(conn_map_.count(conn_id));
-    Connection &client_conn = conn_map_[conn_id];
+    uint64_t conn_id = stream.key();
+    if (!stream.get()) {
+      LOG_WARN << "conn_id:" << conn_id << " already removed";
+      return;
+    }
+    Connection &client_conn = *stream.get();
     if (client_conn.proxy_accept) {
-      DataRequestBody data_request;
-      data_request.length = buffer->readableBytes();
-      data_request.conn_key = conn_id;
-      data_request.data = std::string(buffer->peek(), buffer->readableBytes());
-      buffer->retrieve(buffer->readableBytes());
-      ProxyMessage request_head;
-      request_head.message_type = DATA_REQUEST;
-      request_head.length = data_request.Size();
-      request_head.body = &data_request;
-      dispatcher_->SendRequest(
-          proxy_conn_, &request_head,
-          std::bind(&ProxyInstance::EntryData, this_ptr(),
-                    std::placeholders::_1, std::placeholders::_2, conn),
-          nullptr);
-      request_head.body = nullptr;
-    } else {
+      std::string data(buffer->peek(), buffer->readableBytes());
+      buffer->retrieveAll();
+      ForwardClientData(conn, stream, std::move(data));
+    } else if (!client_conn.pending_full) {
       LOG_DEBUG << "new data before proxy client accept connection, conn_id:"
                 << conn_id;
-      client_conn.pending_message.push_back(
-          std::string(buffer->peek(), buffer->readableBytes()));
-      buffer->retrieveAll();
+      // 放不下的数据留在输入缓冲中, 接受连接后一起发出
+      size_t appended = client_conn.pending_message.Append(
+          buffer->peek(), buffer->readableBytes());
+      buffer->retrieve(appended);
+      memory_.Charge(MEMORY_PENDING_STREAM, appended);
+      if (client_conn.pending_message.Full()) {
+        LOG_INFO << "pending buffer full, stop read conn_id:" << conn_id;
+        client_conn.pending_full = true;
+        conn->stopRead();
+      }
     }
   });
 }
 
-void ProxyInstance::OnClientClose(const muduo::net::TcpConnectionPtr &conn) {
+void ProxyInstance::ForwardClientData(const muduo::net::TcpConnectionPtr &conn,
+                                      ConnectionRef stream,
+                                      std::string data) {
+  uint64_t conn_id = stream.key();
+  Connection *client_conn = stream.get();
+  stats_.client_bytes_in += data.size();
+  throttler_->OnSend(conn_id, data.size());
+  client_conn->trace.Mark(SERVER_TRACE_FIRST_REQUEST);
+  DataRequestBody data_request;
+  data_request.length = data.size();
+  data_request.conn_key = conn_id;
+  data_request.payload = Slice(std::move(data));
+  ProxyMessage request_head;
+  request_head.message_type = DATA_REQUEST;
+  request_head.length = data_request.Size();
+  request_head.body = &data_request;
+  dispatcher_->SendRequest(
+      proxy_conn_, &request_head,
+      std::bind(&ProxyInstance::EntryData, this_ptr(), std::placeholders::_1,
+                std::placeholders::_2, conn, stream),
+      nullptr);
+  request_head.body = nullptr;
+}
+
+void ProxyInstance::OnClientClose(const muduo::net::TcpConnectionPtr &conn,
+                                  ConnectionRef stream) {
   // 更新状态
   loop_->runInLoop([=] {
-    uint64_t conn_id = boost::any_cast<uint64_t>(conn->getContext());
-    assert(conn_id);
-    assert(conn_map_.count(conn_id));
+    PROXY_LOOP_CALLBACK("ProxyInstance::OnClientClose");
+    uint64_t conn_id = stream.key();
+    if (!stream.get()) {
+      // 转发失败时已经删除
+      LOG_DEBUG << "client conn close, conn_id:" << conn_id
+                << " already removed";
+      return;
+    }
     LOG_INFO << "client conn close, conn_id:" << conn_id
              << " peer_address:" << conn->peerAddress().toIpPort();
     if (!proxy_client_connect_) {
@@ -289,23 +464,38 @@ void ProxyInstance::EntryCloseConnection(MessagePtr message, uint64_t conn_id) {
 }
 
 void ProxyInstance::EntryAddConnection(
-    MessagePtr message, const muduo::net::TcpConnectionPtr &client_conn) {
+    MessagePtr message, const muduo::net::TcpConnectionPtr &client_conn,
+    ConnectionRef stream) {
   assert(message->head().message_type() == proto::NEW_CONNECTION_RESPONSE);
   assert(message->body().has_new_connection_response());
   const proto::NewConnectionResponse &response =
       message->body().new_connection_response();
-  uint64_t conn_id = boost::any_cast<uint64_t>(client_conn->getContext());
+  uint64_t conn_id = stream.key();
   // conn_map_[conn_id] = client_conn;
+  if (!stream.get()) {
+    LOG_WARN << "conn_id:" << conn_id << " already removed";
+    return;
+  }
   if (response.rc().retcode() == 0) {
-    Connection &conn = conn_map_[conn_id];
+    Connection &conn = *stream.get();
     conn.proxy_accept = true;
-    if (!conn.pending_message.empty()) {
-      muduo::net::Buffer buffer;
-      for (const std::string &msg : conn.pending_message) {
-        buffer.append(msg.c_str(), msg.length());
-      }
-      OnClientMessage(client_conn, &buffer, muduo::Timestamp::now());
-      conn.pending_message.clear();
+    conn.trace.Mark(SERVER_TRACE_TUNNEL_ACK);
+    // 缓存的数据和满了之后留在输入缓冲中的数据合并成一个请求发出
+    muduo::net::Buffer *input = client_conn->inputBuffer();
+    if (!conn.pending_message.Empty() || input->readableBytes()) {
+      std::string data;
+      data.reserve(conn.pending_message.Size() + input->readableBytes());
+      conn.pending_message.AppendTo(&data);
+      data.append(input->peek(), input->readableBytes());
+      input->retrieveAll();
+      memory_.Charge(MEMORY_PENDING_STREAM,
+                     -static_cast<int64_t>(conn.pending_message.Size()));
+      conn.pending_message.Clear();
+      ForwardClientData(client_conn, stream, std::move(data));
+    }
+    if (conn.pending_full) {
+      conn.pending_full = false;
+      client_conn->startRead();
     }
   } else {
     LOG_ERROR << "proxy client accept connection fail";
@@ -315,43 +505,62 @@ void ProxyInstance::EntryAddConnection(
 }
 
 void ProxyInstance::AddConnectionTimeout(
-    const muduo::net::TcpConnectionPtr &client_conn) {
+    const muduo::net::TcpConnectionPtr &, ConnectionRef stream) {
   LOG_ERROR << "proxy client accept connection timeout";
   // 强制关闭客户端连接
-  uint64_t conn_id = boost::any_cast<uint64_t>(client_conn->getContext());
-  RemoveConnecion(conn_id);
+  RemoveConnecion(stream.key());
 }
 
 void ProxyInstance::EntryData(const muduo::net::TcpConnectionPtr &conn,
                               ProxyMessagePtr response,
-                              const muduo::net::TcpConnectionPtr &client_conn) {
+                              const muduo::net::TcpConnectionPtr &client_conn,
+                              ConnectionRef stream) {
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_SERVER);
   assert(response->message_type == DATA_RESPONSE);
-  uint64_t conn_id = boost::any_cast<uint64_t>(client_conn->getContext());
+  uint64_t conn_id = stream.key();
   DataResponseBody *response_body =
       dynamic_cast<DataResponseBody *>(response->body);
   if (response_body->retcode == 0) {
-    LOG_TRACE << "conn:" << conn_id << " recv data succ";
+    PROXY_LOG_TRACE << "conn:" << conn_id << " recv data succ";
   } else {
-    conn_map_.erase(conn_id);
+    if (stream.get()) {
+      ReleaseMemory(conn_id, *stream.get());
+      conn_map_.erase(conn_id);
+    }
+    throttler_->Remove(conn_id);
     client_conn->forceClose();
     LOG_WARN << "conn:" << conn_id << " force close";
   }
 }
 
-uint64_t ProxyInstance::GetConnId() { return ++conn_id_; }
+size_t ProxyInstance::TunnelOutputBytes() const {
+  if (!proxy_conn_ || !proxy_conn_->connected()) {
+    return 0;
+  }
+  return proxy_conn_->outputBuffer()->readableBytes();
+}
 
 uint32_t ProxyInstance::GetSourceEntity() { return ++source_entity_; }
 
 void ProxyInstance::HandleDataRequest(const muduo::net::TcpConnectionPtr,
                                       ProxyMessagePtr message) {
+  PROXY_LOOP_CALLBACK("ProxyInstance::HandleDataRequest");
+  PROXY_ALLOC_SCOPE(ALLOC_TAG_SERVER);
   // 判断auth
   assert(message->message_type == DATA_REQUEST);
   DataRequestBody *request = dynamic_cast<DataRequestBody *>(message->body);
   uint64_t conn_key = request->conn_key;
   DataResponseBody response_body;
-  if (conn_map_.find(conn_key) != conn_map_.end()) {
-    (conn_map_[conn_key])
-        .conn->send((request->data).c_str(), (request->data).size());
+  auto index = conn_map_.find(conn_key);
+  if (index != conn_map_.end()) {
+    Connection &client_conn = index->second;
+    client_conn.conn->send((request->data).c_str(), (request->data).size());
+    stats_.client_bytes_out += request->data.size();
+    SampleOutput(conn_key, &client_conn);
+    if (!client_conn.trace.finished) {
+      client_conn.trace.Mark(SERVER_TRACE_FIRST_RESPONSE);
+      trace_stats_.Finish(conn_key, &client_conn.trace);
+    }
     response_body.retcode = 0;
   } else {
     response_body.retcode = -1;
@@ -394,6 +603,9 @@ void ProxyInstance::RemoveConnecion(uint64_t conn_id) {
   if (index == conn_map_.end()) {
     return;
   }
+  trace_stats_.Finish(conn_id, &index->second.trace);
+  throttler_->Remove(conn_id);
+  ReleaseMemory(conn_id, index->second);
   index->second.conn->getLoop()->queueInLoop(std::bind(
       &muduo::net::TcpConnection::connectDestroyed, index->second.conn));
   conn_map_.erase(index);
@@ -435,6 +647,7 @@ void ProxyInstance::HandleResumeSendRequest(const muduo::net::TcpConnectionPtr,
 }
 
 void ProxyInstance::StopClientRead(uint64_t conn_id, bool server_block) {
+  PROXY_LOOP_CALLBACK("ProxyInstance::StopClientRead");
   if (conn_id) {
     auto index = conn_map_.find(conn_id);
     if (index == conn_map_.end()) {
@@ -442,8 +655,12 @@ void ProxyInstance::StopClientRead(uint64_t conn_id, bool server_block) {
                << " read failed, not found connection";
     } else {
       (index->second).conn->stopRead();
-      (index->second).server_block = server_block;
-      LOG_INFO << "stop conn_id:" << conn_id << " read succ";
+      ++stats_.pauses;
+      // 不覆盖proxy client设置的block状态
+      if (server_block) {
+        (index->second).server_block = true;
+      }
+      LOG_DEBUG << "stop conn_id:" << conn_id << " read succ";
     }
     return;
   } else {
@@ -455,6 +672,7 @@ void ProxyInstance::StopClientRead(uint64_t conn_id, bool server_block) {
 }
 
 void ProxyInstance::ResumeClientRead(uint64_t conn_id, bool server_block) {
+  PROXY_LOOP_CALLBACK("ProxyInstance::ResumeClientRead");
   if (conn_id) {
     auto index = conn_map_.find(conn_id);
     if (index == conn_map_.end()) {
@@ -462,11 +680,16 @@ void ProxyInstance::ResumeClientRead(uint64_t conn_id, bool server_block) {
                << " read failed, not found connection";
     } else {
       if ((index->second).server_block && !server_block) {
-        LOG_INFO << "not resume conn_id:" << conn_id << " read, server block";
+        LOG_DEBUG << "not resume conn_id:" << conn_id << " read, server block";
+      } else if (server_block && throttler_->Paused(conn_id)) {
+        // proxy连接拥塞暂停的连接由throttler_恢复
+        (index->second).server_block = false;
+        LOG_DEBUG << "not resume conn_id:" << conn_id << " read, throttled";
       } else {
         (index->second).conn->startRead();
+        ++stats_.resumes;
         (index->second).server_block = false;
-        LOG_INFO << "resume conn_id:" << conn_id << " read succ";
+        LOG_DEBUG << "resume conn_id:" << conn_id << " read succ";
       }
     }
     return;
@@ -480,17 +703,18 @@ void ProxyInstance::ResumeClientRead(uint64_t conn_id, bool server_block) {
 
 void ProxyInstance::OnHighWaterMark(bool is_proxy_conn,
                                     const muduo::net::TcpConnectionPtr &conn,
-                                    size_t) {
+                                    size_t, ConnectionRef stream) {
   if (is_proxy_conn) {
     LOG_INFO << "proxy connection high water";
     if (proxy_conn_->outputBuffer()->readableBytes() > 0) {
-      StopClientRead();
-      proxy_conn_->setWriteCompleteCallback(std::bind(
-          &ProxyInstance::OnWriteComplete, this, true, std::placeholders::_1));
+      throttler_->OnHighWater(bdp_tuner_->Current().tunnel_high_water);
+      proxy_conn_->setWriteCompleteCallback(
+          std::bind(&ProxyInstance::OnWriteComplete, this, true,
+                    std::placeholders::_1, ConnectionRef()));
     }
   } else {
     // 客户端接收速度慢,通知proxy client
-    uint64_t conn_id = boost::any_cast<uint64_t>(conn->getContext());
+    uint64_t conn_id = stream.key();
     LOG_INFO << "client conn_id:" << conn_id << " high water";
     MessagePtr message = std::make_shared<proto::Message>();
     MakeMessage(message.get(), proto::PAUSE_SEND_REQUEST, GetSourceEntity());
@@ -502,20 +726,22 @@ void ProxyInstance::OnHighWaterMark(bool is_proxy_conn,
         std::bind(&ProxyInstance::EntryPauseSend, this_ptr(),
                   std::placeholders::_1, conn_id),
         nullptr);
-    conn->setWriteCompleteCallback(std::bind(
-        &ProxyInstance::OnWriteComplete, this, false, std::placeholders::_1));
+    conn->setWriteCompleteCallback(
+        std::bind(&ProxyInstance::OnWriteComplete, this, false,
+                  std::placeholders::_1, stream));
   }
 }
 
 void ProxyInstance::OnWriteComplete(bool is_proxy_conn,
-                                    const muduo::net::TcpConnectionPtr &conn) {
+                                    const muduo::net::TcpConnectionPtr &conn,
+                                    ConnectionRef stream) {
   if (is_proxy_conn) {
     LOG_INFO << "proxy connection write complete";
-    ResumeClientRead();
+    throttler_->OnDrain();
     proxy_conn_->setWriteCompleteCallback(muduo::net::WriteCompleteCallback());
   } else {
     // 通知proxy client可以继续发送
-    uint64_t conn_id = boost::any_cast<uint64_t>(conn->getContext());
+    uint64_t conn_id = stream.key();
     LOG_INFO << "client conn_id:" << conn_id << " write complete";
     MessagePtr message = std::make_shared<proto::Message>();
     MakeMessage(message.get(), proto::RESUME_SEND_REQUEST, GetSourceEntity());
@@ -531,6 +757,71 @@ void ProxyInstance::OnWriteComplete(bool is_proxy_conn,
   }
 }
 
+void ProxyInstance::CheckMemory() {
+  PROXY_LOOP_CALLBACK("ProxyInstance::CheckMemory");
+  memory_.Set(MEMORY_TUNNEL_OUTPUT, TunnelOutputBytes());
+  for (auto index = buffered_conns_.begin();
+       index != buffered_conns_.end();) {
+    uint64_t conn_id = *index++;
+    auto conn = conn_map_.find(conn_id);
+    if (conn != conn_map_.end()) {
+      SampleOutput(conn_id, &conn->second);
+    }
+  }
+  const MemoryBudget &budget = MemoryBudget::Global();
+  if (budget.Pressure()) {
+    LOG_WARN << "memory used:" << budget.Used() << " limit:" << budget.Limit()
+             << ", instance used:" << memory_.Total();
+    throttler_->Hold();
+  } else if (budget.Relieved()) {
+    throttler_->Release();
+  }
+}
+
+void ProxyInstance::SampleOutput(uint64_t conn_id, Connection *conn) {
+  // 客户端连接不在loop_中时读不到输出缓冲, 由stream high water限制
+  if (conn->conn->getLoop() != loop_) {
+    return;
+  }
+  size_t output_bytes = conn->conn->outputBuffer()->readableBytes();
+  memory_.Charge(MEMORY_STREAM_OUTPUT,
+                 static_cast<int64_t>(output_bytes) -
+                     static_cast<int64_t>(conn->output_bytes));
+  conn->output_bytes = output_bytes;
+  if (output_bytes) {
+    buffered_conns_.insert(conn_id);
+  } else {
+    buffered_conns_.erase(conn_id);
+  }
+}
+
+void ProxyInstance::ReleaseMemory(uint64_t conn_id, const Connection &conn) {
+  memory_.Charge(MEMORY_PENDING_STREAM,
+                 -static_cast<int64_t>(conn.pending_message.Size()));
+  memory_.Charge(MEMORY_STREAM_OUTPUT,
+                 -static_cast<int64_t>(conn.output_bytes));
+  buffered_conns_.erase(conn_id);
+}
+
+void ProxyInstance::SweepBuffers() {
+  PROXY_LOOP_CALLBACK("ProxyInstance::SweepBuffers");
+  size_t freed = 0;
+  if (proxy_conn_->getLoop() == loop_) {
+    freed += BufferSweeper::ShrinkConnection(proxy_conn_);
+  }
+  for (const auto &item : conn_map_) {
+    const muduo::net::TcpConnectionPtr &conn = item.second.conn;
+    if (conn->getLoop() == loop_) {
+      freed += BufferSweeper::ShrinkConnection(conn);
+    }
+  }
+  freed += BufferSweeper::TrimSlabs();
+  if (freed) {
+    LOG_DEBUG << "sweep buffers, freed:" << freed;
+  }
+  BufferSweeper::ReturnFreed(freed);
+}
+
 void ProxyInstance::EntryPauseSend(MessagePtr, uint64_t conn_id) {}
 
 void ProxyInstance::EntryResumeSend(MessagePtr, uint64_t conn_id) {}
@@ -6,54 +6,135 @@
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/TcpConnection.h>
 
-#include <map>
 #include <memory>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include "Acceptor.h"
 #include "TcpServer.h"
+#include "common/bdp_tuner.h"
+#include "common/buffer_sweeper.h"
+#include "common/chain_buffer.h"
+#include "common/conn_trace.h"
+#include "common/memory_budget.h"
+#include "common/slot_map.h"
 #include "common/message_dispatch.h"
+#include "common/stream_throttler.h"
+#include "common/tunnel_liveness.h"
+
+// Connection::trace的时间点, 和ProxyInstance::trace_stats_中名字的顺序一致
+enum ServerTracePoint {
+  SERVER_TRACE_ACCEPT,          // accept返回
+  SERVER_TRACE_REGISTER,        // 分配conn_id, 发出NEW_CONNECTION_REQUEST
+  SERVER_TRACE_TUNNEL_ACK,      // 收到proxy client连接后端成功的响应
+  SERVER_TRACE_FIRST_REQUEST,   // 第一次转发客户端数据
+  SERVER_TRACE_FIRST_RESPONSE,  // 第一次收到后端返回的数据
+};
 
 struct Connection {
   explicit Connection(muduo::net::TcpConnectionPtr conn)
-      : conn(conn), proxy_accept(false), server_block(false) {}
+      : conn(conn),
+        proxy_accept(false),
+        server_block(false),
+        pending_full(false),
+        output_bytes(0) {}
   Connection() = default;
   Connection(const Connection &) = default;
   muduo::net::TcpConnectionPtr conn;
   bool proxy_accept;
   bool server_block;  // 标识真实server对应的连接是否block
-  std::vector<std::string> pending_message;
+  // proxy client接受连接之前读到的数据, 满了之后停止读客户端连接
+  ChainBuffer pending_message;
+  bool pending_full;
+  // 最近一次采样的输出缓冲字节数, 已计入MemoryAccount
+  size_t output_bytes;
+  ConnTrace trace;
+};
+
+// 绑定到客户端连接的回调中, 直接访问conn_map_中的连接状态
+typedef SlotRef<Connection> ConnectionRef;
+
+// 实例的转发统计, 只在loop_中更新和读取
+struct InstanceStats {
+  // 接受的客户端连接数
+  uint64_t accepted = 0;
+  // 从客户端连接读到的字节数
+  uint64_t client_bytes_in = 0;
+  // 写给客户端连接的字节数
+  uint64_t client_bytes_out = 0;
+  // 停止/恢复读客户端连接的次数
+  uint64_t pauses = 0;
+  uint64_t resumes = 0;
 };
 
 typedef std::function<void()> StopCb;
+typedef std::function<void(uint64_t session_key,
+                           const muduo::net::TcpConnectionPtr &,
+                           ProxyMessagePtr request_head, MessagePtr message)>
+    ResumeCb;
 
 class ProxyInstance : public std::enable_shared_from_this<ProxyInstance> {
  public:
+  // session_grace: proxy连接断开后会话保留的时间(s), 0表示不支持恢复
   ProxyInstance(muduo::net::EventLoop *loop,
-                const muduo::net::TcpConnectionPtr &conn);
+                const muduo::net::TcpConnectionPtr &conn,
+                double session_grace = 0);
   ~ProxyInstance();
   void Init();
   void Stop(StopCb cb);
+  // proxy连接断开, 保留会话等待proxy client重连, 返回false表示不能保留
+  // 超时后调用expire_cb
+  bool Detach(StopCb expire_cb);
+  // 在新的proxy连接上恢复会话
+  void Resume(const muduo::net::TcpConnectionPtr &conn,
+              ProxyMessagePtr request_head, MessagePtr message);
+  // 恢复会话失败, 通知proxy client
+  void ResumeFailed(ProxyMessagePtr request_head, MessagePtr message);
+  bool Resumable() const { return detached_ && proxy_client_connect_; }
+  uint64_t SessionKey() const { return session_key_; }
+  size_t ConnectionCount() const { return conn_map_.size(); }
+  uint16_t ListenPort() const { return listen_addr_.port(); }
+  const InstanceStats &Stats() const { return stats_; }
+  const ConnTraceStats &TraceStats() const { return trace_stats_; }
+  // Stop之后为nullptr, 实例要等客户端连接全部关闭才会删除
+  const MessageDispatch *Dispatcher() const { return dispatcher_.get(); }
+  const TunnelLiveness *Liveness() const { return liveness_.get(); }
+  const BdpTuner *Tuner() const { return bdp_tuner_.get(); }
+  const StreamThrottler &Throttler() const { return *throttler_; }
+  const MemoryAccount &Memory() const { return memory_; }
+  // proxy连接输出缓冲中还未发出的字节数
+  size_t TunnelOutputBytes() const;
+  const muduo::net::TcpConnectionPtr &ProxyConn() const { return proxy_conn_; }
+  void SetResumeCb(ResumeCb cb) { resume_cb_ = std::move(cb); }
   void OnMessage(const muduo::net::TcpConnectionPtr &conn,
                  muduo::net::Buffer *buf, muduo::Timestamp time) {
     dispatcher_->OnMessage(conn, buf, time);
   }
   void OnNewConnection(int sockfd, const muduo::net::InetAddress &);
-  void OnClientConnection(const muduo::net::TcpConnectionPtr &);
+  // 客户端连接的回调都绑定了stream, 不再通过context和conn_id查找连接
+  void OnClientConnection(const muduo::net::TcpConnectionPtr &,
+                          ConnectionRef stream);
   void OnClientMessage(const muduo::net::TcpConnectionPtr &,
-                       muduo::net::Buffer *, muduo::Timestamp);
-  void OnClientClose(const muduo::net::TcpConnectionPtr &);
+                       muduo::net::Buffer *, muduo::Timestamp,
+                       ConnectionRef stream);
+  void OnClientClose(const muduo::net::TcpConnectionPtr &,
+                     ConnectionRef stream);
   void EntryAddConnection(MessagePtr message,
-                          const muduo::net::TcpConnectionPtr &);
-  void AddConnectionTimeout(const muduo::net::TcpConnectionPtr &);
+                          const muduo::net::TcpConnectionPtr &,
+                          ConnectionRef stream);
+  void AddConnectionTimeout(const muduo::net::TcpConnectionPtr &,
+                            ConnectionRef stream);
+  // 封装成DATA_REQUEST发给proxy client, stream必须还存在
+  void ForwardClientData(const muduo::net::TcpConnectionPtr &conn,
+                         ConnectionRef stream, std::string data);
   void EntryData(const muduo::net::TcpConnectionPtr &conn, ProxyMessagePtr,
-                 const muduo::net::TcpConnectionPtr &client_conn);
+                 const muduo::net::TcpConnectionPtr &client_conn,
+                 ConnectionRef stream);
   void EntryCloseConnection(MessagePtr, uint64_t conn_id);
   void EntryPauseSend(MessagePtr, uint64_t conn_id);
   void EntryResumeSend(MessagePtr, uint64_t conn_id);
   void EntryHeartBeat(MessagePtr);
-  uint64_t GetConnId();
   uint32_t GetSourceEntity();
   std::shared_ptr<ProxyInstance> this_ptr() { return shared_from_this(); }
 
@@ -75,31 +156,60 @@ class ProxyInstance : public std::enable_shared_from_this<ProxyInstance> {
   void RemoveConnecion(uint64_t conn_id);
   void StopClientRead(uint64_t conn_id = 0, bool server_block = false);
   void ResumeClientRead(uint64_t conn_id = 0, bool sever_block = false);
+  // proxy连接的stream为空
   void OnHighWaterMark(bool is_proxy_conn, const muduo::net::TcpConnectionPtr &,
-                       size_t);
-  void OnWriteComplete(bool is_proxy_conn,
-                       const muduo::net::TcpConnectionPtr &);
+                       size_t, ConnectionRef stream);
+  void OnWriteComplete(bool is_proxy_conn, const muduo::net::TcpConnectionPtr &,
+                       ConnectionRef stream);
   void CheckListen();
   void CheckStop();
   void SendHeartBeat();
+  // 空闲时发送心跳, 判定proxy连接断开时关闭连接
+  void StartLiveness();
+  // 按带宽时延积调整proxy连接和客户端连接的高水位
+  void StartBdpTuner();
+  void ApplyBdpSettings(const BdpSettings &settings);
+  // 采样输出缓冲, 超过内存预算时暂停发送最多的客户端连接
+  void CheckMemory();
+  // 采样客户端连接输出缓冲, 只能在连接自己的loop中读取
+  void SampleOutput(uint64_t conn_id, Connection *conn);
+  // 连接删除时归还缓存数据和输出缓冲占用的内存
+  void ReleaseMemory(uint64_t conn_id, const Connection &conn);
+  // 缩小proxy连接和客户端连接突发之后的缓冲
+  void SweepBuffers();
   muduo::net::EventLoop *loop_;
+  // 在dispatcher_之前构造, dispatcher_析构时还会使用
+  MemoryAccount memory_;
   std::unique_ptr<MessageDispatch> dispatcher_;
+  std::unique_ptr<TunnelLiveness> liveness_;
+  std::unique_ptr<BdpTuner> bdp_tuner_;
+  std::unique_ptr<StreamThrottler> throttler_;
   muduo::net::TcpConnectionPtr proxy_conn_;
   muduo::net::TimerId check_listen_timer_;
+  muduo::net::TimerId memory_timer_;
+  muduo::net::TimerId sweep_timer_;
+  // 输出缓冲不为空的客户端连接
+  std::unordered_set<uint64_t> buffered_conns_;
   // std::unique_ptr<TcpServer> server_;
 
   MessagePtr listen_response_msg_;
-  uint64_t conn_id_;
   uint32_t source_entity_;
   muduo::net::InetAddress listen_addr_;
-  std::map<uint64_t, Connection> conn_map_;
+  // conn_id由conn_map_分配, 包含slot下标和generation
+  SlotMap<Connection> conn_map_;
   // std::map<uint64_t, muduo::net::TcpConnectionPtr> conn_map_;
   // std::map<uint64_t, std::vector<std::string>> pending_message_;
   std::unique_ptr<Acceptor> acceptor_;
   std::shared_ptr<muduo::net::EventLoopThreadPool> thread_pool_;
   bool proxy_client_connect_;
-  muduo::net::TimerId heartbeat_timer_;
   StopCb stop_cb_;
+  double session_grace_;
+  uint64_t session_key_;
+  bool detached_;
+  muduo::net::TimerId grace_timer_;
+  ResumeCb resume_cb_;
+  InstanceStats stats_;
+  ConnTraceStats trace_stats_;
 };
 
 #endif  // SERVER_PROXY_INSTANCE_H_
@@ -3,45 +3,335 @@
 #include "server/proxy_server.h"
 
 #include <muduo/base/Logging.h>
+#include <muduo/net/SocketsOps.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/prometheus.h"
 
 ProxyServer::ProxyServer(muduo::net::EventLoop *loop,
-                         const muduo::net::InetAddress &listen_address)
-    : loop_(loop), listen_address_(listen_address) {}
+                         const muduo::net::InetAddress &listen_address,
+                         double session_grace)
+    : loop_(loop),
+      listen_address_(listen_address),
+      next_conn_id_(0),
+      session_grace_(session_grace) {}
 
 void ProxyServer::Start() {
-  server_.reset(new muduo::net::TcpServer(loop_, listen_address_, "server"));
-  server_->setConnectionCallback(
+  loop_monitor_.reset(new LoopMonitor(loop_, "proxy_server"));
+  loop_monitor_->Start();
+  acceptor_.reset(new Acceptor(loop_, listen_address_, false));
+  acceptor_->setNewConnectionCallback(
+      std::bind(&ProxyServer::OnNewConnection, this, std::placeholders::_1,
+                std::placeholders::_2));
+  std::pair<bool, std::string> result = acceptor_->listen();
+  if (!result.first) {
+    LOG_FATAL << "listen " << listen_address_.toIpPort()
+              << " failed:" << result.second;
+  }
+  if (metrics_address_) {
+    metrics_server_.reset(
+        new muduo::net::HttpServer(loop_, *metrics_address_, "metrics"));
+    metrics_server_->setHttpCallback(
+        std::bind(&ProxyServer::OnMetricsRequest, this, std::placeholders::_1,
+                  std::placeholders::_2));
+    metrics_server_->start();
+    LOG_INFO << "metrics listen on:" << metrics_address_->toIpPort();
+  }
+}
+
+void ProxyServer::EnableMetrics(const muduo::net::InetAddress &address) {
+  metrics_address_.reset(new muduo::net::InetAddress(address));
+}
+
+void ProxyServer::OnNewConnection(int sockfd,
+                                  const muduo::net::InetAddress &peer_addr) {
+  loop_->assertInLoopThread();
+  std::string conn_name = "server-" + listen_address_.toIpPort() + "#" +
+                          std::to_string(++next_conn_id_);
+  muduo::net::InetAddress local_addr(muduo::net::sockets::getLocalAddr(sockfd));
+  muduo::net::TcpConnectionPtr conn(std::make_shared<muduo::net::TcpConnection>(
+      loop_, conn_name, sockfd, local_addr, peer_addr));
+  // ConnectionFd通过context取得fd
+  conn->setContext(sockfd);
+  connections_[conn.get()] = conn;
+  conn->setConnectionCallback(
       std::bind(&ProxyServer::OnConnection, this, std::placeholders::_1));
-  server_->setMessageCallback(
+  conn->setMessageCallback(
       std::bind(&ProxyServer::OnMessage, this, std::placeholders::_1,
                 std::placeholders::_2, std::placeholders::_3));
-  server_->start();
+  conn->setCloseCallback(
+      std::bind(&ProxyServer::RemoveConnection, this, std::placeholders::_1));
+  conn->connectEstablished();
+}
+
+void ProxyServer::RemoveConnection(const muduo::net::TcpConnectionPtr &conn) {
+  loop_->assertInLoopThread();
+  connections_.erase(conn.get());
+  // connectDestroyed中调用OnConnection处理连接断开
+  loop_->queueInLoop(
+      std::bind(&muduo::net::TcpConnection::connectDestroyed, conn));
 }
 
 void ProxyServer::OnConnection(const muduo::net::TcpConnectionPtr &conn) {
+  PROXY_LOOP_CALLBACK("ProxyServer::OnConnection");
   if (proxy_instances_.find(conn.get()) == proxy_instances_.end()) {
     LOG_INFO << "new proxy client connection from:"
              << conn->peerAddress().toIpPort();
     std::shared_ptr<ProxyInstance> proxy_instance =
-        std::make_shared<ProxyInstance>(conn->getLoop(), conn);
+        std::make_shared<ProxyInstance>(conn->getLoop(), conn, session_grace_);
+    proxy_instance->SetResumeCb(std::bind(
+        &ProxyServer::ResumeSession, this, std::placeholders::_1,
+        std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
     proxy_instances_[conn.get()] = proxy_instance;
     proxy_instance->Init();
   } else {
     LOG_INFO << "proxy client connection close:"
              << conn->peerAddress().toIpPort();
-    proxy_instances_[conn.get()]->Stop(
+    std::shared_ptr<ProxyInstance> proxy_instance =
+        proxy_instances_[conn.get()];
+    uint64_t session_key = proxy_instance->SessionKey();
+    if (proxy_instance->Detach(
+            std::bind(&ProxyServer::OnSessionExpire, this, session_key))) {
+      // 保留会话, 等待proxy client重连
+      proxy_instances_.erase(conn.get());
+      detached_instances_[session_key] = proxy_instance;
+      return;
+    }
+    proxy_instance->Stop(
         std::bind(&ProxyServer::OnProxyInstanceStop, this, conn.get()));
   }
 }
 
 void ProxyServer::OnMessage(const muduo::net::TcpConnectionPtr &conn,
                             muduo::net::Buffer *buf, muduo::Timestamp time) {
+  PROXY_LOOP_CALLBACK("ProxyServer::OnMessage");
   auto index = proxy_instances_.find(conn.get());
   assert(index != proxy_instances_.end());
   (index->second)->OnMessage(conn, buf, time);
 }
 
+size_t ProxyServer::ConnectionCount() const {
+  size_t count = 0;
+  for (const auto &item : proxy_instances_) {
+    count += item.second->ConnectionCount();
+  }
+  for (const auto &item : detached_instances_) {
+    count += item.second->ConnectionCount();
+  }
+  return count;
+}
+
+uint64_t ProxyServer::DataFramesOut() const {
+  uint64_t count = 0;
+  // 已经Stop的实例不再统计
+  for (const auto &item : proxy_instances_) {
+    if (item.second->Dispatcher()) {
+      count += item.second->Dispatcher()->Stats().data_frames_out;
+    }
+  }
+  for (const auto &item : detached_instances_) {
+    if (item.second->Dispatcher()) {
+      count += item.second->Dispatcher()->Stats().data_frames_out;
+    }
+  }
+  return count;
+}
+
 void ProxyServer::OnProxyInstanceStop(muduo::net::TcpConnection *conn) {
   LOG_INFO << "proxy server stop finish " << conn->peerAddress().toIpPort();
   proxy_instances_.erase(conn);
 }
+
+void ProxyServer::ResumeSession(uint64_t session_key,
+                                const muduo::net::TcpConnectionPtr &conn,
+                                ProxyMessagePtr request_head,
+                                MessagePtr message) {
+  // 旧的proxy连接可能还没有检测到断开, 关闭后再恢复
+  for (auto &item : proxy_instances_) {
+    if (item.first != conn.get() &&
+        item.second->SessionKey() == session_key) {
+      LOG_INFO << "session:" << session_key
+               << " still attached, close old proxy connection";
+      item.second->ProxyConn()->forceClose();
+      break;
+    }
+  }
+  // 当前在新实例的消息处理中, 不能直接替换实例
+  loop_->queueInLoop(std::bind(&ProxyServer::ResumeSessionInLoop, this,
+                               session_key, conn, request_head, message));
+}
+
+void ProxyServer::ResumeSessionInLoop(uint64_t session_key,
+                                      const muduo::net::TcpConnectionPtr &conn,
+                                      ProxyMessagePtr request_head,
+                                      MessagePtr message) {
+  auto fresh_index = proxy_instances_.find(conn.get());
+  if (fresh_index == proxy_instances_.end() || !conn->connected()) {
+    LOG_WARN << "proxy connection closed before resume session:"
+             << session_key;
+    return;
+  }
+  std::shared_ptr<ProxyInstance> fresh_instance = fresh_index->second;
+  auto index = detached_instances_.find(session_key);
+  if (index == detached_instances_.end() || !(index->second)->Resumable()) {
+    LOG_WARN << "session:" << session_key << " not found, resume failed";
+    fresh_instance->ResumeFailed(request_head, message);
+    return;
+  }
+  std::shared_ptr<ProxyInstance> proxy_instance = index->second;
+  detached_instances_.erase(index);
+  fresh_index->second = proxy_instance;
+  fresh_instance->Stop(nullptr);
+  proxy_instance->Resume(conn, request_head, message);
+}
+
+void ProxyServer::OnSessionExpire(uint64_t session_key) {
+  auto index = detached_instances_.find(session_key);
+  if (index == detached_instances_.end()) {
+    return;
+  }
+  (index->second)
+      ->Stop(std::bind(&ProxyServer::OnDetachedInstanceStop, this,
+                       session_key));
+}
+
+void ProxyServer::OnDetachedInstanceStop(uint64_t session_key) {
+  LOG_INFO << "detached session:" << session_key << " stop finish";
+  // 在实例的stop回调中, 延后释放
+  loop_->queueInLoop(
+      [this, session_key] { detached_instances_.erase(session_key); });
+}
+
+void ProxyServer::OnMetricsRequest(const muduo::net::HttpRequest &request,
+                                   muduo::net::HttpResponse *response) {
+  if (request.path() != "/metrics") {
+    response->setStatusCode(muduo::net::HttpResponse::k404NotFound);
+    response->setStatusMessage("Not Found");
+    response->setCloseConnection(true);
+    return;
+  }
+  response->setStatusCode(muduo::net::HttpResponse::k200Ok);
+  response->setStatusMessage("OK");
+  response->setContentType("text/plain; version=0.0.4");
+  response->setBody(CollectMetrics());
+}
+
+std::string ProxyServer::CollectMetrics() const {
+  PrometheusWriter writer;
+  writer.AddGauge("proxy_server_instances", "Proxy client sessions",
+                  "state=\"attached\"", proxy_instances_.size());
+  writer.AddGauge("proxy_server_instances", "Proxy client sessions",
+                  "state=\"detached\"", detached_instances_.size());
+  std::vector<std::pair<const ProxyInstance *, const char *>> instances;
+  for (const auto &item : proxy_instances_) {
+    instances.emplace_back(item.second.get(), "attached");
+  }
+  for (const auto &item : detached_instances_) {
+    instances.emplace_back(item.second.get(), "detached");
+  }
+  for (const auto &item : instances) {
+    const ProxyInstance &instance = *item.first;
+    std::string labels = "listen_port=\"" +
+                         std::to_string(instance.ListenPort()) +
+                         "\",state=\"" + item.second + "\"";
+    const InstanceStats &stats = instance.Stats();
+    writer.AddGauge("proxy_active_streams", "Public connections in conn_map",
+                    labels, instance.ConnectionCount());
+    writer.AddCounter("proxy_streams_accepted_total",
+                      "Public connections accepted", labels, stats.accepted);
+    writer.AddCounter("proxy_public_bytes_in_total",
+                      "Bytes read from public connections and forwarded",
+                      labels, stats.client_bytes_in);
+    writer.AddCounter("proxy_public_bytes_out_total",
+                      "Bytes written to public connections", labels,
+                      stats.client_bytes_out);
+    writer.AddGauge("proxy_tunnel_output_buffer_bytes",
+                    "Bytes queued in the tunnel output buffer", labels,
+                    instance.TunnelOutputBytes());
+    writer.AddCounter("proxy_stream_pauses_total",
+                      "Times a public connection stopped reading", labels,
+                      stats.pauses);
+    writer.AddCounter("proxy_stream_resumes_total",
+                      "Times a public connection resumed reading", labels,
+                      stats.resumes);
+    // Stop之后等待客户端连接关闭的实例没有dispatcher, 不输出隧道统计
+    if (instance.Dispatcher()) {
+      const MessageDispatch &dispatcher = *instance.Dispatcher();
+      const DispatchStats &dispatch_stats = dispatcher.Stats();
+      writer.AddCounter("proxy_tunnel_frames_in_total",
+                        "Frames received on the tunnel", labels,
+                        dispatch_stats.frames_in);
+      writer.AddCounter("proxy_tunnel_frames_out_total",
+                        "Frames sent on the tunnel", labels,
+                        dispatch_stats.frames_out);
+      writer.AddCounter("proxy_tunnel_bytes_in_total",
+                        "Bytes received on the tunnel", labels,
+                        dispatch_stats.bytes_in);
+      writer.AddCounter("proxy_tunnel_bytes_out_total",
+                        "Bytes sent on the tunnel", labels,
+                        dispatch_stats.bytes_out);
+      writer.AddGauge("proxy_dispatch_inflight_requests",
+                      "Requests waiting for a response", labels,
+                      dispatcher.InflightRequests());
+      writer.AddGauge("proxy_dispatch_pending_bytes",
+                      "Bytes of requests waiting for a response", labels,
+                      dispatcher.PendingBytes());
+      writer.AddCounter("proxy_dispatch_retries_total", "Requests resent",
+                        labels, dispatch_stats.retries);
+      writer.AddCounter("proxy_dispatch_timeouts_total",
+                        "Requests timed out or dropped", labels,
+                        dispatch_stats.timeouts);
+      writer.AddHistogram("proxy_tunnel_rtt_us",
+                          "Time from sending a request to its response",
+                          labels, dispatch_stats.rtt_us);
+      writer.AddGauge("proxy_tunnel_srtt_us",
+                      "Smoothed tunnel round trip time", labels,
+                      dispatch_stats.rtt.SrttUs());
+      writer.AddGauge("proxy_tunnel_rttvar_us",
+                      "Tunnel round trip time variation", labels,
+                      dispatch_stats.rtt.RttvarUs());
+    }
+    if (instance.Liveness()) {
+      const TunnelLiveness &liveness = *instance.Liveness();
+      writer.AddGauge("proxy_tunnel_dead_deadline_us",
+                      "Silence after which the tunnel is declared dead",
+                      labels, liveness.DeadlineUs());
+      writer.AddCounter("proxy_tunnel_pings_total",
+                        "Pings sent because the tunnel was idle", labels,
+                        liveness.Pings());
+      writer.AddCounter("proxy_tunnel_dead_total",
+                        "Times the tunnel was declared dead", labels,
+                        liveness.Deaths());
+    }
+    if (instance.Tuner()) {
+      const BdpTuner &tuner = *instance.Tuner();
+      writer.AddGauge("proxy_tunnel_bdp_bytes",
+                      "Estimated bandwidth-delay product of the tunnel",
+                      labels, tuner.BdpBytes());
+      writer.AddGauge("proxy_tunnel_high_water_bytes",
+                      "Tunnel output buffer high-water mark", labels,
+                      tuner.Current().tunnel_high_water);
+      writer.AddGauge("proxy_stream_high_water_bytes",
+                      "Public connection output buffer high-water mark",
+                      labels, tuner.Current().stream_high_water);
+    }
+    writer.AddGauge("proxy_throttled_streams",
+                    "Public connections paused because the tunnel is full",
+                    labels, instance.Throttler().PausedCount());
+    writer.AddCounter("proxy_throttle_pauses_total",
+                      "Public connections paused on tunnel high water", labels,
+                      instance.Throttler().Pauses());
+    writer.AddConnTraceStats(instance.TraceStats(), labels);
+    writer.AddMemoryAccount(instance.Memory(), labels);
+  }
+  writer.AddMemoryBudget(MemoryBudget::Global());
+  writer.AddSlabPoolStats();
+  writer.AddBufferSweeperStats();
+  if (loop_monitor_) {
+    writer.AddLoopStats(loop_monitor_->GetStats());
+  }
+  return writer.ToString();
+}
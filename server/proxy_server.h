@@ -5,29 +5,69 @@
 #include <muduo/base/Timestamp.h>
 #include <muduo/net/Callbacks.h>
 #include <muduo/net/EventLoop.h>
-#include <muduo/net/TcpServer.h>
+#include <muduo/net/http/HttpRequest.h>
+#include <muduo/net/http/HttpResponse.h>
+#include <muduo/net/http/HttpServer.h>
 
 #include <map>
 #include <memory>
+#include <string>
 
+#include "Acceptor.h"
+#include "common/loop_monitor.h"
 #include "server/proxy_instance.h"
 
 class ProxyServer {
  public:
-  explicit ProxyServer(muduo::net::EventLoop *loop,
-                       const muduo::net::InetAddress &listen_address);
+  // session_grace: proxy client断开后会话保留的时间(s), 0表示不保留
+  ProxyServer(muduo::net::EventLoop *loop,
+              const muduo::net::InetAddress &listen_address,
+              double session_grace = 30.0);
+  // 在Start之前调用, Start时在address上提供Prometheus格式的/metrics
+  void EnableMetrics(const muduo::net::InetAddress &address);
   void Start();
+  void OnNewConnection(int sockfd, const muduo::net::InetAddress &peer_addr);
   void OnConnection(const muduo::net::TcpConnectionPtr &conn);
   void OnMessage(const muduo::net::TcpConnectionPtr &conn,
                  muduo::net::Buffer *buf, muduo::Timestamp);
   void OnProxyInstanceStop(muduo::net::TcpConnection *);
+  // 所有实例的客户端连接数, 在loop_中调用
+  size_t ConnectionCount() const;
+  // 所有实例发出的DATA_REQUEST帧数, 在loop_中调用
+  uint64_t DataFramesOut() const;
+  // Start之后有效, 在loop_中调用
+  const LoopMonitor *GetLoopMonitor() const { return loop_monitor_.get(); }
 
  private:
+  void ResumeSession(uint64_t session_key,
+                     const muduo::net::TcpConnectionPtr &conn,
+                     ProxyMessagePtr request_head, MessagePtr message);
+  void ResumeSessionInLoop(uint64_t session_key,
+                           const muduo::net::TcpConnectionPtr &conn,
+                           ProxyMessagePtr request_head, MessagePtr message);
+  void RemoveConnection(const muduo::net::TcpConnectionPtr &conn);
+  void OnSessionExpire(uint64_t session_key);
+  void OnDetachedInstanceStop(uint64_t session_key);
+  void OnMetricsRequest(const muduo::net::HttpRequest &request,
+                        muduo::net::HttpResponse *response);
+  // 抓取时在loop_中汇总, 转发路径上只做无锁的计数
+  std::string CollectMetrics() const;
+
   muduo::net::EventLoop *loop_;
   muduo::net::InetAddress listen_address_;
-  std::unique_ptr<muduo::net::TcpServer> server_;
+  // 自己accept proxy连接, context设置为socket fd, 用于writev和设置socket选项
+  std::unique_ptr<Acceptor> acceptor_;
+  std::map<muduo::net::TcpConnection *, muduo::net::TcpConnectionPtr>
+      connections_;
+  uint64_t next_conn_id_;
+  std::unique_ptr<LoopMonitor> loop_monitor_;
+  std::unique_ptr<muduo::net::InetAddress> metrics_address_;
+  std::unique_ptr<muduo::net::HttpServer> metrics_server_;
   std::map<muduo::net::TcpConnection *, std::shared_ptr<ProxyInstance>>
       proxy_instances_;
+  double session_grace_;
+  // session_key => proxy连接断开, 等待恢复的实例
+  std::map<uint64_t, std::shared_ptr<ProxyInstance>> detached_instances_;
 };
 
 #endif  // SERVER_PROXY_SERVER_H_
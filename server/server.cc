@@ -1,9 +1,10 @@
 // Copyright [2020] zhangke
 #include <muduo/base/Logging.h>
-#include <muduo/base/LogFile.h>
 #include <muduo/net/EventLoop.h>
 #include <muduo/net/InetAddress.h>
 
+#include "common/async_logger.h"
+#include "common/memory_budget.h"
 #include "server/proxy_server.h"
 
 void PrintUsage(const char *command) {
@@ -11,26 +12,32 @@ void PrintUsage(const char *command) {
             << " -s listen_address"
             << " -p listen_port"
             << " -l log_level[trace/debug/info/warn]"
+            << " -g session_grace_seconds(default 30, 0 disable resume)"
+            << " -m metrics_port(default 0, disable)"
+            << " -b memory_budget_mb(default 0, unlimited)"
             << " -h help" << std::endl;
 }
 
-std::unique_ptr<muduo::LogFile> g_logFile;
+std::unique_ptr<AsyncLogger> g_async_logger;
 
 void outputFunc(const char* msg, int len) {
-  g_logFile->append(msg, len);
+  g_async_logger->Append(msg, len);
 }
 
 void flushFunc() {
-  g_logFile->flush();
+  g_async_logger->Flush();
 }
 
 
 int main(int argc, char *argv[]) {
   const char *listen_address_p = nullptr, *level_str = nullptr;
-  muduo::Logger::LogLevel log_level = muduo::Logger::DEBUG;
+  muduo::Logger::LogLevel log_level = muduo::Logger::INFO;
   uint16_t listen_port = 0;
   int port = 0, ch = 0;
-  while ((ch = getopt(argc, argv, "s:p:l:h")) != -1) {
+  double session_grace = 30.0;
+  uint16_t metrics_port = 0;
+  int64_t memory_budget_mb = 0;
+  while ((ch = getopt(argc, argv, "s:p:l:g:m:b:h")) != -1) {
     switch (ch) {
       case 's':
         listen_address_p = optarg;
@@ -59,6 +66,31 @@ int main(int argc, char *argv[]) {
         }
         std::cout << "log level:" << log_level << std::endl;
         break;
+      case 'g':
+        session_grace = atof(optarg);
+        if (session_grace < 0) {
+          std::cout << "invalid session grace:" << optarg << std::endl;
+          exit(1);
+        }
+        std::cout << "session grace:" << session_grace << std::endl;
+        break;
+      case 'm':
+        port = atoi(optarg);
+        if (port <= 0 || port >= 65535) {
+          std::cout << "invalid metrics port:" << port << std::endl;
+          exit(1);
+        }
+        metrics_port = static_cast<uint16_t>(port);
+        std::cout << "metrics_port:" << metrics_port << std::endl;
+        break;
+      case 'b':
+        memory_budget_mb = atoll(optarg);
+        if (memory_budget_mb < 0) {
+          std::cout << "invalid memory budget:" << optarg << std::endl;
+          exit(1);
+        }
+        std::cout << "memory budget:" << memory_budget_mb << "MB" << std::endl;
+        break;
       case 'h':
         PrintUsage(argv[0]);
         exit(0);
@@ -78,11 +110,19 @@ int main(int argc, char *argv[]) {
   muduo::net::InetAddress address(listen_address_p, listen_port);
    char name[256] = {0};
   strncpy(name, argv[0], sizeof(name) - 1);
-  g_logFile.reset(new muduo::LogFile(::basename(name), 10*1024*1024, true, 1, 1));
+  // 日志由后台线程写文件, 不阻塞io线程
+  g_async_logger.reset(new AsyncLogger(::basename(name), 10 * 1024 * 1024));
+  g_async_logger->Start();
   muduo::Logger::setLogLevel(log_level);
   muduo::Logger::setOutput(outputFunc);
   muduo::Logger::setFlush(flushFunc);
-  ProxyServer proxy_server(&loop, address);
+  MemoryBudget::Global().SetLimit(static_cast<size_t>(memory_budget_mb) << 20);
+  ProxyServer proxy_server(&loop, address, session_grace);
+  if (metrics_port) {
+    // metrics和代理服务监听同一个地址
+    proxy_server.EnableMetrics(
+        muduo::net::InetAddress(listen_address_p, metrics_port));
+  }
   proxy_server.Start();
   loop.loop();
   return 0;